@@ -0,0 +1,572 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+// Load generator for the enforcer. Simulates client endpoints that register
+// for, receive ups and downs from, and cancel a set of targets at an
+// enforcer, and reports what the enforcer sustained. Meant to be run against
+// enforcer/fake_enforcer, whose "alive-<n>" targets report up every 100 ms
+// and go down when killed.
+//
+// Phases, in order:
+//   register - every client registers for every target (clients * targets
+//              calls, window outstanding at a time)
+//   steady   - the clients sit idle and count CLIENT_UP messages
+//   down     - the first kills targets are killed with SPY_KILL; latency is
+//              measured from the kill to each client's CLIENT_DOWN
+//   cancel   - the clients cancel all remaining registrations
+//
+// Each phase prints one line of key=value pairs, including the enforcer's
+// CPU time and RSS when its pid is known, so runs of different builds can be
+// compared with a script. The enforcer's own SPY_STATS follow at the end.
+//
+// usage: load_gen [-e enforcer binary | -p enforcer pid] [-H host]
+//                 [-c clients] [-t targets] [-k kills] [-w window]
+//                 [-s steady seconds] [-u up interval ms]
+//                 [-d detection deadline ms]
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <arpc.h>
+#include <async.h>
+
+#include "common.h"
+#include "client_prot.h"
+#include "spy_prot.h"
+
+namespace {
+
+// How long to wait for stragglers before a phase gives up on them
+const int kPhaseTimeoutS = 30;
+
+struct options {
+    options() : enforcer_path(NULL), enforcer_pid(-1), host("127.0.0.1"),
+                clients(16), targets(256), kills(0), window(64), steady_s(5),
+                up_interval_ms(100), deadline_ms(0) {}
+    const char* enforcer_path;
+    pid_t       enforcer_pid;
+    const char* host;
+    uint32_t    clients;
+    uint32_t    targets;
+    uint32_t    kills;
+    uint32_t    window;
+    int         steady_s;
+    int32_t     up_interval_ms;
+    uint32_t    deadline_ms;
+};
+
+// CPU time (s) and resident set (kB) of a process
+struct proc_usage {
+    double      cpu_s;
+    long        rss_kb;
+};
+
+// A batch of identical calls kept window deep until all have completed
+struct phase {
+    const char*     name;
+    size_t          total;
+    size_t          issued;
+    size_t          done;
+    size_t          failed;
+    double          start;
+    proc_usage      usage;
+    void            (*issue)(size_t op);
+    void            (*finish)();
+};
+
+options                         opts;
+ptr<aclnt>                      enforcer;
+std::vector<sockaddr_in>        client_addrs;
+std::vector<ptr<asrv> >         client_srvs;
+std::vector<rpc_vec<gen_no, RPC_INFINITY> > generations;
+std::vector<double>             kill_time;
+std::vector<double>             down_latency;
+phase                           current;
+timecb_t*                       phase_timeout;
+uint64_t                        ups;
+uint64_t                        downs;
+uint64_t                        heartbeats;
+
+double
+Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + kNanosecondsToSeconds * ts.tv_nsec;
+}
+
+proc_usage
+EnforcerUsage() {
+    proc_usage u = {0, 0};
+    if (opts.enforcer_pid < 0) return u;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", opts.enforcer_pid);
+    FILE* f = fopen(path, "r");
+    if (f) {
+        unsigned long utime = 0, stime = 0;
+        // Fields 14 and 15; the command name (field 2) has no spaces here
+        if (2 == fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u "
+                        "%*u %*u %lu %lu", &utime, &stime)) {
+            u.cpu_s = (utime + stime) / static_cast<double>(
+                      sysconf(_SC_CLK_TCK));
+        }
+        fclose(f);
+    }
+    snprintf(path, sizeof(path), "/proc/%d/status", opts.enforcer_pid);
+    f = fopen(path, "r");
+    if (f) {
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            if (1 == sscanf(line, "VmRSS: %ld", &u.rss_kb)) break;
+        }
+        fclose(f);
+    }
+    return u;
+}
+
+// Prints the common part of a phase's report line
+void
+ReportPhase(size_t ops) {
+    double elapsed = Now() - current.start;
+    proc_usage u = EnforcerUsage();
+    printf("phase=%s clients=%u targets=%u ops=%zu failed=%zu elapsed_s=%.3f "
+           "ops_per_s=%.1f enforcer_cpu_s=%.3f enforcer_rss_kb=%ld",
+           current.name, opts.clients, opts.targets, ops, current.failed,
+           elapsed, ops / elapsed, u.cpu_s - current.usage.cpu_s, u.rss_kb);
+}
+
+void
+StartPhase(const char* name, size_t total, void (*issue)(size_t),
+           void (*finish)());
+
+void
+Pump() {
+    while (current.issued < current.total &&
+           current.issued - current.done < opts.window) {
+        current.issue(current.issued++);
+    }
+}
+
+void
+OpDone(bool ok) {
+    current.done++;
+    if (!ok) current.failed++;
+    if (current.done == current.total) {
+        current.finish();
+    } else {
+        Pump();
+    }
+}
+
+void
+StartPhase(const char* name, size_t total, void (*issue)(size_t),
+           void (*finish)()) {
+    current.name = name;
+    current.total = total;
+    current.issued = 0;
+    current.done = 0;
+    current.failed = 0;
+    current.start = Now();
+    current.usage = EnforcerUsage();
+    current.issue = issue;
+    current.finish = finish;
+    if (total == 0) {
+        finish();
+        return;
+    }
+    Pump();
+}
+
+str
+TargetName(uint32_t target) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "alive-%u", target);
+    return str(buf);
+}
+
+// Target index of a handle, or -1
+int
+TargetIndex(const str& handle) {
+    unsigned idx;
+    if (1 != sscanf(handle.cstr(), "alive-%u", &idx) || idx >= opts.targets) {
+        return -1;
+    }
+    return idx;
+}
+
+void
+FillClient(uint32_t client, client_addr_t* addr) {
+    addr->ipaddr = client_addrs[client].sin_addr.s_addr;
+    addr->port = client_addrs[client].sin_port;
+    addr->client_tag = 0;
+}
+
+void Done();
+void StartRegister();
+void StartSteady();
+void StartDown();
+void StartCancel();
+
+// Learn each target's generation first, so that registrations pass the
+// enforcer's generation check
+void
+GetGenDone(uint32_t target, ref<spy_res> res, clnt_stat st) {
+    bool ok = (st == RPC_SUCCESS && res->status == FALCON_GEN_RESP);
+    if (ok) {
+        generations[target] = res->target.generation;
+    }
+    OpDone(ok);
+}
+
+void
+IssueGetGen(size_t op) {
+    ref<spy_get_gen_arg> arg = New refcounted<spy_get_gen_arg>;
+    ref<spy_res> res = New refcounted<spy_res>;
+    arg->target.handle = TargetName(op);
+    enforcer->call(SPY_GET_GEN, arg, res, wrap(GetGenDone, op, res));
+}
+
+void
+FinishGetGen() {
+    if (current.failed) {
+        fprintf(stderr, "%zu targets are unknown to the enforcer\n",
+                current.failed);
+        Done();
+        return;
+    }
+    StartRegister();
+}
+
+void
+RegisterDone(ref<spy_res> res, clnt_stat st) {
+    OpDone(st == RPC_SUCCESS && res->status == FALCON_REGISTER_ACK);
+}
+
+void
+IssueRegister(size_t op) {
+    uint32_t client = op / opts.targets;
+    uint32_t target = op % opts.targets;
+    ref<spy_register_arg> arg = New refcounted<spy_register_arg>;
+    ref<spy_res> res = New refcounted<spy_res>;
+    arg->target.handle = TargetName(target);
+    arg->target.generation = generations[target];
+    arg->lethal = true;
+    arg->up_interval_ms = opts.up_interval_ms;
+    arg->deadline_ms = opts.deadline_ms;
+    FillClient(client, &arg->client);
+    enforcer->call(SPY_REGISTER, arg, res, wrap(RegisterDone, res));
+}
+
+void
+FinishRegister() {
+    ReportPhase(current.done);
+    printf("\n");
+    StartSteady();
+}
+
+void
+FinishSteady() {
+    current.failed = 0;
+    ReportPhase(ups);
+    printf(" ups=%llu ups_per_s=%.1f heartbeats=%llu\n",
+           static_cast<unsigned long long>(ups),
+           ups / (Now() - current.start),
+           static_cast<unsigned long long>(heartbeats));
+    StartDown();
+}
+
+void
+StartSteady() {
+    current.name = "steady";
+    current.start = Now();
+    current.usage = EnforcerUsage();
+    ups = 0;
+    delaycb(opts.steady_s, 0, wrap(FinishSteady));
+}
+
+void
+KillDone(ref<spy_res> res, clnt_stat st) {
+    // Completion is counted by the downs that arrive
+    if (st != RPC_SUCCESS || res->status != FALCON_KILL_ACK) {
+        current.failed++;
+    }
+}
+
+void
+FinishDown() {
+    if (phase_timeout) {
+        timecb_remove(phase_timeout);
+        phase_timeout = NULL;
+    }
+    std::sort(down_latency.begin(), down_latency.end());
+    size_t n = down_latency.size();
+    ReportPhase(n);
+    printf(" kills=%u downs_expected=%zu downs=%zu", opts.kills,
+           current.total, n);
+    const double kPercentiles[] = {50, 90, 99, 99.9};
+    const char* kNames[] = {"p50", "p90", "p99", "p999"};
+    for (int i = 0; i < 4; ++i) {
+        double v = n ? down_latency[std::min(n - 1,
+                       static_cast<size_t>(kPercentiles[i] / 100 * n))] : 0;
+        printf(" down_%s_us=%.1f", kNames[i], v * 1e6);
+    }
+    printf(" down_max_us=%.1f\n", n ? down_latency[n - 1] * 1e6 : 0);
+    StartCancel();
+}
+
+void
+DownTimeout() {
+    phase_timeout = NULL;
+    current.failed += current.total - down_latency.size();
+    FinishDown();
+}
+
+void
+StartDown() {
+    current.name = "down";
+    current.total = static_cast<size_t>(opts.kills) * opts.clients;
+    current.failed = 0;
+    current.start = Now();
+    current.usage = EnforcerUsage();
+    down_latency.reserve(current.total);
+    if (current.total == 0) {
+        FinishDown();
+        return;
+    }
+    phase_timeout = delaycb(kPhaseTimeoutS, 0, wrap(DownTimeout));
+    for (uint32_t target = 0; target < opts.kills; ++target) {
+        ref<spy_kill_arg> arg = New refcounted<spy_kill_arg>;
+        ref<spy_res> res = New refcounted<spy_res>;
+        arg->target.handle = TargetName(target);
+        arg->target.generation = generations[target];
+        kill_time[target] = Now();
+        enforcer->call(SPY_KILL, arg, res, wrap(KillDone, res));
+    }
+}
+
+void
+CancelDone(ref<spy_res> res, clnt_stat st) {
+    OpDone(st == RPC_SUCCESS && res->status == FALCON_CANCEL_ACK);
+}
+
+void
+IssueCancel(size_t op) {
+    uint32_t live = opts.targets - opts.kills;
+    uint32_t client = op / live;
+    uint32_t target = opts.kills + op % live;
+    ref<spy_cancel_arg> arg = New refcounted<spy_cancel_arg>;
+    ref<spy_res> res = New refcounted<spy_res>;
+    arg->target.handle = TargetName(target);
+    arg->target.generation = generations[target];
+    FillClient(client, &arg->client);
+    enforcer->call(SPY_CANCEL, arg, res, wrap(CancelDone, res));
+}
+
+void
+FinishCancel() {
+    ReportPhase(current.done);
+    printf("\n");
+    Done();
+}
+
+void
+StartCancel() {
+    StartPhase("cancel",
+               static_cast<size_t>(opts.targets - opts.kills) * opts.clients,
+               IssueCancel, FinishCancel);
+}
+
+void
+StartRegister() {
+    StartPhase("register", static_cast<size_t>(opts.clients) * opts.targets,
+               IssueRegister, FinishRegister);
+}
+
+void
+PrintHistogram(const char* name, const spy_histogram& h) {
+    printf(" %s_count=%llu %s_mean_us=%.1f %s_max_us=%llu", name,
+           static_cast<unsigned long long>(h.count), name,
+           h.count ? static_cast<double>(h.total_us) / h.count : 0.0, name,
+           static_cast<unsigned long long>(h.max_us));
+}
+
+void
+StatsDone(ref<spy_stats_res> res, clnt_stat st) {
+    if (st == RPC_SUCCESS) {
+        const spy_target_stats& t = res->total;
+        printf("phase=enforcer_stats uptime_ms=%llu targets=%u clients=%u "
+               "registers=%u cancels=%u ups=%u downs=%u down_retries=%u "
+               "down_failures=%u heartbeat_failures=%u shed_queries=%u "
+               "shed_registers=%u shed_ups=%u",
+               static_cast<unsigned long long>(res->uptime_ms), res->targets,
+               res->clients, t.registers, t.cancels, t.ups, t.downs,
+               t.down_retries, t.down_failures, res->heartbeat_failures,
+               res->shed_queries, res->shed_registers, res->shed_ups);
+        PrintHistogram("probe_late", t.probe_late);
+        PrintHistogram("down_delivery", t.down_delivery);
+        printf("\n");
+    }
+    fflush(stdout);
+    if (opts.enforcer_path) {
+        kill(opts.enforcer_pid, SIGTERM);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+void
+Done() {
+    ref<spy_stats_arg> arg = New refcounted<spy_stats_arg>;
+    ref<spy_stats_res> res = New refcounted<spy_stats_res>;
+    enforcer->timedcall(5, SPY_STATS, arg, res, wrap(StatsDone, res));
+}
+
+void
+ReceivedDown(const client_down_arg& down) {
+    downs++;
+    int target = TargetIndex(down.handle);
+    if (target < 0 || kill_time[target] == 0) return;
+    down_latency.push_back(Now() - kill_time[target]);
+    if (strcmp(current.name, "down") == 0 &&
+        down_latency.size() == current.total) {
+        FinishDown();
+    }
+}
+
+void
+ClientDispatch(uint32_t client, svccb* sbp) {
+    switch (sbp->proc()) {
+        case CLIENT_NULL:
+            heartbeats++;
+            break;
+        case CLIENT_UP:
+            ups++;
+            break;
+        case CLIENT_UP_BATCH:
+            ups += sbp->Xtmpl getarg<client_up_batch_arg>()->ups.size();
+            break;
+        case CLIENT_DOWN:
+            ReceivedDown(*sbp->Xtmpl getarg<client_down_arg>());
+            break;
+        case CLIENT_DOWN_BATCH: {
+            client_down_batch_arg* arg =
+                sbp->Xtmpl getarg<client_down_batch_arg>();
+            for (size_t i = 0; i < arg->downs.size(); ++i) {
+                ReceivedDown(arg->downs[i]);
+            }
+            break;
+        }
+        default:
+            sbp->reject(PROC_UNAVAIL);
+            return;
+    }
+    sbp->reply(0);
+}
+
+void
+SetupClients() {
+    client_addrs.resize(opts.clients);
+    client_srvs.resize(opts.clients);
+    for (uint32_t i = 0; i < opts.clients; ++i) {
+        int fd = inetsocket(SOCK_DGRAM, 0, INADDR_LOOPBACK);
+        CHECK(fd >= 0);
+        make_async(fd);
+        close_on_exec(fd);
+        socklen_t len = sizeof(client_addrs[i]);
+        CHECK(0 == getsockname(fd, reinterpret_cast<sockaddr*>(
+                                   &client_addrs[i]), &len));
+        client_srvs[i] = asrv::alloc(axprt_dgram::alloc(fd), client_prog_1,
+                                     wrap(ClientDispatch, i));
+    }
+}
+
+void
+Start() {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kFalconPort);
+    CHECK(1 == inet_pton(AF_INET, opts.host, &addr.sin_addr));
+    int fd = inetsocket(SOCK_DGRAM, 0, 0);
+    CHECK(fd >= 0);
+    make_async(fd);
+    close_on_exec(fd);
+    enforcer = aclnt::alloc(axprt_dgram::alloc(fd), spy_prog_1,
+                            reinterpret_cast<sockaddr*>(&addr));
+    SetupClients();
+    StartPhase("get_gen", opts.targets, IssueGetGen, FinishGetGen);
+}
+
+void
+Usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-e enforcer binary | -p enforcer pid] "
+            "[-H host] [-c clients] [-t targets] [-k kills] [-w window] "
+            "[-s steady seconds] [-u up interval ms] "
+            "[-d detection deadline ms]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+}  // end anonymous namespace
+
+int
+main(int argc, char** argv) {
+    int c;
+    bool kills_set = false;
+    while ((c = getopt(argc, argv, "e:p:H:c:t:k:w:s:u:d:")) != -1) {
+        switch (c) {
+            case 'e': opts.enforcer_path = optarg; break;
+            case 'p': opts.enforcer_pid = atoi(optarg); break;
+            case 'H': opts.host = optarg; break;
+            case 'c': opts.clients = atoi(optarg); break;
+            case 't': opts.targets = atoi(optarg); break;
+            case 'k': opts.kills = atoi(optarg); kills_set = true; break;
+            case 'w': opts.window = atoi(optarg); break;
+            case 's': opts.steady_s = atoi(optarg); break;
+            case 'u': opts.up_interval_ms = atoi(optarg); break;
+            case 'd': opts.deadline_ms = atoi(optarg); break;
+            default: Usage(argv[0]);
+        }
+    }
+    if (!kills_set) opts.kills = std::max(1U, opts.targets / 10);
+    if (opts.clients == 0 || opts.targets == 0 || opts.window == 0 ||
+        opts.kills > opts.targets) {
+        Usage(argv[0]);
+    }
+    generations.resize(opts.targets);
+    kill_time.resize(opts.targets, 0);
+
+    async_init();
+    if (opts.enforcer_path) {
+        int devnull = open("/dev/null", O_RDWR);
+        CHECK(devnull >= 0);
+        const char* av[] = {opts.enforcer_path, NULL};
+        opts.enforcer_pid = spawn(opts.enforcer_path, av, devnull, devnull,
+                                  devnull);
+        CHECK(opts.enforcer_pid >= 0);
+        close(devnull);
+        // Give it time to bind its port
+        delaycb(1, 0, wrap(Start));
+    } else {
+        Start();
+    }
+    amain();
+    return EXIT_FAILURE;
+}
@@ -47,6 +47,7 @@ public:
         lethal(false),
         cb(NULL),
         e2etimeout(-1),
+        deadline_ms(0),
         done(false),
         target(NULL) {
             pthread_mutex_init(&lock, NULL);
@@ -54,13 +55,14 @@ public:
         }
 
     FalconRequest(const LayerIdList& h, void* cd, bool l,
-                  falcon_callback_fn cb, int32_t to) :
+                  falcon_callback_fn cb, int32_t to, uint32_t deadline) :
         type(START),
         idlist(h),
         client_data(cd),
         lethal(l),
         cb(cb),
         e2etimeout(to),
+        deadline_ms(deadline),
         done(false),
         target(NULL) {
             pthread_mutex_init(&lock, NULL);
@@ -96,6 +98,7 @@ public:
     const bool                  lethal;
     const falcon_callback_fn    cb;
     const int32_t               e2etimeout;
+    const uint32_t              deadline_ms;
 
     bool                        done;
     falcon_target*              target;
@@ -141,6 +144,14 @@ start_svc(void*) {
     return NULL;
 }
 
+// A START request being built, one layer at a time from the top
+struct BuildState {
+    ReqPtr              req;
+    FalconCallbackPtr   cb;
+    FalconLayerPtr      layer;
+    ssize_t             next;
+};
+
 void*
 start_builder(void*) {
     // Builder will wait here until the constructor is finished.
@@ -148,42 +159,79 @@ start_builder(void*) {
     pthread_mutex_t* q_lock = &cl->queue_lock_;
     pthread_cond_t*  q_cond = &cl->queue_cond_;
     for (;;) {
+        // Take everything queued, so that children of the same layer can be
+        // added with one batch registration
+        std::vector<BuildState> builds;
         pthread_mutex_lock(q_lock);
         while (cl->request_q_.empty()) {
             pthread_cond_wait(q_cond, q_lock);
         }
-        ReqPtr req = cl->request_q_.front();
         client_addr_t addr = cl->addr_;
-        cl->request_q_.pop();
+        while (!cl->request_q_.empty()) {
+            ReqPtr req = cl->request_q_.front();
+            cl->request_q_.pop();
+            if (req->type == STOP) {
+                // TODO(leners):
+                // Find the where to cut the tree, and cut it. The watchdog
+                // will take care of cancellation.
+                continue;
+            }
+            BuildState b;
+            b.req = req;
+            b.cb = FalconCallbackPtr(new FalconCallback(req->cb, req->idlist,
+                                                        req->client_data));
+            b.layer = cl->base_layer_;
+            b.next = req->idlist.size() - 1;
+            builds.push_back(b);
+        }
         pthread_mutex_unlock(q_lock);
-        if (req->type == STOP) {
-            // TODO(leners):
-            // Find the where to cut the tree, and cut it. The watchdog will
-            // take care of cancellation.
-            continue;
-        } else {
-            FalconLayerPtr curr_layer = cl->base_layer_;
-            FalconCallbackPtr cb = FalconCallbackPtr(
-                                        new FalconCallback(req->cb,
-                                                           req->idlist,
-                                                           req->client_data));
-            // i == 0 when we are dealing with the App itself, in this case
-            // there is no need for a LayerId to be put in the catalog
-            ssize_t i;
-            for (i = req->idlist.size()-1; i >= 0 && curr_layer; --i) {
-                addr.client_tag = cl->GetNextLayerId();
-                curr_layer = curr_layer->AddChild(req->idlist[i], req->lethal,
-                                                  addr, req->e2etimeout,
-                                                  (i == 0), curr_layer, cb);
-                if (curr_layer && i != 0) {
-                    cl->AddLayer(addr.client_tag, curr_layer);
+
+        // One level per round. i == 0 is the App itself, in which case there
+        // is no need for a LayerId to be put in the catalog.
+        size_t active = builds.size();
+        while (active > 0) {
+            std::map<FalconLayer*, std::vector<size_t> > by_parent;
+            for (size_t j = 0; j < builds.size(); ++j) {
+                if (builds[j].layer && builds[j].next >= 0) {
+                    by_parent[builds[j].layer.get()].push_back(j);
                 }
             }
-            if (!curr_layer) {
-                (*cb)(req->idlist[i], REGISTRATION_ERROR, 0);
-            } else {
-                req->Complete(new falcon_target(cb, curr_layer));
-                LOG("successfully registered app!");
+            std::map<FalconLayer*, std::vector<size_t> >::iterator it;
+            for (it = by_parent.begin(); it != by_parent.end(); ++it) {
+                std::vector<ChildRequest> adds(it->second.size());
+                FalconLayerPtr parent = builds[it->second[0]].layer;
+                for (size_t k = 0; k < adds.size(); ++k) {
+                    BuildState& b = builds[it->second[k]];
+                    ssize_t i = b.next;
+                    addr.client_tag = cl->GetNextLayerId();
+                    adds[k].child = b.req->idlist[i];
+                    adds[k].killable = b.req->lethal;
+                    adds[k].addr = addr;
+                    adds[k].timeout = b.req->e2etimeout;
+                    adds[k].deadline_ms = b.req->deadline_ms;
+                    adds[k].leaf_layer = (i == 0);
+                    adds[k].cb = b.cb;
+                }
+                parent->AddChildren(&adds, parent);
+                for (size_t k = 0; k < adds.size(); ++k) {
+                    BuildState& b = builds[it->second[k]];
+                    ssize_t i = b.next;
+                    b.layer = adds[k].layer;
+                    if (!b.layer) {
+                        (*b.cb)(b.req->idlist[i], REGISTRATION_ERROR, 0);
+                        active--;
+                        continue;
+                    }
+                    if (i != 0) {
+                        cl->AddLayer(adds[k].addr.client_tag, b.layer);
+                    }
+                    b.next--;
+                    if (b.next < 0) {
+                        b.req->Complete(new falcon_target(b.cb, b.layer));
+                        LOG("successfully registered app!");
+                        active--;
+                    }
+                }
             }
         }
     }
@@ -288,9 +336,10 @@ FalconClient::FalconClient() {
 falcon_target*
 FalconClient::StartMonitoring(const LayerIdList& handle, bool lethal,
                               falcon_callback_fn cb, void* cd,
-                              int32_t e2etimeout) {
+                              int32_t e2etimeout, uint32_t deadline_ms) {
     pthread_mutex_lock(&queue_lock_);
-    ReqPtr req = ReqPtr(new FalconRequest(handle, cd, lethal, cb, e2etimeout));
+    ReqPtr req = ReqPtr(new FalconRequest(handle, cd, lethal, cb, e2etimeout,
+                                          deadline_ms));
     request_q_.push(req);
     pthread_cond_signal(&queue_cond_);
     pthread_mutex_unlock(&queue_lock_);
@@ -53,7 +53,8 @@ class FalconClient {
         // Start monitoring
         falcon_target* StartMonitoring(const LayerIdList& handle, bool lethal,
                                        falcon_callback_fn cb, void* client_data,
-                                       int32_t up_interval = kDefaultFalconInterval);
+                                       int32_t up_interval = kDefaultFalconInterval,
+                                       uint32_t deadline_ms = 0);
         // Stop Monitoring
         void StopMonitoring(const LayerIdList& handle);
 
@@ -19,7 +19,13 @@
 #include "FalconClient.h"
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <algorithm>
+#include <set>
 
 namespace {
 // RAII to get rid of Boilerplate for RPCs
@@ -48,6 +54,60 @@ struct Monitor {
 
 const timeval kFalconWait = {10, 0};
 const timeval kFalconRetry = {2, 0};
+// How long to wait for the spy to accept a stream connection
+const int kFalconConnectMs = 1000;
+// Keeps a batch registration within a datagram
+const size_t kMaxRegisterBatch = 256;
+
+// Returns the spy address of layer child, or NULL
+sockaddr_in*
+SpyAddress(const LayerId& child) {
+    addrinfo hints;
+    addrinfo* aret = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    if (0 != getaddrinfo(child.c_str(), NULL, &hints, &aret)) {
+        LOG("Couldn't get addr for %s", child.c_str());
+        return NULL;
+    }
+    sockaddr_in* layer_addr = new sockaddr_in(
+        *reinterpret_cast<sockaddr_in*>(aret->ai_addr));
+    layer_addr->sin_port = htons(kFalconPort);
+    freeaddrinfo(aret);
+    return layer_addr;
+}
+
+// Returns a blocking TCP socket connected to addr, or -1
+int
+ConnectStream(const sockaddr_in* addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int ret = connect(fd, reinterpret_cast<const sockaddr*>(addr),
+                      sizeof(*addr));
+    if (ret != 0 && errno == EINPROGRESS) {
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (1 == poll(&pfd, 1, kFalconConnectMs) &&
+            0 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) &&
+            err == 0) {
+            ret = 0;
+        }
+    }
+    if (ret != 0) {
+        close(fd);
+        errno = 0;
+        return -1;
+    }
+    fcntl(fd, F_SETFL, flags);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
 }  // end anonymous namespace
 
 FalconLayer::FalconLayer(const LayerId& h, const Generation& g, bool killable,
@@ -63,6 +123,7 @@ FalconLayer::FalconLayer(const LayerId& h, const Generation& g, bool killable,
     pthread_mutex_init(&kill_lock_, NULL);
     pthread_mutex_init(&cancel_lock_, NULL);
     pthread_mutex_init(&add_child_lock_, NULL);
+    pthread_mutex_init(&clnt_lock_, NULL);
 
     pthread_cond_init(&kill_cond_, NULL);
     pthread_cond_init(&cancel_cond_, NULL);
@@ -74,18 +135,60 @@ FalconLayer::FalconLayer(const LayerId& h, const Generation& g, bool killable,
 
     watchdog_ = NULL;
     clnt_ = NULL;
+    stream_ = false;
 
     if (has_watchdog) {
         watchdog_ = new Watchdog(parent.lock(), handle_, timeout);
     } else if (!base_layer_) {
-        fd_ = socket(AF_INET, SOCK_DGRAM, 0);
-        CHECK(fd_ >= 0);
-        clnt_ = clntudp_create(my_addr, SPY_PROG, SPY_V1, kFalconRetry,
-                               &fd_);
-        CHECK(clnt_);
+        spy_addr_ = *my_addr;
+        OpenSpyClient();
     }
 }
 
+void
+FalconLayer::OpenSpyClient() {
+    // A stream leaves loss recovery to TCP instead of kFalconRetry
+    fd_ = ConnectStream(&spy_addr_);
+    if (fd_ >= 0) {
+        clnt_ = clnttcp_create(&spy_addr_, SPY_PROG, SPY_V1, &fd_, 0, 0);
+        if (clnt_) {
+            stream_ = true;
+            return;
+        }
+        close(fd_);
+    }
+    stream_ = false;
+    fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    CHECK(fd_ >= 0);
+    clnt_ = clntudp_create(&spy_addr_, SPY_PROG, SPY_V1, kFalconRetry, &fd_);
+    CHECK(clnt_);
+}
+
+void
+FalconLayer::CloseSpyClient() {
+    clnt_destroy(clnt_);
+    close(fd_);
+    clnt_ = NULL;
+    stream_ = false;
+}
+
+clnt_stat
+FalconLayer::CallSpy(u_long proc, xdrproc_t xargs, caddr_t args,
+                     xdrproc_t xres, caddr_t res) {
+    pthread_mutex_lock(&clnt_lock_);
+    clnt_stat st = clnt_call(clnt_, proc, xargs, args, xres, res,
+                             kFalconWait);
+    if (stream_ && (st == RPC_CANTSEND || st == RPC_CANTRECV)) {
+        // The spy restarted or dropped us: reconnect and try again
+        LOG("Reconnecting to spy: rpc: %d", st);
+        CloseSpyClient();
+        OpenSpyClient();
+        st = clnt_call(clnt_, proc, xargs, args, xres, res, kFalconWait);
+    }
+    pthread_mutex_unlock(&clnt_lock_);
+    return st;
+}
+
 FalconLayer::~FalconLayer() {
     // I'm sorry Old Yeller, I've got to put you down!
     if (watchdog_) {
@@ -94,8 +197,7 @@ FalconLayer::~FalconLayer() {
 
     // Close the spy client for this layer.
     if (clnt_) {
-        clnt_destroy(clnt_);
-        close(fd_);
+        CloseSpyClient();
     }
 
     // Clean up our mutexes. This is auto-destroyed by shared ptr, so we
@@ -104,6 +206,7 @@ FalconLayer::~FalconLayer() {
     CHECK(0 == pthread_mutex_destroy(&kill_lock_));
     CHECK(0 == pthread_mutex_destroy(&cancel_lock_));
     CHECK(0 == pthread_mutex_destroy(&add_child_lock_));
+    CHECK(0 == pthread_mutex_destroy(&clnt_lock_));
 
     CHECK(0 == pthread_cond_destroy(&kill_cond_));
     CHECK(0 == pthread_cond_destroy(&cancel_cond_));
@@ -162,6 +265,15 @@ FalconLayer::InitRPCArgs(const LayerId& child, target_t* target,
     return;
 }
 
+void
+FalconLayer::CheckDeadline(const LayerId& child, uint32_t requested_ms,
+                           uint32_t achieved_ms) {
+    if (requested_ms != 0 && achieved_ms > requested_ms) {
+        LOG("%s at %s: detection deadline %u ms, asked for %u ms",
+            child.c_str(), handle_.c_str(), achieved_ms, requested_ms);
+    }
+}
+
 bool
 FalconLayer::CancelChild(const LayerId& child) {
     Monitor m(&cancel_lock_, &cancel_cond_, &cancel_active_);
@@ -179,9 +291,9 @@ FalconLayer::CancelChild(const LayerId& child) {
     memset(&res, 0, sizeof(res));
     InitRPCArgs(child, &arg.target, &arg.client, NULL);
     // Cancel. LOG, but ignore error
-    clnt_stat st = clnt_call(clnt_, SPY_CANCEL, (xdrproc_t) xdr_spy_cancel_arg,
-                            (caddr_t) &arg, (xdrproc_t) xdr_spy_res,
-                            (caddr_t) &res, kFalconWait);
+    clnt_stat st = CallSpy(SPY_CANCEL, (xdrproc_t) xdr_spy_cancel_arg,
+                           (caddr_t) &arg, (xdrproc_t) xdr_spy_res,
+                           (caddr_t) &res);
     if (st != RPC_SUCCESS || res.status != FALCON_CANCEL_ACK) {
         LOG("cancel error %s: rpc: %d falcon: %d", child.c_str(), st,
             res.status);
@@ -221,9 +333,9 @@ FalconLayer::KillChild(const LayerId& child) {
     memset(&arg, 0, sizeof(arg));
     memset(&res, 0, sizeof(res));
     InitRPCArgs(child, &arg.target, NULL, NULL);
-    clnt_stat st = clnt_call(clnt_, SPY_KILL, (xdrproc_t) xdr_spy_kill_arg,
-                            (caddr_t) &arg, (xdrproc_t) xdr_spy_res,
-                            (caddr_t) &res, kFalconWait);
+    clnt_stat st = CallSpy(SPY_KILL, (xdrproc_t) xdr_spy_kill_arg,
+                           (caddr_t) &arg, (xdrproc_t) xdr_spy_res,
+                           (caddr_t) &res);
     if (st != RPC_SUCCESS || res.status != FALCON_KILL_ACK) {
         LOG("kill error: rpc: %d falcon: %d", st, res.status);
         if (st == RPC_SUCCESS && res.status == FALCON_LONG_DEAD) {
@@ -241,7 +353,7 @@ FalconLayer::KillChild(const LayerId& child) {
 
 FalconLayerPtr
 FalconLayer::AddChild(const LayerId& child, bool killable, client_addr_t& addr,
-                      int32_t timeout, bool leaf_layer,
+                      int32_t timeout, uint32_t deadline_ms, bool leaf_layer,
                       FalconParentPtr parent, FalconCallbackPtr cb) {
     Monitor m(&add_child_lock_, &add_child_cond_, &add_child_active_);
 
@@ -257,18 +369,10 @@ FalconLayer::AddChild(const LayerId& child, bool killable, client_addr_t& addr,
     // Step 1. Get an address if it is not a leaf
     sockaddr_in* layer_addr = NULL;
     if (!leaf_layer) {
-        addrinfo hints;
-        addrinfo* aret = NULL;
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_INET;
-        if (0 != getaddrinfo(child.c_str(), NULL, &hints, &aret)) {
-            LOG("Couldn't get addr for %s", child.c_str());
+        layer_addr = SpyAddress(child);
+        if (!layer_addr) {
             return ret;
         }
-        layer_addr = new sockaddr_in(*reinterpret_cast<sockaddr_in*>
-                                     (aret->ai_addr));
-        layer_addr->sin_port = htons(kFalconPort);
-        freeaddrinfo(aret);
     }
 
     // Step 2. If it's the base layer just add the child and return
@@ -291,10 +395,9 @@ FalconLayer::AddChild(const LayerId& child, bool killable, client_addr_t& addr,
     memset(&arg, 0, sizeof(arg));
     memset(&res, 0, sizeof(res));
     InitRPCArgs(child, &arg.target, NULL, NULL);
-    clnt_stat st = clnt_call(clnt_, SPY_GET_GEN,
-                             (xdrproc_t) xdr_spy_get_gen_arg, (caddr_t) &arg,
-                             (xdrproc_t) xdr_spy_res, (caddr_t) &res,
-                             kFalconWait);
+    clnt_stat st = CallSpy(SPY_GET_GEN, (xdrproc_t) xdr_spy_get_gen_arg,
+                           (caddr_t) &arg, (xdrproc_t) xdr_spy_res,
+                           (caddr_t) &res);
     Generation new_gen(res.target.generation.generation_len,
                        res.target.generation.generation_val);
     xdr_free((xdrproc_t) xdr_spy_res, reinterpret_cast<char*>(&res));
@@ -323,11 +426,12 @@ FalconLayer::AddChild(const LayerId& child, bool killable, client_addr_t& addr,
     } else {
         rarg.up_interval_ms = -1;
     }
-    st = clnt_call(clnt_, SPY_REGISTER, (xdrproc_t) xdr_spy_register_arg,
-                   (caddr_t) &rarg, (xdrproc_t) xdr_spy_res, (caddr_t) &res,
-                   kFalconWait);
+    rarg.deadline_ms = deadline_ms;
+    st = CallSpy(SPY_REGISTER, (xdrproc_t) xdr_spy_register_arg,
+                 (caddr_t) &rarg, (xdrproc_t) xdr_spy_res, (caddr_t) &res);
 
     if (st == RPC_SUCCESS && res.status == FALCON_REGISTER_ACK) {
+        CheckDeadline(child, deadline_ms, res.deadline_ms);
         ret = FalconLayerPtr(new FalconLayer(child, new_gen, killable, parent,
                                              addr, timeout, leaf_layer, false,
                                              layer_addr));
@@ -347,6 +451,130 @@ FalconLayer::AddChild(const LayerId& child, bool killable, client_addr_t& addr,
     return ret;
 }
 
+void
+FalconLayer::AddChildren(std::vector<ChildRequest>* reqs,
+                         FalconParentPtr parent) {
+    std::vector<size_t> singles;
+    if (base_layer_ || reqs->size() == 1) {
+        // Nothing to register, or nothing to batch
+        for (size_t i = 0; i < reqs->size(); ++i) {
+            singles.push_back(i);
+        }
+    } else {
+        Monitor m(&add_child_lock_, &add_child_cond_, &add_child_active_);
+        for (size_t i = 0; i < reqs->size(); i += kMaxRegisterBatch) {
+            RegisterBatch(reqs, i,
+                          std::min(reqs->size(), i + kMaxRegisterBatch),
+                          parent, &singles);
+        }
+    }
+    for (size_t i = 0; i < singles.size(); ++i) {
+        ChildRequest& r = (*reqs)[singles[i]];
+        r.layer = AddChild(r.child, r.killable, r.addr, r.timeout,
+                           r.deadline_ms, r.leaf_layer, parent, r.cb);
+    }
+}
+
+void
+FalconLayer::RegisterBatch(std::vector<ChildRequest>* reqs, size_t begin,
+                           size_t end, FalconParentPtr parent,
+                           std::vector<size_t>* singles) {
+    std::vector<size_t> batch;
+    std::vector<sockaddr_in*> layer_addrs;
+    std::set<LayerId> batched;
+    for (size_t i = begin; i < end; ++i) {
+        ChildRequest& r = (*reqs)[i];
+        LockAll();
+        FalconLayerPtr c = children_[r.child];
+        UnlockAll();
+        if (c) {
+            c->AddCallback(r.cb);
+            r.layer = c;
+            continue;
+        }
+        if (!batched.insert(r.child).second) {
+            // AddChild finds the layer the first request adds
+            singles->push_back(i);
+            continue;
+        }
+        sockaddr_in* layer_addr = NULL;
+        if (!r.leaf_layer) {
+            layer_addr = SpyAddress(r.child);
+            if (!layer_addr) {
+                continue;
+            }
+        }
+        batch.push_back(i);
+        layer_addrs.push_back(layer_addr);
+    }
+    if (batch.empty()) {
+        return;
+    }
+
+    // Our own generation stops short of the children's, so the spy
+    // registers their current incarnations and tells us which they are
+    spy_register_batch_arg arg;
+    spy_batch_res res;
+    memset(&arg, 0, sizeof(arg));
+    memset(&res, 0, sizeof(res));
+    arg.entries.entries_len = batch.size();
+    arg.entries.entries_val = reinterpret_cast<spy_register_entry*>(
+        calloc(batch.size(), sizeof(spy_register_entry)));
+    for (size_t k = 0; k < batch.size(); ++k) {
+        const ChildRequest& r = (*reqs)[batch[k]];
+        spy_register_entry* e = &arg.entries.entries_val[k];
+        InitRPCArgs(r.child, &e->target, k == 0 ? &arg.client : NULL, &gen_);
+        e->lethal = r.killable;
+        if (r.leaf_layer && r.timeout >= 0) {
+            e->up_interval_ms = kSecondsToMilliseconds * r.timeout;
+        } else {
+            e->up_interval_ms = -1;
+        }
+        e->deadline_ms = r.deadline_ms;
+    }
+    clnt_stat st = CallSpy(SPY_REGISTER_BATCH,
+                           (xdrproc_t) xdr_spy_register_batch_arg,
+                           (caddr_t) &arg, (xdrproc_t) xdr_spy_batch_res,
+                           (caddr_t) &res);
+    bool answered = (st == RPC_SUCCESS &&
+                     res.results.results_len == batch.size());
+    if (!answered) {
+        LOG("Batch registration at %s failed: rpc: %d", handle_.c_str(), st);
+    }
+    for (size_t k = 0; k < batch.size(); ++k) {
+        ChildRequest& r = (*reqs)[batch[k]];
+        const spy_res* e = answered ? &res.results.results_val[k] : NULL;
+        if (st == RPC_PROCUNAVAIL ||
+            (e && e->status == FALCON_WRONG_SHARD)) {
+            // An older spy, or another shard's target
+            singles->push_back(batch[k]);
+        } else if (e && e->status == FALCON_REGISTER_ACK) {
+            Generation new_gen(e->target.generation.generation_len,
+                               e->target.generation.generation_val);
+            if (!IsChild(gen_, new_gen)) {
+                LOG("Got bad generation for %s!", r.child.c_str());
+            } else {
+                CheckDeadline(r.child, r.deadline_ms, e->deadline_ms);
+                r.layer = FalconLayerPtr(new FalconLayer(r.child, new_gen,
+                    r.killable, parent, r.addr, r.timeout, r.leaf_layer,
+                    false, layer_addrs[k]));
+                LockAll();
+                children_[r.child] = r.layer;
+                child_leaves_[r.child]++;
+                r.layer->AddCallback(r.cb);
+                UnlockAll();
+            }
+        } else if (e) {
+            LOG("Failed to register %s: falcon: %d", r.child.c_str(),
+                e->status);
+        }
+        delete layer_addrs[k];
+    }
+    xdr_free((xdrproc_t) xdr_spy_batch_res, reinterpret_cast<char*>(&res));
+    xdr_free((xdrproc_t) xdr_spy_register_batch_arg,
+             reinterpret_cast<char*>(&arg));
+}
+
 void
 FalconLayer::AddCallback(FalconCallbackPtr cb) {
     cb_list_.Add(cb);
@@ -22,6 +22,7 @@
 
 #include <map>
 #include <list>
+#include <vector>
 
 #include "spy_prot.h"
 #include "CallbackList.h"
@@ -35,6 +36,19 @@ class FalconClient;
 typedef boost::shared_ptr<FalconLayer> FalconLayerPtr;
 typedef boost::weak_ptr<FalconLayer> FalconParentPtr;
 
+// One child for FalconLayer::AddChildren, with the arguments AddChild takes.
+// layer is filled in with the added layer, or left NULL on failure.
+struct ChildRequest {
+    LayerId             child;
+    bool                killable;
+    client_addr_t       addr;
+    int32_t             timeout;
+    uint32_t            deadline_ms;
+    bool                leaf_layer;
+    FalconCallbackPtr   cb;
+    FalconLayerPtr      layer;
+};
+
 class FalconLayer {
     public:
         FalconLayer(const LayerId& h, const Generation& g, bool killable,
@@ -53,9 +67,16 @@ class FalconLayer {
         int             KillChild(const LayerId& child);
         FalconLayerPtr  AddChild(const LayerId& child, bool killable,
                                  client_addr_t& addr, int32_t timeout,
-                                 bool leaf_layer, FalconParentPtr parent,
+                                 uint32_t deadline_ms, bool leaf_layer,
+                                 FalconParentPtr parent,
                                  FalconCallbackPtr first_cb);
 
+        // AddChild for several children at once. The new ones are
+        // registered with SPY_REGISTER_BATCH, so the spy sees one request
+        // (per kMaxRegisterBatch children) instead of two per child.
+        void            AddChildren(std::vector<ChildRequest>* reqs,
+                                    FalconParentPtr parent);
+
         // e2etimer functions
         void StartTimer(FalconCallbackPtr cb, int timeout);
         void StopTimer();
@@ -80,10 +101,31 @@ class FalconLayer {
         void RunCallbacks(const LayerId& lid, uint32_t falcon_status,
                           uint32_t remote_status);
 
+        // Connects clnt_ to the spy at spy_addr_: over a stream if the spy
+        // accepts one, otherwise over datagrams
+        void OpenSpyClient();
+        void CloseSpyClient();
+
+        // Calls the spy. Calls are serialized, and a call that fails
+        // because the stream broke is retried once on a new connection.
+        clnt_stat CallSpy(u_long proc, xdrproc_t xargs, caddr_t args,
+                          xdrproc_t xres, caddr_t res);
+
+        // Registers reqs[begin, end) in one batch. Requests the spy could not
+        // batch are appended to singles for AddChild.
+        void RegisterBatch(std::vector<ChildRequest>* reqs, size_t begin,
+                           size_t end, FalconParentPtr parent,
+                           std::vector<size_t>* singles);
+
         // RPC convenience function
         void InitRPCArgs(const LayerId& child, target_t* target,
                          client_addr_t* addr, const Generation* gen);
 
+        // Logs when the spy can't detect a failure of child as fast as
+        // we asked
+        void CheckDeadline(const LayerId& child, uint32_t requested_ms,
+                           uint32_t achieved_ms);
+
         // Information about this layer
         const LayerId                     handle_;
         const Generation                  gen_;
@@ -118,6 +160,9 @@ class FalconLayer {
         // RPC client for this layer
         CLIENT*                           clnt_;
         int                               fd_;
+        bool                              stream_;
+        sockaddr_in                       spy_addr_;
+        pthread_mutex_t                   clnt_lock_;
 
         // Client address with tag for this layer
         client_addr_t                     addr_;
@@ -43,11 +43,12 @@ Falcon::LogCallbackData(const LayerIdList& id_list, uint32_t falcon_status,
 
 falcon_target*
 Falcon::init(const LayerIdList& id_list, bool lethal, void* client_data,
-     int up_callback_period) {
+     int up_callback_period, uint32_t detection_deadline_ms) {
     FalconClient* cl = FalconClient::GetInstance();
     falcon_target* target = cl->StartMonitoring(id_list, lethal, NULL,
                                                 client_data,
-                                                up_callback_period);
+                                                up_callback_period,
+                                                detection_deadline_ms);
     return target;
 }
 
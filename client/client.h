@@ -47,8 +47,11 @@ typedef void(*falcon_callback_fn)(const LayerIdList& handle,
 void LogCallbackData(const LayerIdList& id_list, uint32_t falcon_status,
                      uint32_t remote_st);
 
+// detection_deadline_ms asks the spies to notice a failure of the target
+// within that many milliseconds; 0 leaves the spies' defaults alone.
 falcon_target* init(const LayerIdList& id_list, bool lethal, void* client_data,
-                    int up_callback_period=-1);
+                    int up_callback_period=-1,
+                    uint32_t detection_deadline_ms=0);
 
 void uninit(falcon_target* target);
 
@@ -51,6 +51,25 @@ client_down_1_svc(client_down_arg* argp, void* result, struct svc_req *rqstp) {
     return 1;
 }
 
+// Batches are unpacked into the single-target handlers, one entry at a time
+bool_t
+client_up_batch_1_svc(client_up_batch_arg* argp, void* result,
+                      struct svc_req *rqstp) {
+    for (u_int i = 0; i < argp->ups.ups_len; ++i) {
+        client_up_1_svc(&argp->ups.ups_val[i], result, rqstp);
+    }
+    return 1;
+}
+
+bool_t
+client_down_batch_1_svc(client_down_batch_arg* argp, void* result,
+                        struct svc_req *rqstp) {
+    for (u_int i = 0; i < argp->downs.downs_len; ++i) {
+        client_down_1_svc(&argp->downs.downs_val[i], result, rqstp);
+    }
+    return 1;
+}
+
 int
 client_prog_1_freeresult(SVCXPRT *transp, xdrproc_t xdr_result,
                          caddr_t result) {
@@ -19,6 +19,17 @@ struct client_down_arg {
     uint32_t    client_tag;
 };
 
+/* Several up or down messages for targets watched by one client endpoint,
+ * delivered in a single call. Each entry carries its own client_tag.
+ */
+struct client_up_batch_arg {
+    client_up_arg   ups<>;
+};
+
+struct client_down_batch_arg {
+    client_down_arg downs<>;
+};
+
 program CLIENT_PROG {
     version CLIENT_V1 {
         void
@@ -29,5 +40,11 @@ program CLIENT_PROG {
 
         void
         CLIENT_DOWN(client_down_arg) = 2;
+
+        void
+        CLIENT_UP_BATCH(client_up_batch_arg) = 3;
+
+        void
+        CLIENT_DOWN_BATCH(client_down_batch_arg) = 4;
     } = 1;
 } = 2000112;
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+// Counts the heap allocations Enforcer::Dispatch makes per request once the
+// enforcer knows the target and the client. The enforcer runs in-process
+// behind a loopback socket and gets one request at a time; malloc is
+// interposed and counts only while a measured request is dispatched.
+//
+// The counts include what libasync does to send the reply, so the SPY_NULL
+// row, which does nothing but reply, is the baseline. The tool exits
+// non-zero if any other request allocates more than that. SPY_CANCEL is left
+// out: it tears down the registration that the next request would rebuild.
+//
+// usage: dispatch_allocs [calls per request]
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <arpc.h>
+#include <async.h>
+
+#include "common.h"
+#include "enforcer.h"
+
+namespace {
+
+const size_t kWarmupCalls = 16;
+
+struct request_kind {
+    const char* name;
+    uint32_t    proc;
+    uint32_t    expect;
+};
+
+const request_kind kKinds[] = {
+    {"SPY_NULL", SPY_NULL, 0},
+    {"SPY_GET_GEN", SPY_GET_GEN, FALCON_GEN_RESP},
+    {"SPY_REGISTER", SPY_REGISTER, FALCON_REGISTER_ACK},
+    {"SPY_KILL", SPY_KILL, FALCON_KILL_ACK},
+};
+const size_t kNumKinds = sizeof(kKinds) / sizeof(kKinds[0]);
+
+bool        counting;
+uint64_t    allocations;
+
+}  // end anonymous namespace
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t size);
+
+void*
+malloc(size_t size) {
+    if (counting) allocations++;
+    return __libc_malloc(size);
+}
+
+void*
+calloc(size_t n, size_t size) {
+    if (counting) allocations++;
+    return __libc_calloc(n, size);
+}
+
+void*
+realloc(void* p, size_t size) {
+    if (counting) allocations++;
+    return __libc_realloc(p, size);
+}
+}
+
+namespace {
+
+// Measured requests are counted; warm-up requests are not
+bool measuring;
+
+// An enforcer whose layer accepts every target and does nothing
+class CountingEnforcer : public virtual Enforcer {
+  public:
+    virtual ~CountingEnforcer() {}
+    virtual void Init() {}
+    virtual void StartMonitoring(const ref<const str> handle) {}
+    virtual void StopMonitoring(const ref<const str> handle) {}
+    virtual bool InvalidTarget(const ref<const str> handle) { return false; }
+    virtual void Kill(const ref<const str> handle) {}
+    virtual void UpdateGenerations(const ref<const str> handle) {}
+
+    void Serve(int fd) {
+        server_ = asrv::alloc(axprt_dgram::alloc(fd), spy_prog_1,
+                              wrap(mkref(this), &CountingEnforcer::Counted));
+    }
+
+  private:
+    void Counted(svccb* sbp) {
+        if (!sbp) return;
+        counting = measuring;
+        Dispatch(sbp);
+        counting = false;
+    }
+
+    ptr<asrv>   server_;
+};
+
+ptr<aclnt>      enforcer;
+client_addr_t   client;
+size_t          calls;
+size_t          kind;
+size_t          call;
+uint64_t        baseline;
+bool            failed;
+
+int
+LoopbackSocket(sockaddr_in* addr) {
+    int fd = inetsocket(SOCK_DGRAM, 0, INADDR_LOOPBACK);
+    CHECK(fd >= 0);
+    make_async(fd);
+    close_on_exec(fd);
+    socklen_t len = sizeof(*addr);
+    CHECK(0 == getsockname(fd, reinterpret_cast<sockaddr*>(addr), &len));
+    return fd;
+}
+
+void
+FillTarget(target_t* target) {
+    target->handle = "target";
+    target->generation.setsize(1);
+    target->generation[0] = 0;
+}
+
+void
+Report() {
+    if (kind == 0) {
+        baseline = allocations;
+    }
+    uint64_t excess = (allocations > baseline) ? allocations - baseline : 0;
+    printf("request=%s calls=%zu allocs_per_call=%.2f excess_per_call=%.2f\n",
+           kKinds[kind].name, calls,
+           static_cast<double>(allocations) / calls,
+           static_cast<double>(excess) / calls);
+    fflush(stdout);
+    if (excess) {
+        failed = true;
+    }
+}
+
+void Issue();
+
+void
+Answered(ref<spy_res> res, clnt_stat st) {
+    if (st != RPC_SUCCESS ||
+        (kKinds[kind].expect && res->status != kKinds[kind].expect)) {
+        fprintf(stderr, "%s failed: rpc %d status %u\n", kKinds[kind].name,
+                st, res->status);
+        exit(EXIT_FAILURE);
+    }
+    if (++call == kWarmupCalls + calls) {
+        Report();
+        kind++;
+        call = 0;
+        allocations = 0;
+        if (kind == kNumKinds) {
+            exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+    }
+    Issue();
+}
+
+void
+Issue() {
+    measuring = (call >= kWarmupCalls);
+    ref<spy_res> res = New refcounted<spy_res>;
+    switch (kKinds[kind].proc) {
+        case SPY_NULL:
+            enforcer->call(SPY_NULL, NULL, NULL, wrap(Answered, res));
+            break;
+        case SPY_GET_GEN: {
+            ref<spy_get_gen_arg> a = New refcounted<spy_get_gen_arg>;
+            FillTarget(&a->target);
+            enforcer->call(SPY_GET_GEN, a, res, wrap(Answered, res));
+            break;
+        }
+        case SPY_REGISTER: {
+            ref<spy_register_arg> a = New refcounted<spy_register_arg>;
+            FillTarget(&a->target);
+            a->lethal = true;
+            // No ups, so nothing is sent to the client address
+            a->up_interval_ms = -1;
+            a->deadline_ms = 0;
+            a->client = client;
+            enforcer->call(SPY_REGISTER, a, res, wrap(Answered, res));
+            break;
+        }
+        case SPY_KILL: {
+            ref<spy_kill_arg> a = New refcounted<spy_kill_arg>;
+            FillTarget(&a->target);
+            enforcer->call(SPY_KILL, a, res, wrap(Answered, res));
+            break;
+        }
+    }
+}
+
+}  // end anonymous namespace
+
+int
+main(int argc, char** argv) {
+    calls = (argc > 1) ? atoi(argv[1]) : 1000;
+    CHECK(calls > 0);
+    async_init();
+
+    sockaddr_in enforcer_addr;
+    ref<CountingEnforcer> e = New refcounted<CountingEnforcer>();
+    e->Serve(LoopbackSocket(&enforcer_addr));
+
+    // Registered as the client's callback address; never read
+    sockaddr_in client_addr;
+    LoopbackSocket(&client_addr);
+    client.ipaddr = client_addr.sin_addr.s_addr;
+    client.port = client_addr.sin_port;
+    client.client_tag = 0;
+
+    int fd = inetsocket(SOCK_DGRAM, 0, 0);
+    CHECK(fd >= 0);
+    make_async(fd);
+    close_on_exec(fd);
+    enforcer = aclnt::alloc(axprt_dgram::alloc(fd), spy_prog_1,
+                            reinterpret_cast<sockaddr*>(&enforcer_addr));
+    Issue();
+    amain();
+    return EXIT_FAILURE;
+}
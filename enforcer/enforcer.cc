@@ -14,7 +14,19 @@
  * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. 
  *
  */
+#include <netinet/tcp.h>
 #include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
+#include <algorithm>
 
 #include <arpc.h>
 #include <async.h>
@@ -29,59 +41,1126 @@ bool operator<(const ref<FalconClient> c1, const ref<FalconClient> c2) {
     return *c1 < *c2;
 }
 
-Enforcer::Enforcer() : logfile_name_("/dev/null"), generation_log_(NULL) {}
+Enforcer::Enforcer() : timers_(New refcounted<TimerWheel>()),
+                       logfile_name_("/dev/null"), generation_lease_(0),
+                       down_deadline_ms_(kDefaultDownDeadlineMs),
+                       shards_(1), shard_(0), standby_(false),
+                       takeover_ms_(kDefaultTakeoverMs),
+                       standby_port_(kFalconPort), admission_rate_(0),
+                       admission_burst_(0), gen_store_(NULL),
+                       journal_(NULL), journal_flush_(false),
+                       standby_fd_(-1), replica_sent_(0),
+                       replica_timer_(NULL), primary_fd_(-1),
+                       primary_pid_(0), primary_timer_(NULL),
+                       next_flight_(0),
+                       heartbeat_failures_(0), shed_queries_(0),
+                       shed_registers_(0), shed_ups_(0),
+                       start_ns_(TimerWheel::Now()), next_stream_(0) {}
+
+void
+Enforcer::Run() {
+    if (!replication_path_.empty() && shards_ > 1) {
+        LOG1("Replication needs an unsharded enforcer");
+        exit(EXIT_FAILURE);
+    }
+    if (standby_) {
+        // Everything else happens once the primary is gone
+        CHECK(!replication_path_.empty());
+        WatchPrimary();
+        amain();
+    }
+    // Initialize generations from file
+    InitGenerations();
+    // Start server
+    int fd;
+    if (shards_ > 1) {
+        fd = StartShards();
+    } else {
+        fd = inetsocket(SOCK_DGRAM, kFalconPort, INADDR_ANY);
+    }
+    Serve(fd, kFalconPort);
+    amain();
+}
+
+void
+Enforcer::Serve(int fd, uint16_t port) {
+    CHECK(fd >= 0);
+    StartThreads();
+    RestoreRegistrations();
+    // Generation bumps are synced off the event loop from here on
+    gen_store_->StartSyncThread();
+    make_async(gen_store_->NotifyFd());
+    close_on_exec(gen_store_->NotifyFd());
+    fdcb(gen_store_->NotifyFd(), selread,
+         wrap(mkref(this), &Enforcer::GenerationsDurable));
+    make_async(fd);
+    close_on_exec(fd);
+    srv_ = asrv::alloc(axprt_dgram::alloc(fd), spy_prog_1);
+    srv_->setcb(wrap(mkref(this), &Enforcer::Dispatch));
+    if (shards_ == 1) {
+        StartStreamListener(inetsocket(SOCK_STREAM, port, INADDR_ANY));
+        StartReplication();
+    }
+}
+
+namespace {
+// Connections beyond this are closed right away
+const size_t kMaxStreams = 1024;
+}  // end anonymous namespace
+
+void
+Enforcer::StartStreamListener(int fd) {
+    // Clients fall back to datagrams without it
+    if (fd < 0 || listen(fd, SOMAXCONN) != 0) {
+        LOG("No stream transport: %s", strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        errno = 0;
+        return;
+    }
+    make_async(fd);
+    close_on_exec(fd);
+    fdcb(fd, selread, wrap(mkref(this), &Enforcer::AcceptStream, fd));
+}
+
+void
+Enforcer::AcceptStream(int fd) {
+    for (;;) {
+        int cfd = accept(fd, NULL, NULL);
+        if (cfd < 0) {
+            if (EAGAIN != errno && EWOULDBLOCK != errno) {
+                LOG("accept: %s", strerror(errno));
+            }
+            errno = 0;
+            return;
+        }
+        if (streams_.size() >= kMaxStreams) {
+            LOG1("Too many stream connections");
+            close(cfd);
+            continue;
+        }
+        make_async(cfd);
+        close_on_exec(cfd);
+        int one = 1;
+        setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        uint32_t id = next_stream_++;
+        ptr<asrv> s = asrv::alloc(axprt_stream::alloc(cfd), spy_prog_1,
+                          wrap(mkref(this), &Enforcer::StreamDispatch, id));
+        if (!s) {
+            close(cfd);
+            continue;
+        }
+        streams_.insert(id, mkref(s));
+    }
+}
+
+void
+Enforcer::StreamDispatch(uint32_t id, svccb *sbp) {
+    if (!sbp) {
+        // Requests deferred on it keep what they need to reply
+        streams_.remove(id);
+        return;
+    }
+    // Stream sources are told apart from datagram ones by the top bit
+    if (!Admit(sbp, id | 0x80000000U)) {
+        sbp->ignore();
+        return;
+    }
+    Answer(sbp);
+}
+
+namespace {
+// Golden ratio multiplier for spreading handles over shards
+const uint32_t kShardHashMultiplier = 2654435761U;
+
+#if defined(SO_REUSEPORT) && defined(SO_ATTACH_REUSEPORT_CBPF)
+// Builds the socket filter that steers every call to the shard owning its
+// target. Every spy procedure starts its argument with a target handle, so
+// its XDR encoding directly follows the call header. The filter computes
+// Enforcer::ShardOf() from the handle's length and its last (zero padded)
+// word, which is as far as a classic BPF program can get without loops.
+// Calls it cannot parse (e.g. SPY_NULL) go to shard 0.
+void
+AttachShardFilter(int fd, uint32_t shards) {
+    struct sock_filter code[] = {
+        // A = credential length; skip the credential
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 28),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 3),
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, ~3U),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 32),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        // A = verifier length; skip the verifier
+        BPF_STMT(BPF_LD | BPF_W | BPF_IND, 4),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 3),
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, ~3U),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 8),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        // X now points at the handle length. Keep it and find the last word.
+        BPF_STMT(BPF_LD | BPF_W | BPF_IND, 0),
+        BPF_STMT(BPF_ST, 0),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 3),
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, ~3U),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_IND, 0),
+        // A = ((word ^ length) * multiplier >> 16) % shards
+        BPF_STMT(BPF_LDX | BPF_W | BPF_MEM, 0),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, kShardHashMultiplier),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, shards),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    CHECK(0 == setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                          sizeof(prog)));
+}
+#endif
+}  // end anonymous namespace
+
+uint32_t
+Enforcer::ShardOf(const str& handle, uint32_t shards) {
+    // Must agree with AttachShardFilter(). An empty handle's "last word" is
+    // its length.
+    uint32_t len = handle.len();
+    uint32_t word = 0;
+    if (len > 0) {
+        size_t start = (len - 1) & ~3U;
+        unsigned char bytes[4] = {0, 0, 0, 0};
+        memcpy(bytes, handle.cstr() + start, len - start);
+        word = bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+    }
+    return ((word ^ len) * kShardHashMultiplier >> 16) % shards;
+}
+
+int
+Enforcer::ShardSocket() {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    CHECK(fd >= 0);
+    int one = 1;
+#ifdef SO_REUSEPORT
+    CHECK(0 == setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)));
+#endif
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kFalconPort);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    CHECK(0 == bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                    sizeof(addr)));
+    return fd;
+}
+
+std::string
+Enforcer::ShardLogName(uint32_t shard) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), ".shard%u", shard);
+    return std::string(logfile_name_) + buf;
+}
+
+std::string
+Enforcer::JournalName(uint32_t shard) {
+    std::string log = (shard == 0) ? std::string(logfile_name_) :
+                                     ShardLogName(shard);
+    return log + ".reg";
+}
+
+int
+Enforcer::StartShards() {
+#if defined(SO_REUSEPORT) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    CHECK(shards_ <= kMaxShards);
+    // The filter picks sockets by their position in the group, which is the
+    // order they were bound in, so every shard's socket is bound here.
+    std::vector<int> socks(shards_);
+    shard_recv_.resize(shards_);
+    shard_send_.resize(shards_);
+    for (uint32_t i = 0; i < shards_; ++i) {
+        socks[i] = ShardSocket();
+        if (i == 0) {
+            AttachShardFilter(socks[0], shards_);
+        }
+        int link[2];
+        CHECK(0 == socketpair(AF_UNIX, SOCK_DGRAM, 0, link));
+        close_on_exec(link[0]);
+        close_on_exec(link[1]);
+        shard_recv_[i] = link[0];
+        shard_send_[i] = link[1];
+    }
+
+    // Each shard holds the write end of a lifeline pipe that shard 0
+    // watches. Losing a shard means losing its targets, so shard 0 then
+    // takes the whole spy down, and the others follow it via PDEATHSIG.
+    pid_t parent = getpid();
+    std::vector<int> lifelines;
+    for (uint32_t i = 1; i < shards_; ++i) {
+        int lifeline[2];
+        CHECK(0 == pipe(lifeline));
+        pid_t pid = fork();
+        CHECK(pid >= 0);
+        if (pid == 0) {
+            CHECK(0 == prctl(PR_SET_PDEATHSIG, SIGKILL));
+            if (getppid() != parent) {
+                exit(EXIT_FAILURE);
+            }
+            close(lifeline[0]);
+            close_on_exec(lifeline[1]);
+            for (size_t j = 0; j < lifelines.size(); ++j) {
+                fdcb(lifelines[j], selread, 0);
+                close(lifelines[j]);
+            }
+            shard_ = i;
+            break;
+        }
+        close(lifeline[1]);
+        close_on_exec(lifeline[0]);
+        lifelines.push_back(lifeline[0]);
+        fdcb(lifeline[0], selread,
+             wrap(mkref(this), &Enforcer::ShardExited, i));
+    }
+
+    for (uint32_t i = 0; i < shards_; ++i) {
+        if (i == shard_) continue;
+        close(socks[i]);
+        close(shard_recv_[i]);
+        shard_recv_[i] = -1;
+    }
+    make_async(shard_recv_[shard_]);
+    fdcb(shard_recv_[shard_], selread,
+         wrap(mkref(this), &Enforcer::ReceiveShardMessage));
+
+    if (shard_ != 0) {
+        // Generations loaded by shard 0 carry over; new bumps go to a log of
+        // our own, absorbed by shard 0 at the next start
+        bool own_log = gen_store_->Checkpoints();
+        delete gen_store_;
+        std::string path = own_log ? ShardLogName(shard_) :
+                                     std::string(logfile_name_);
+        gen_store_ = new GenerationStore(path.c_str());
+        std::map<std::string, uint32_t> ignored;
+        gen_store_->Load(&ignored);
+    }
+    LOG("shard %u of %u running as %d", shard_, shards_, getpid());
+    return socks[shard_];
+#else
+    LOG("sharding needs SO_REUSEPORT and SO_ATTACH_REUSEPORT_CBPF");
+    exit(EXIT_FAILURE);
+#endif
+}
+
+void
+Enforcer::ShardExited(uint32_t shard) {
+    LOG("shard %u exited, giving up", shard);
+    exit(EXIT_FAILURE);
+}
+
+void
+Enforcer::SendToShard(uint32_t shard, const void* msg, size_t len, int fd) {
+    CHECK(shard < shards_ && len <= kMaxShardMessage);
+    struct iovec iov;
+    iov.iov_base = const_cast<void*>(msg);
+    iov.iov_len = len;
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    // The socketpair is the queue between shards. It is blocking, so a
+    // shard that falls far behind holds up its senders instead of losing
+    // messages.
+    CHECK(static_cast<ssize_t>(len) == sendmsg(shard_send_[shard], &hdr, 0));
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void
+Enforcer::ReceiveShardMessage() {
+    char buf[kMaxShardMessage];
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    ssize_t len = recvmsg(shard_recv_[shard_], &hdr, 0);
+    if (len < 0) {
+        CHECK(EAGAIN == errno || EINTR == errno);
+        errno = 0;
+        return;
+    }
+    int fd = -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    ShardMessage(buf, len, fd);
+}
+
+void
+Enforcer::BecomePrimary() {
+    return;
+}
+
+void
+Enforcer::StartThreads() {
+    return;
+}
+
+uint32_t
+Enforcer::SetDeadline(const ref<const str> target, uint32_t deadline_ms) {
+    return 0;
+}
+
+void
+Enforcer::ShardMessage(const char* msg, size_t len, int fd) {
+    LOG("dropping %zu byte message from another shard", len);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool
+Enforcer::Misrouted(svccb *sbp, const str& handle) {
+    if (OwnsTarget(handle)) {
+        return false;
+    }
+    LOG("%s belongs to shard %u", handle.cstr(), ShardOf(handle, shards_));
+    sbp->reject(SYSTEM_ERR);
+    return true;
+}
+
+Target::Target(const str& h) : handle(New refcounted<const str>(h)),
+                                generation(0), pending(false),
+                                pending_generation(0), ceiling(0),
+                                requested_ms(kNoDeadline), deadline_ms(0),
+                                suspect_ns(0), down_ns(0) {}
+
+Target*
+Enforcer::FindTarget(const str& handle) {
+    ptr<Target> t = targets_[handle];
+    return t ? &*t : NULL;
+}
+
+Target*
+Enforcer::InternTarget(const str& handle) {
+    ptr<Target> t = targets_[handle];
+    if (t) {
+        return &*t;
+    }
+    ref<Target> n = New refcounted<Target>(handle);
+    targets_.insert(handle, n);
+    target_list_.push_back(&*n);
+    return &*n;
+}
+
+Target*
+Enforcer::GetValidTarget(const str& handle) {
+    if (handle.len() >= kGenerationHandleSize) {
+        LOG("Refusing a handle of %zu bytes",
+            static_cast<size_t>(handle.len()));
+        return NULL;
+    }
+    Target* t = FindTarget(handle);
+    if (t) {
+        // The layer may have forgotten about it since
+        if (InvalidTarget(t->handle)) {
+            return NULL;
+        }
+        return t;
+    }
+    ref<const str> h = New refcounted<const str>(handle);
+    if (InvalidTarget(h)) {
+        return NULL;
+    }
+    return InternTarget(handle);
+}
+
+bool
+Enforcer::Killable(const ref<const str> target) {
+    Target* t = FindTarget(*target);
+    return t && !t->deadly.empty();
+}
+
+uint32_t
+Enforcer::GetGeneration(const ref<const str> target) {
+    Target* t = FindTarget(*target);
+    return t ? t->generation : 0;
+}
+
+void
+Enforcer::SetReplyGeneration(const Target* t,
+                             rpc_vec<gen_no, RPC_INFINITY>* gen) {
+    size_t n = gen_vec_.size();
+    gen->setsize(n + 1);
+    for (size_t i = 0; i < n; ++i) {
+        (*gen)[i] = gen_vec_[i];
+    }
+    (*gen)[n] = t ? t->generation : 0;
+}
+
+spy_res&
+Enforcer::StartReply(const str& handle) {
+    reply_.target.handle = handle;
+    // Shrinking keeps the storage
+    reply_.target.generation.setsize(0);
+    reply_.status = FALCON_SUCCESS;
+    reply_.deadline_ms = 0;
+    return reply_;
+}
+
+void
+Enforcer::InitGenerations() {
+    gen_store_ = new GenerationStore(logfile_name_);
+    std::map<std::string, uint32_t> gens;
+    gen_store_->Load(&gens);
+    // Fold in what the shards of an earlier run logged, whatever the number
+    // of shards was then
+    if (gen_store_->Checkpoints()) {
+        for (uint32_t i = 1; i < kMaxShards; ++i) {
+            gen_store_->Absorb(ShardLogName(i).c_str(), &gens);
+        }
+    }
+    std::map<std::string, uint32_t>::iterator it;
+    for (it = gens.begin(); it != gens.end(); ++it) {
+        // With leases the store holds each target's ceiling. Generations
+        // below it may have been handed out before a crash, so restart
+        // from the ceiling itself.
+        Target* t = InternTarget(it->first.c_str());
+        t->generation = it->second;
+        if (generation_lease_ > 0) {
+            t->ceiling = it->second;
+        }
+    }
+    // Read every shard's registrations before any shard starts rewriting
+    // its journal
+    if (gen_store_->Checkpoints()) {
+        std::vector<uint32_t> base(gen_vec_.base(), gen_vec_.lim());
+        for (uint32_t i = 0; i < kMaxShards; ++i) {
+            RegistrationJournal::Read(JournalName(i).c_str(), base,
+                                      &restoring_);
+        }
+    }
+    return;
+}
+
+namespace {
+// Saved registrations for targets that have not shown up by then are dropped
+const time_t kRestoreWindowS = 60;
+}  // end anonymous namespace
+
+void
+Enforcer::RestoreRegistrations() {
+    if (!gen_store_->Checkpoints()) return;
+    // A registration is only good for the incarnation it was made for. With
+    // generation leases the target resumes above it, so nothing survives.
+    RegistrationMap::iterator it = restoring_.begin();
+    while (it != restoring_.end()) {
+        str handle(it->first.handle.c_str());
+        Target* t = FindTarget(handle);
+        gen_no gen = t ? t->generation : 0;
+        if (!OwnsTarget(handle) || it->second.generation != gen) {
+            restoring_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    std::vector<uint32_t> base(gen_vec_.base(), gen_vec_.lim());
+    journal_ = new RegistrationJournal(JournalName(shard_).c_str());
+    journal_->Open(base, restoring_);
+    if (shard_ == 0) {
+        // Shards of an earlier run that are gone now
+        for (uint32_t i = shards_; i < kMaxShards; ++i) {
+            if (0 != unlink(JournalName(i).c_str())) {
+                CHECK(ENOENT == errno);
+                errno = 0;
+            }
+        }
+    }
+    if (restoring_.empty()) return;
+    LOG("Restoring %zu registrations", restoring_.size());
+    std::vector<std::string> handles;
+    for (it = restoring_.begin(); it != restoring_.end(); ++it) {
+        if (handles.empty() || handles.back() != it->first.handle) {
+            handles.push_back(it->first.handle);
+        }
+    }
+    for (size_t i = 0; i < handles.size(); ++i) {
+        RestoreTarget(handles[i].c_str());
+    }
+    if (!restoring_.empty()) {
+        delaycb(kRestoreWindowS, 0,
+                wrap(mkref(this), &Enforcer::ExpireRestores));
+    }
+    return;
+}
+
+void
+Enforcer::TargetAvailable(const ref<const str> target) {
+    if (!restoring_.empty()) {
+        RestoreTarget(*target);
+    }
+    return;
+}
+
+void
+Enforcer::RestoreTarget(const str& handle) {
+    Target* t = GetValidTarget(handle);
+    if (!t) return;
+    registration_key first;
+    first.handle = handle.cstr();
+    first.ipaddr = first.port = first.tag = 0;
+    RegistrationMap::iterator it = restoring_.lower_bound(first);
+    // Registering for the current incarnation, as in RegisterClient()
+    target_t target;
+    target.handle = handle;
+    SetReplyGeneration(t, &target.generation);
+    target.generation.setsize(gen_vec_.size());
+    bool watch = false;
+    while (it != restoring_.end() && it->first.handle == first.handle) {
+        client_addr_t addr;
+        addr.ipaddr = it->first.ipaddr;
+        addr.port = it->first.port;
+        addr.client_tag = it->first.tag;
+        bool first_client = false;
+        RegisterClient(t, target, addr, it->second.lethal,
+                       it->second.up_interval_ms, it->second.deadline_ms,
+                       &first_client);
+        watch = watch || first_client;
+        // Tell the client about the target as soon as it shows signs of
+        // life, whatever its up interval
+        if (it->second.up_interval_ms >= 0) {
+            AddToWaiting(t, GetClient(addr));
+        }
+        restoring_.erase(it++);
+    }
+    if (watch) {
+        StartMonitoring(t->handle);
+    }
+    return;
+}
+
+void
+Enforcer::ExpireRestores() {
+    if (restoring_.empty()) return;
+    LOG("Dropping %zu saved registrations", restoring_.size());
+    RegistrationMap::iterator it;
+    for (it = restoring_.begin(); it != restoring_.end(); ++it) {
+        journal_->Cancel(it->first);
+    }
+    restoring_.clear();
+    FlushJournal();
+    return;
+}
+
+void
+Enforcer::DescribeRegistration(Target* t, const ref<FalconClient> cl,
+                               registration_key* key,
+                               registration_state* state) {
+    key->handle = t->handle->cstr();
+    key->ipaddr = cl->key_.ipaddr;
+    key->port = cl->key_.port;
+    key->tag = cl->key_.tag;
+    state->generation = t->generation;
+    const registration& reg = cl->registrations_[t];
+    state->up_interval_ms = reg.up_interval;
+    state->deadline_ms = reg.deadline_ms;
+    state->lethal = (t->deadly.count(cl) == 1);
+}
+
+void
+Enforcer::JournalRegistration(Target* t, const ref<FalconClient> cl,
+                              bool registered) {
+    if (!journal_ && standby_fd_ < 0) return;
+    registration_key key;
+    registration_state state;
+    DescribeRegistration(t, cl, &key, &state);
+    if (journal_) {
+        if (registered) {
+            journal_->Register(key, state);
+        } else {
+            journal_->Cancel(key);
+        }
+    }
+    if (standby_fd_ >= 0) {
+        char line[kJournalLineSize];
+        size_t len = registered ?
+            RegistrationJournal::FormatRegister(line, sizeof(line), key,
+                                                state) :
+            RegistrationJournal::FormatCancel(line, sizeof(line), key);
+        Replicate(line, len);
+    }
+    ScheduleJournalFlush();
+    return;
+}
+
+void
+Enforcer::ScheduleJournalFlush() {
+    if (!journal_flush_) {
+        journal_flush_ = true;
+        delaycb(0, 0, wrap(mkref(this), &Enforcer::FlushJournal));
+    }
+    return;
+}
+
+void
+Enforcer::FlushJournal() {
+    journal_flush_ = false;
+    if (journal_) {
+        journal_->Flush();
+    }
+    WriteReplica();
+    return;
+}
+
+namespace {
+// The primary writes at least this often, so a silent one is a stuck one
+const uint32_t kReplicaHeartbeatNs = 100 * 1000 * 1000;
+// A standby this far behind is dropped and has to start over
+const size_t kMaxReplicaBacklog = 64 * 1024 * 1024;
+// A standby without a primary tries again this often
+const uint32_t kPrimaryRetryNs = 100 * 1000 * 1000;
+// How long a new primary waits for the old one to let go of the port
+const int kBindAttempts = 200;
+const uint32_t kBindRetryNs = 10 * 1000 * 1000;
+
+void
+ReplicationAddress(const std::string& path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    CHECK(path.size() < sizeof(addr->sun_path));
+    strncpy(addr->sun_path, path.c_str(), sizeof(addr->sun_path) - 1);
+}
+}  // end anonymous namespace
+
+void
+Enforcer::StartReplication() {
+    if (replication_path_.empty()) return;
+    struct sockaddr_un addr;
+    ReplicationAddress(replication_path_, &addr);
+    // Left behind by the primary we replace, or by an earlier run
+    if (0 != unlink(addr.sun_path)) {
+        CHECK(ENOENT == errno);
+        errno = 0;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK(fd >= 0);
+    CHECK(0 == bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                    sizeof(addr)));
+    CHECK(0 == listen(fd, 1));
+    make_async(fd);
+    close_on_exec(fd);
+    fdcb(fd, selread, wrap(mkref(this), &Enforcer::AcceptStandby, fd));
+    replica_timer_ = timers_->NewTimer(
+        wrap(mkref(this), &Enforcer::ReplicationHeartbeat));
+    LOG("Accepting a standby at %s", addr.sun_path);
+}
+
+void
+Enforcer::AcceptStandby(int fd) {
+    int cfd = accept(fd, NULL, NULL);
+    if (cfd < 0) {
+        CHECK(EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno);
+        errno = 0;
+        return;
+    }
+    // There is only ever one standby; a new one replaces the old
+    if (standby_fd_ >= 0) {
+        DropStandby();
+    }
+    make_async(cfd);
+    close_on_exec(cfd);
+    standby_fd_ = cfd;
+    LOG1("Standby connected");
+    fdcb(cfd, selread, wrap(mkref(this), &Enforcer::StandbyReadable));
+    SendSnapshot();
+    ReplicationHeartbeat();
+}
+
+void
+Enforcer::StandbyReadable() {
+    // The standby never sends anything, so this is the connection closing
+    char buf[64];
+    ssize_t n = read(standby_fd_, buf, sizeof(buf));
+    if (n < 0 && (EAGAIN == errno || EINTR == errno)) {
+        errno = 0;
+        return;
+    }
+    LOG1("Standby went away");
+    errno = 0;
+    DropStandby();
+}
+
+void
+Enforcer::DropStandby() {
+    fdcb(standby_fd_, selread, 0);
+    fdcb(standby_fd_, selwrite, 0);
+    close(standby_fd_);
+    standby_fd_ = -1;
+    replica_out_.clear();
+    replica_sent_ = 0;
+    timers_->Cancel(replica_timer_);
+}
+
+void
+Enforcer::SendSnapshot() {
+    char line[kJournalLineSize];
+    std::vector<uint32_t> base(gen_vec_.base(), gen_vec_.lim());
+    Replicate(line, RegistrationJournal::FormatBase(line, sizeof(line), base));
+    for (size_t i = 0; i < target_list_.size(); ++i) {
+        Target* t = target_list_[i];
+        gen_no gen = LatestGeneration(t);
+        if (gen > 0) {
+            int len = snprintf(line, sizeof(line), "G\t%u\t%s\n", gen,
+                               t->handle->cstr());
+            CHECK(len > 0 && static_cast<size_t>(len) < sizeof(line));
+            Replicate(line, len);
+        }
+        ClientSet::iterator it;
+        for (it = t->clients.begin(); it != t->clients.end(); ++it) {
+            registration_key key;
+            registration_state state;
+            DescribeRegistration(t, *it, &key, &state);
+            Replicate(line, RegistrationJournal::FormatRegister(
+                                line, sizeof(line), key, state));
+        }
+    }
+}
+
+void
+Enforcer::Replicate(const char* line, size_t len) {
+    CHECK(len > 0);
+    replica_out_.append(line, len);
+}
+
+void
+Enforcer::WriteReplica() {
+    if (standby_fd_ < 0) return;
+    while (replica_sent_ < replica_out_.size()) {
+        ssize_t n = send(standby_fd_, replica_out_.data() + replica_sent_,
+                         replica_out_.size() - replica_sent_, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno) {
+                errno = 0;
+                break;
+            }
+            LOG("Dropping standby: %s", strerror(errno));
+            errno = 0;
+            DropStandby();
+            return;
+        }
+        replica_sent_ += n;
+    }
+    if (replica_sent_ == replica_out_.size()) {
+        replica_out_.clear();
+        replica_sent_ = 0;
+        fdcb(standby_fd_, selwrite, 0);
+        return;
+    }
+    if (replica_out_.size() - replica_sent_ > kMaxReplicaBacklog) {
+        LOG1("Dropping standby: too far behind");
+        DropStandby();
+        return;
+    }
+    if (replica_sent_ > replica_out_.size() / 2) {
+        replica_out_.erase(0, replica_sent_);
+        replica_sent_ = 0;
+    }
+    fdcb(standby_fd_, selwrite, wrap(mkref(this), &Enforcer::WriteReplica));
+}
+
+void
+Enforcer::ReplicationHeartbeat() {
+    if (standby_fd_ < 0) return;
+    Replicate("H\n", 2);
+    WriteReplica();
+    if (standby_fd_ >= 0) {
+        timers_->Arm(replica_timer_, 0, kReplicaHeartbeatNs);
+    }
+}
+
+void
+Enforcer::WatchPrimary() {
+    struct sockaddr_un addr;
+    ReplicationAddress(replication_path_, &addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK(fd >= 0);
+    if (0 != connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                     sizeof(addr))) {
+        close(fd);
+        errno = 0;
+        // A primary we followed before and that is gone for good
+        if (primary_pid_ != 0 && !PrimaryAlive()) {
+            TakeOver();
+            return;
+        }
+        delaycb(0, kPrimaryRetryNs,
+                wrap(mkref(this), &Enforcer::WatchPrimary));
+        return;
+    }
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    CHECK(0 == getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len));
+    primary_pid_ = cred.pid;
+    make_async(fd);
+    close_on_exec(fd);
+    primary_fd_ = fd;
+    replica_in_.clear();
+    fdcb(fd, selread, wrap(mkref(this), &Enforcer::ReadReplica));
+    if (!primary_timer_) {
+        primary_timer_ = timers_->NewTimer(
+            wrap(mkref(this), &Enforcer::PrimaryUnresponsive));
+    }
+    timers_->Arm(primary_timer_, takeover_ms_ / kSecondsToMilliseconds,
+                 (takeover_ms_ % kSecondsToMilliseconds) *
+                 kMillisecondsToNanoseconds);
+    LOG("Standing by for primary %d at %s", primary_pid_, addr.sun_path);
+}
+
+void
+Enforcer::ReadReplica() {
+    char buf[8192];
+    ssize_t n = read(primary_fd_, buf, sizeof(buf));
+    if (n < 0 && (EAGAIN == errno || EINTR == errno)) {
+        errno = 0;
+        return;
+    }
+    if (n <= 0) {
+        errno = 0;
+        LostPrimary();
+        return;
+    }
+    timers_->Arm(primary_timer_, takeover_ms_ / kSecondsToMilliseconds,
+                 (takeover_ms_ % kSecondsToMilliseconds) *
+                 kMillisecondsToNanoseconds);
+    replica_in_.append(buf, n);
+    size_t start = 0;
+    size_t end;
+    while ((end = replica_in_.find('\n', start)) != std::string::npos) {
+        replica_in_[end] = '\0';
+        ApplyReplica(replica_in_.c_str() + start);
+        start = end + 1;
+    }
+    replica_in_.erase(0, start);
+}
+
+void
+Enforcer::ApplyReplica(const char* line) {
+    if (line[0] == 'H') {
+        return;
+    } else if (line[0] == 'V') {
+        // A snapshot follows
+        CHECK(RegistrationJournal::ParseBase(line, &replica_base_));
+        replica_regs_.clear();
+    } else if (line[0] == 'G') {
+        unsigned int gen = 0;
+        int off = 0;
+        if (1 == sscanf(line, "G\t%u\t%n", &gen, &off) && off > 0) {
+            uint32_t& mine = replica_gens_[line + off];
+            mine = std::max(mine, static_cast<uint32_t>(gen));
+        }
+    } else if (!RegistrationJournal::ApplyLine(line, &replica_regs_)) {
+        LOG("Bad replication entry: %s", line);
+    }
+}
+
+void
+Enforcer::LostPrimary() {
+    timers_->Cancel(primary_timer_);
+    fdcb(primary_fd_, selread, 0);
+    close(primary_fd_);
+    primary_fd_ = -1;
+    if (PrimaryAlive()) {
+        // It dropped us (e.g. for falling behind); catch up again
+        LOG("Primary %d closed the connection", primary_pid_);
+        WatchPrimary();
+        return;
+    }
+    TakeOver();
+}
+
+void
+Enforcer::PrimaryUnresponsive() {
+    LOG("Primary %d silent for %u ms, killing it", primary_pid_,
+        takeover_ms_);
+    // Its connection closes once it is dead, which leads to LostPrimary()
+    CHECK(primary_pid_ > 0);
+    if (0 != kill(primary_pid_, SIGKILL)) {
+        LOG("kill %d: %s", primary_pid_, strerror(errno));
+        errno = 0;
+        LostPrimary();
+    }
+}
+
+bool
+Enforcer::PrimaryAlive() {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", primary_pid_);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        errno = 0;
+        return false;
+    }
+    char buf[512];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    // The state follows the command name, which may hold anything
+    const char* paren = strrchr(buf, ')');
+    return paren && paren[1] == ' ' && paren[2] != 'Z' && paren[2] != 'X';
+}
+
+void
+Enforcer::TakeOver() {
+    LOG("Taking over from primary %d", primary_pid_);
+    timers_->Cancel(primary_timer_);
+    standby_ = false;
+    BecomePrimary();
+    // The primary's log has every generation it published. Bumps it
+    // replicated but did not get to sync are folded in, so no generation
+    // it handed out can come back.
+    InitGenerations();
+    std::map<std::string, uint32_t>::const_iterator it;
+    for (it = replica_gens_.begin(); it != replica_gens_.end(); ++it) {
+        Target* t = InternTarget(it->first.c_str());
+        gen_no gen = it->second + generation_lease_;
+        if (gen > t->generation) {
+            gen_store_->Append(it->first.c_str(), gen);
+            t->generation = gen;
+            if (generation_lease_ > 0) {
+                t->ceiling = gen;
+            }
+        }
+    }
+    replica_gens_.clear();
+    // What the primary replicated is at least as new as its journal
+    std::vector<uint32_t> base(gen_vec_.base(), gen_vec_.lim());
+    restoring_.clear();
+    if (replica_base_ == base) {
+        restoring_.swap(replica_regs_);
+    }
+    replica_regs_.clear();
+    BindAfterPrimary(0);
+}
+
+void
+Enforcer::BindAfterPrimary(int attempt) {
+    int fd = inetsocket(SOCK_DGRAM, standby_port_, INADDR_ANY);
+    if (fd < 0) {
+        CHECK(attempt < kBindAttempts);
+        errno = 0;
+        delaycb(0, kBindRetryNs,
+                wrap(mkref(this), &Enforcer::BindAfterPrimary, attempt + 1));
+        return;
+    }
+    Serve(fd, standby_port_);
+    LOG("Serving on port %u as the primary", standby_port_);
+}
+
+gen_no
+Enforcer::LatestGeneration(const Target* t) {
+    return t->pending ? t->pending_generation : t->generation;
+}
 
 void
-Enforcer::Run() {
-    // Initialize generations from file
-    InitGenerations();
-    // Start server
-    int fd = inetsocket(SOCK_DGRAM, kFalconPort, INADDR_ANY);
-    CHECK(fd >= 0);
-    make_async(fd);
-    close_on_exec(fd);
-    srv_ = asrv::alloc(axprt_dgram::alloc(fd), spy_prog_1);
-    srv_->setcb(wrap(mkref(this), &Enforcer::Dispatch));
-    amain();
+Enforcer::IncrementGeneration(Target* t) {
+    AdvanceGeneration(t, LatestGeneration(t) + 1);
 }
 
 void
-Enforcer::InitGenerations() {
-    generation_log_ = fopen(logfile_name_, "a+");
-    CHECK(generation_log_);
-    const size_t kTargetSize = 256;
-    char target[kTargetSize];
-    while (NULL != fgets(target, kTargetSize, generation_log_)) {
-        size_t new_line = strlen(target) - 1;
-        target[new_line] = '\0';
-        generations_[target]++;
+Enforcer::FastForwardGeneration(const ref<const str> target, uint32_t new_gen) {
+    Target* t = InternTarget(*target);
+    // In the non-lethal case
+    if (new_gen < t->generation && !t->pending) {
+        LOG("Setting generation %d %d", new_gen, t->generation);
+        t->generation = new_gen;
+    }
+    if (new_gen > LatestGeneration(t)) {
+        AdvanceGeneration(t, new_gen);
     }
-    return;
 }
 
 void
-Enforcer::IncrementGeneration(const ref<const str> target) {
-    const char* buf = target->cstr();
-    CHECK(0 <= fprintf(generation_log_, "%s\n", buf));
-    CHECK(0 == fflush(generation_log_));
-    if (0 == fsync(fileno(generation_log_)) ||
-        EROFS == errno || EINVAL == errno) {
-        generations_[*target]++;
-    } else {
-        CHECK(0);
+Enforcer::AdvanceGeneration(Target* t, gen_no next) {
+    if (standby_fd_ >= 0) {
+        char line[kJournalLineSize];
+        int len = snprintf(line, sizeof(line), "G\t%u\t%s\n", next,
+                           t->handle->cstr());
+        CHECK(len > 0 && static_cast<size_t>(len) < sizeof(line));
+        Replicate(line, len);
+        ScheduleJournalFlush();
+    }
+    if (generation_lease_ > 0 && !t->pending && next <= t->ceiling) {
+        // Covered by a lease that is already on disk
+        t->generation = next;
+        return;
     }
+    t->pending = true;
+    t->pending_generation = next;
+    gen_store_->Stage(t->handle->cstr(), next + generation_lease_);
 }
 
 void
-Enforcer::FastForwardGeneration(const ref<const str> target, uint32_t new_gen) {
-    // In the non-lethal case
-    if (new_gen < generations_[*target]) {
-        LOG("Setting generation %d %d", new_gen, generations_[*target]);
-        generations_[*target] = new_gen;
+Enforcer::GenerationsDurable() {
+    GenerationBatch done;
+    gen_store_->Reap(&done);
+    GenerationBatch::iterator it;
+    for (it = done.begin(); it != done.end(); ++it) {
+        Target* t = FindTarget(it->first.c_str());
+        CHECK(t);
+        gen_no durable = it->second;
+        if (generation_lease_ > 0) {
+            t->ceiling = durable;
+        }
+        if (!t->pending) {
+            continue;
+        }
+        if (t->pending_generation > durable) {
+            // A later bump is still in flight. Without leases this
+            // intermediate generation is durable and may be published.
+            if (generation_lease_ == 0) {
+                t->generation = durable;
+            }
+            continue;
+        }
+        t->generation = t->pending_generation;
+        t->pending = false;
+        std::list<svccb*> waiting;
+        waiting.swap(t->deferred);
+        std::list<svccb*>::iterator w;
+        for (w = waiting.begin(); w != waiting.end(); ++w) {
+            Answer(*w);
+        }
     }
-    while (new_gen > generations_[*target]) {
-        IncrementGeneration(target);
+    return;
+}
+
+bool
+Enforcer::DeferUntilDurable(svccb *sbp, Target* t) {
+    UpdateGenerations(t->handle);
+    if (!t->pending) {
+        return false;
     }
+    t->deferred.push_back(sbp);
+    return true;
 }
 
 // Taken from www-theorie.physik.unizh.ch/~dpotter/howto/daemonize
@@ -125,120 +1204,435 @@ Enforcer::Prioritize() {
 const int32_t kClientTimeout = 90;  // Test every 1.5 minutes
 const int32_t kClientRetry = 5;  // Will remove after 7.5 minutes
 void
-Enforcer::DoHeartbeat(const ref<FalconClient> cl, int retry_count) {
-    cl->clnt_->timedcall(kClientTimeout, CLIENT_NULL, NULL, NULL,
+Enforcer::DoHeartbeat(const ref<ClientEndpoint> ep, int retry_count) {
+    if (!LiveEndpoint(ep)) return;
+    double idle = GetRealTime() - ep->last_heard_;
+    if (retry_count == 0 && idle < kClientTimeout) {
+        // Recent up/down traffic already proved the address reachable
+        timers_->Arm(ep->heartbeat_timer_,
+                     kClientTimeout - static_cast<int32_t>(idle), 0);
+        return;
+    }
+    ep->clnt_->timedcall(kClientTimeout, CLIENT_NULL, NULL, NULL,
                          wrap(mkref(this), &Enforcer::HandleClientHeartbeat,
-                              cl, retry_count));
+                              ep, retry_count));
     return;
 }
 
 void
-Enforcer::HandleClientHeartbeat(const ref<FalconClient> cl,
+Enforcer::HandleClientHeartbeat(const ref<ClientEndpoint> ep,
                                 int retry_count,
                                 clnt_stat status) {
-    if (all_clients_.count(cl) == 0) return;
+    if (!LiveEndpoint(ep)) return;
     if (status == RPC_SUCCESS || retry_count < kClientRetry) {
         if (status == RPC_SUCCESS) {
-            delaycb(kClientTimeout, wrap(mkref(this), &Enforcer::DoHeartbeat,
-                                         cl, 0));
+            ep->last_heard_ = GetRealTime();
+            timers_->Arm(ep->heartbeat_timer_, kClientTimeout, 0);
         } else {
+            heartbeat_failures_++;
             retry_count++;
-            DoHeartbeat(cl, retry_count);
+            DoHeartbeat(ep, retry_count);
         }
     } else {
-        RemoveClient(cl);
+        // The verdict holds for every client layer at this address
+        ClientSet doomed = ep->clients_;
+        ClientSet::iterator it;
+        for (it = doomed.begin(); it != doomed.end(); ++it) {
+            RemoveClient(*it);
+        }
+    }
+    return;
+}
+
+void
+Enforcer::EndpointReplied(const ref<ClientEndpoint> ep, clnt_stat status) {
+    if (status == RPC_SUCCESS) {
+        ep->last_heard_ = GetRealTime();
     }
     return;
 }
 
+bool
+Enforcer::LiveEndpoint(const ref<ClientEndpoint> ep) {
+    ptr<ClientEndpoint> cur = endpoints_[ep->key_];
+    return cur && &*cur == &*ep;
+}
+
+FalconClient::FalconClient(const client_addr_t& addr,
+                           const ref<ClientEndpoint>& ep) :
+        key_(addr), endpoint_(ep), clnt_(ep->clnt_),
+        client_tag_(addr.client_tag) {}
+
 const int32_t kClientStrBuf = 64;
+const str&
+FalconClient::Id() {
+    if (!id_) {
+        char buf[kClientStrBuf];
+        in_addr a;
+        a.s_addr = key_.ipaddr;
+        snprintf(buf, kClientStrBuf, "%s:%u:%u", inet_ntoa(a),
+                 ntohs(key_.port), key_.tag);
+        id_ = buf;
+    }
+    return id_;
+}
+
 ref<FalconClient>
 Enforcer::GetClient(const client_addr_t& addr) {
-    ref<FalconClient> new_client = New refcounted<FalconClient>;
-    // Create id string from addr
-    char buf[kClientStrBuf];
-    in_addr a;
-    a.s_addr = addr.ipaddr;
-    snprintf(buf, kClientStrBuf, "%s:%u:%u", inet_ntoa(a),
-             ntohs(addr.port), addr.client_tag);
-    new_client->id = buf;
-    new_client->client_tag_ = addr.client_tag;
-    // Check if id is in place
-    if (all_clients_.count(new_client) == 0) {
-        LOG("Adding new client: %s", buf);
-        int cfd = inetsocket(SOCK_DGRAM, 0, 0);
-        CHECK(cfd >= 0);
-        make_async(cfd);
-        close_on_exec(cfd);
-        struct sockaddr_in iaddr;
-        memset(&iaddr, 0, sizeof(iaddr));
-        iaddr.sin_family = AF_INET;
-        iaddr.sin_addr.s_addr = addr.ipaddr;
-        iaddr.sin_port = addr.port;
-        ptr<aclnt> clnt = aclnt::alloc(axprt_dgram::alloc(cfd), client_prog_1,
-                                reinterpret_cast<sockaddr *>(&iaddr),
-                                callbase_alloc<rpccb_unreliable>);
-        new_client->clnt_ = clnt;
-        all_clients_.insert(new_client);
-        DoHeartbeat(new_client, 0);
+    client_key key(addr);
+    ptr<FalconClient> cl = all_clients_[key];
+    if (cl) {
+        return mkref(cl);
+    }
+    ref<FalconClient> new_client =
+        New refcounted<FalconClient>(addr, GetEndpoint(addr));
+    LOG("Adding new client: %s", new_client->Id().cstr());
+    new_client->endpoint_->clients_.insert(new_client);
+    all_clients_.insert(key, new_client);
+    return new_client;
+}
+
+ref<ClientEndpoint>
+Enforcer::GetEndpoint(const client_addr_t& addr) {
+    client_key key = client_key(addr).Endpoint();
+    ptr<ClientEndpoint> ep = endpoints_[key];
+    if (ep) {
+        return mkref(ep);
+    }
+    int cfd = inetsocket(SOCK_DGRAM, 0, 0);
+    CHECK(cfd >= 0);
+    make_async(cfd);
+    close_on_exec(cfd);
+    struct sockaddr_in iaddr;
+    memset(&iaddr, 0, sizeof(iaddr));
+    iaddr.sin_family = AF_INET;
+    iaddr.sin_addr.s_addr = addr.ipaddr;
+    iaddr.sin_port = addr.port;
+    ptr<aclnt> clnt = aclnt::alloc(axprt_dgram::alloc(cfd), client_prog_1,
+                            reinterpret_cast<sockaddr *>(&iaddr),
+                            callbase_alloc<rpccb_unreliable>);
+    ref<ClientEndpoint> new_ep = New refcounted<ClientEndpoint>(key, clnt);
+    endpoints_.insert(key, new_ep);
+    new_ep->flush_timer_ = timers_->NewTimer(
+        wrap(mkref(this), &Enforcer::FlushEndpoint, new_ep));
+    new_ep->heartbeat_timer_ = timers_->NewTimer(
+        wrap(mkref(this), &Enforcer::DoHeartbeat, new_ep, 0));
+    DoHeartbeat(new_ep, 0);
+    return new_ep;
+}
+
+// Entries queued within this window of each other share one datagram
+const int32_t kFlushWindowNs = 500 * 1000;
+// Keeps batches well inside a UDP datagram
+const size_t kMaxBatch = 64;
+
+void
+Enforcer::ScheduleFlush(const ref<ClientEndpoint> ep) {
+    // Endpoints that have been dropped have no timers
+    if (!ep->flush_timer_ || TimerWheel::Armed(ep->flush_timer_)) return;
+    timers_->Arm(ep->flush_timer_, 0, kFlushWindowNs);
+}
+
+void
+Enforcer::FlushEndpoint(const ref<ClientEndpoint> ep) {
+    std::vector<client_up_arg> ups;
+    std::vector<pending_down> downs;
+    ups.swap(ep->ups_);
+    downs.swap(ep->downs_);
+
+    // Downs go out first. They are tracked until they are acked, as a
+    // batch if sent as one.
+    if (downs.size() == 1 || (!downs.empty() && !ep->batches_)) {
+        for (size_t i = 0; i < downs.size(); ++i) {
+            SendDowns(ep, std::vector<pending_down>(1, downs[i]));
+        }
+    } else {
+        for (size_t i = 0; i < downs.size(); i += kMaxBatch) {
+            size_t n = std::min(kMaxBatch, downs.size() - i);
+            SendDowns(ep, std::vector<pending_down>(downs.begin() + i,
+                                                    downs.begin() + i + n));
+        }
+    }
+
+    // Ups are fire and forget
+    if (ups.size() == 1 || (!ups.empty() && !ep->batches_)) {
+        for (size_t i = 0; i < ups.size(); ++i) {
+            ep->clnt_->call(CLIENT_UP, &ups[i], NULL,
+                            wrap(mkref(this), &Enforcer::EndpointReplied, ep));
+        }
+    } else {
+        for (size_t i = 0; i < ups.size(); i += kMaxBatch) {
+            size_t n = std::min(kMaxBatch, ups.size() - i);
+            ref<client_up_batch_arg> a = New refcounted<client_up_batch_arg>;
+            a->ups.setsize(n);
+            for (size_t j = 0; j < n; ++j) {
+                a->ups[j] = ups[i + j];
+            }
+            ep->clnt_->call(CLIENT_UP_BATCH, a, NULL,
+                            wrap(mkref(this), &Enforcer::UpBatchSent, ep, a));
+        }
+    }
+    return;
+}
+
+void
+Enforcer::UpBatchSent(const ref<ClientEndpoint> ep,
+                      const ref<client_up_batch_arg> arg,
+                      clnt_stat status) {
+    if (status != RPC_PROCUNAVAIL) {
+        EndpointReplied(ep, status);
+        return;
+    }
+    LOG1("Client does not support batches");
+    ep->batches_ = false;
+    for (size_t i = 0; i < arg->ups.size(); ++i) {
+        ep->clnt_->call(CLIENT_UP, &arg->ups[i], NULL,
+                        wrap(mkref(this), &Enforcer::EndpointReplied, ep));
     }
-    return *(all_clients_.find(new_client));
+    return;
 }
 
 void
 Enforcer::RemoveClient(const ref<FalconClient> c) {
-    LOG("Remvoing client %s", c->id.cstr());
-    all_clients_.erase(c);
-    std::map<str, int32_t>::iterator it;
-    for (it = c->up_intervals_.begin(); it != c->up_intervals_.end(); ++it) {
-        target_clients_[it->first].erase(c);
-        deadly_[it->first].erase(c);
-        if (target_clients_[it->first].empty()) {
-            ref<str> target = New refcounted<str>(it->first);
-            StopMonitoring(target);
+    // A client can be removed twice (e.g. by a failed down call and a
+    // failed heartbeat). Only the first time counts.
+    ptr<FalconClient> cur = all_clients_[c->key_];
+    if (!cur || &*cur != &*c) return;
+    LOG("Remvoing client %s", c->Id().cstr());
+    all_clients_.remove(c->key_);
+    ref<ClientEndpoint> ep = c->endpoint_;
+    ep->clients_.erase(c);
+    if (ep->clients_.empty()) {
+        endpoints_.remove(ep->key_);
+        timers_->FreeTimer(ep->flush_timer_);
+        timers_->FreeTimer(ep->heartbeat_timer_);
+        ep->flush_timer_ = ep->heartbeat_timer_ = NULL;
+    }
+    std::map<Target*, registration>::iterator it;
+    for (it = c->registrations_.begin(); it != c->registrations_.end();
+         ++it) {
+        Target* t = it->first;
+        timers_->FreeTimer(it->second.repeat);
+        JournalRegistration(t, c, false);
+        t->clients.erase(c);
+        t->waiting.erase(c);
+        t->deadly.erase(c);
+        // As in Unregister(): the tightest deadline may loosen. UpdateDeadline
+        // skips c, which is no longer among t's clients.
+        uint32_t deadline_ms = it->second.deadline_ms;
+        if (deadline_ms != 0 && deadline_ms == t->requested_ms) {
+            UpdateDeadline(t);
         }
+        if (t->clients.empty()) {
+            StopMonitoring(t->handle);
+        }
+    }
+    c->registrations_.clear();
+    return;
+}
+
+void
+Enforcer::Unregister(const ref<FalconClient> c, Target* t) {
+    std::map<Target*, registration>::iterator it = c->registrations_.find(t);
+    if (it == c->registrations_.end()) return;
+    uint32_t deadline_ms = it->second.deadline_ms;
+    timers_->FreeTimer(it->second.repeat);
+    c->registrations_.erase(it);
+    // Only the tightest deadline can loosen when it goes
+    if (deadline_ms != 0 && deadline_ms == t->requested_ms) {
+        UpdateDeadline(t);
     }
     return;
 }
 
+void
+Enforcer::UpdateDeadline(Target* t) {
+    uint32_t tightest = 0;
+    ClientSet::iterator it;
+    for (it = t->clients.begin(); it != t->clients.end(); ++it) {
+        std::map<Target*, registration>::iterator reg =
+            (*it)->registrations_.find(t);
+        if (reg == (*it)->registrations_.end()) continue;
+        uint32_t d = reg->second.deadline_ms;
+        if (d != 0 && (tightest == 0 || d < tightest)) {
+            tightest = d;
+        }
+    }
+    if (tightest == t->requested_ms) {
+        return;
+    }
+    t->requested_ms = tightest;
+    t->deadline_ms = SetDeadline(t->handle, tightest);
+    LOG("%s: detection deadline %u ms (asked for %u)", t->handle->cstr(),
+        t->deadline_ms, tightest);
+}
+
 void
 Enforcer::ObserveUp(const ref<const str> target) {
-    std::set<ref<FalconClient> > fc_set = waiting_for_up_[*target];
-    waiting_for_up_[*target].clear();
-    std::set<ref<FalconClient> >::iterator it;
+    Target* t = FindTarget(*target);
+    if (!t) {
+        return;
+    }
+    Count(t, &target_stats::ups);
+    t->suspect_ns = 0;
+    ClientSet fc_set;
+    fc_set.swap(t->waiting);
+    bool shed = (Overload() >= SHED_UPS);
+    ClientSet::iterator it;
     for (it = fc_set.begin(); it != fc_set.end(); ++it) {
+        // A shed up is not lost for good: the client waits for the next
+        if (shed || (*it)->endpoint_->ups_.size() >= kMaxQueuedUps) {
+            shed_ups_++;
+            RepeatWaiting(t, *it);
+            continue;
+        }
         client_up_arg a;
-        a.handle = *target;
-        a.generation = gen_vec_;
-        a.generation.push_back(generations_[*target]);
+        a.handle = *t->handle;
+        SetReplyGeneration(t, &a.generation);
         a.client_tag = (*it)->client_tag_;
-        (*it)->clnt_->call(CLIENT_UP, &a, NULL, aclnt_cb_null);
-        RepeatWaiting(target, *it);
+        (*it)->endpoint_->ups_.push_back(a);
+        ScheduleFlush((*it)->endpoint_);
+        RepeatWaiting(t, *it);
+    }
+    return;
+}
+
+namespace {
+// Bounds on the per-endpoint retransmission timeout. The floor keeps a
+// retransmission at least two wheel ticks out.
+const uint64_t kMinRtoNs = 2 * kTimerResolutionNs;
+const uint64_t kMaxRtoNs = 2ULL * 1000 * 1000 * 1000;
+}  // end anonymous namespace
+
+void
+Enforcer::SendDowns(const ref<ClientEndpoint> ep,
+                    const std::vector<pending_down>& downs) {
+    uint32_t id = next_flight_++;
+    ref<down_flight> f = New refcounted<down_flight>(ep);
+    f->downs = downs;
+    f->sent_ns = TimerWheel::Now();
+    down_flights_.insert(id, f);
+
+    // The rpc layer gives up at the deadline; until then we retransmit
+    time_t s = down_deadline_ms_ / kSecondsToMilliseconds;
+    uint32_t ns = (down_deadline_ms_ % kSecondsToMilliseconds) *
+                  kMillisecondsToNanoseconds;
+    callbase* call;
+    if (downs.size() == 1) {
+        LOG("Sending down to %s", downs[0].client->Id().cstr());
+        call = ep->clnt_->timedcall(s, ns, CLIENT_DOWN, downs[0].arg, NULL,
+                    wrap(mkref(this), &Enforcer::DownsAnswered, id));
+    } else {
+        LOG("Sending down batch of %zu", downs.size());
+        ref<client_down_batch_arg> a = New refcounted<client_down_batch_arg>;
+        a->downs.setsize(downs.size());
+        for (size_t i = 0; i < downs.size(); ++i) {
+            a->downs[i] = *downs[i].arg;
+        }
+        f->batch = a;
+        call = ep->clnt_->timedcall(s, ns, CLIENT_DOWN_BATCH, a, NULL,
+                    wrap(mkref(this), &Enforcer::DownsAnswered, id));
+    }
+    // The call may have failed on the spot
+    if (!down_flights_[id] || !call) return;
+    f->call = static_cast<rpccb_unreliable*>(call);
+    f->timer = timers_->NewTimer(wrap(mkref(this), &Enforcer::RetransmitDowns,
+                                      id));
+    timers_->Arm(f->timer, ep->rto_ns_ / kSecondsToNanoseconds,
+                 ep->rto_ns_ % kSecondsToNanoseconds);
+    return;
+}
+
+void
+Enforcer::RetransmitDowns(uint32_t id) {
+    ptr<down_flight> f = down_flights_[id];
+    if (!f || !f->call) return;
+    LOG("Retransmitting down call %u (%u)", id, f->xmits);
+    f->call->xmit(f->xmits);
+    f->xmits++;
+    std::vector<pending_down>::iterator it;
+    for (it = f->downs.begin(); it != f->downs.end(); ++it) {
+        Count(it->target, &target_stats::down_retries);
     }
+    // Exponential backoff from the endpoint's current timeout
+    uint32_t shift = std::min(f->xmits - 1, 16U);
+    uint64_t rto = std::min(f->ep->rto_ns_ << shift, kMaxRtoNs);
+    timers_->Arm(f->timer, rto / kSecondsToNanoseconds,
+                 rto % kSecondsToNanoseconds);
     return;
 }
 
-const int kMaxRetries = 3;
 void
-Enforcer::ReportDown(const ref<FalconClient> cl, const ref<client_down_arg> arg,
-                     int32_t retries, clnt_stat status) {
-    if (status == RPC_SUCCESS && retries != 0) {
-        cl->up_intervals_.erase(arg->handle);
-        target_clients_[arg->handle].erase(cl);
-        deadly_[arg->handle].erase(cl);
-        if (cl->up_intervals_.empty()) {
-            RemoveClient(cl);
+Enforcer::DownsAnswered(uint32_t id, clnt_stat status) {
+    ptr<down_flight> fp = down_flights_[id];
+    if (!fp) return;
+    ref<down_flight> f = mkref(fp);
+    down_flights_.remove(id);
+    f->call = NULL;
+    if (f->timer) {
+        timers_->FreeTimer(f->timer);
+        f->timer = NULL;
+    }
+    const ref<ClientEndpoint> ep = f->ep;
+    std::vector<pending_down>::iterator it;
+    if (status == RPC_SUCCESS) {
+        EndpointReplied(ep, status);
+        // Karn: an ack for a retransmitted call is an ambiguous sample
+        if (f->xmits == 1) {
+            SampleRtt(ep, TimerWheel::Now() - f->sent_ns);
+        }
+        for (it = f->downs.begin(); it != f->downs.end(); ++it) {
+            DownDelivered(it->target, it->client);
         }
-        LOG("Successfully sent down %s", cl->id.cstr());
+        LOG("Successfully sent %zu downs", f->downs.size());
         return;
-    } else if (retries == kMaxRetries) {
-        LOG1("Removing client");
-        RemoveClient(cl);
+    } else if (status == RPC_PROCUNAVAIL && f->batch) {
+        // An older client: fall back to one call per target
+        LOG1("Client does not support batches");
+        ep->batches_ = false;
+        for (it = f->downs.begin(); it != f->downs.end(); ++it) {
+            SendDowns(ep, std::vector<pending_down>(1, *it));
+        }
         return;
     }
-    LOG("Doing %d down call for %s", retries + 1,  cl->id.cstr());
-    cl->clnt_->call(CLIENT_DOWN, arg, NULL, wrap(mkref(this),
-                    &Enforcer::ReportDown, cl, arg, retries + 1));
+    LOG("Down call %u failed after %u transmissions (%d), removing clients",
+        id, f->xmits, status);
+    for (it = f->downs.begin(); it != f->downs.end(); ++it) {
+        Count(it->target, &target_stats::down_failures);
+        RemoveClient(it->client);
+    }
+    return;
+}
+
+void
+Enforcer::SampleRtt(const ref<ClientEndpoint> ep, uint64_t rtt_ns) {
+    if (ep->srtt_ns_ == 0) {
+        ep->srtt_ns_ = rtt_ns;
+        ep->rttvar_ns_ = rtt_ns / 2;
+    } else {
+        uint64_t err = (ep->srtt_ns_ > rtt_ns) ? ep->srtt_ns_ - rtt_ns :
+                                                 rtt_ns - ep->srtt_ns_;
+        ep->rttvar_ns_ = (3 * ep->rttvar_ns_ + err) / 4;
+        ep->srtt_ns_ = (7 * ep->srtt_ns_ + rtt_ns) / 8;
+    }
+    uint64_t rto = ep->srtt_ns_ + std::max(static_cast<uint64_t>(
+                       kTimerResolutionNs), 4 * ep->rttvar_ns_);
+    ep->rto_ns_ = std::max(kMinRtoNs, std::min(rto, kMaxRtoNs));
+    return;
+}
+
+void
+Enforcer::DownDelivered(Target* t, const ref<FalconClient> cl) {
+    if (t->down_ns) {
+        RecordLatency(t, &target_stats::down_delivery,
+                      TimerWheel::Now() - t->down_ns);
+    }
+    Unregister(cl, t);
+    t->clients.erase(cl);
+    t->deadly.erase(cl);
+    if (cl->registrations_.empty()) {
+        RemoveClient(cl);
+    }
     return;
 }
 
@@ -248,206 +1642,604 @@ Enforcer::ObserveDown(const ref<const str> target,
                       const bool killed,
                       const bool would_kill) {
     LOG("%s", target->cstr());
+    Target* t = InternTarget(*target);
+    uint64_t now = TimerWheel::Now();
+    Count(t, &target_stats::downs);
+    if (t->suspect_ns) {
+        RecordLatency(t, &target_stats::timeout_to_down, now - t->suspect_ns);
+        t->suspect_ns = 0;
+    }
+    t->down_ns = now;
     // Get clients to contact
-    std::set<ref<FalconClient> >& fc_set = target_clients_[*target];
-    std::set<ref<FalconClient> >::iterator it;
+    ClientSet& fc_set = t->clients;
+    ClientSet::iterator it;
 
-    // Send response
-    // TODO(leners) add retries.
+    // Send response. Downs are queued per endpoint and sent by SendDowns(),
+    // which retransmits them (RetransmitDowns()) until they are answered.
     for (it = fc_set.begin(); it != fc_set.end(); ++it) {
         // Construct response
         ref<client_down_arg> a = New refcounted<client_down_arg>;
-        a->handle = *target;
-        a->generation = gen_vec_;
-        a->generation.push_back(generations_[*target]);
+        a->handle = *t->handle;
+        SetReplyGeneration(t, &a->generation);
         a->layer_status = status;
         a->killed = killed;
         a->would_kill = would_kill;
         a->client_tag = (*it)->client_tag_;
 
-        LOG("Down call for: %s", (*it)->id.cstr());
-        ReportDown(*it, a, 0, RPC_SUCCESS /* this arg is ignored */);
+        LOG("Down call for: %s", (*it)->Id().cstr());
+        (*it)->endpoint_->downs_.push_back(pending_down(t, *it, a));
+        ScheduleFlush((*it)->endpoint_);
+        // A restarted enforcer must not watch the next incarnation for it
+        JournalRegistration(t, *it, false);
     }
-    IncrementGeneration(target);
+    IncrementGeneration(t);
 
     // The layer is gone, there are no more clients to give
     fc_set.clear();
-    waiting_for_up_[*target].clear();
-    StopMonitoring(target);
+    t->waiting.clear();
+    StopMonitoring(t->handle);
     return;
 }
 
 void
-Enforcer::AddToWaiting(const ref<const str> target,
-                       const ref<FalconClient> client) {
-    if (1 == target_clients_[*target].count(client)) {
-        waiting_for_up_[*target].insert(client);
+Enforcer::AddToWaiting(Target* t, const ref<FalconClient> client) {
+    if (1 == t->clients.count(client)) {
+        t->waiting.insert(client);
     }
     return;
 }
 
 void
-Enforcer::RepeatWaiting(const ref<const str> target,
-                        const ref<FalconClient> client) {
-    if (1 == target_clients_[*target].count(client)) {
-        int32_t delay = client->up_intervals_[*target];
+Enforcer::RepeatWaiting(Target* t, const ref<FalconClient> client) {
+    std::map<Target*, registration>::iterator reg =
+        client->registrations_.find(t);
+    if (reg != client->registrations_.end() &&
+        1 == t->clients.count(client)) {
+        int32_t delay = reg->second.up_interval;
         if (delay < 0) {
             return;
         }
         if (delay == 0) {
-            AddToWaiting(target, client);
+            AddToWaiting(t, client);
             return;
         }
         int32_t delay_s = delay / kSecondsToMilliseconds;
         int32_t delay_ns = (delay % kSecondsToMilliseconds) *
                            kMillisecondsToNanoseconds;
-        delaycb(delay_s, delay_ns,
-                wrap(mkref(this), &Enforcer::AddToWaiting,
-                     target, client));
+        timers_->Arm(reg->second.repeat, delay_s, delay_ns);
     }
     return;
 }
 
 spy_status
-Enforcer::GenCheck(const ref<const str> target,
+Enforcer::GenCheck(const Target* t,
                    const rpc_vec<gen_no, RPC_INFINITY>& query_gen) {
-    UpdateGenerations(target);
-    rpc_vec<gen_no, RPC_INFINITY> my_vec = gen_vec_;
-    my_vec.push_back(generations_[*target]);
-    // Check whether we are actually monitoring the target
-    if (InvalidTarget(target)) {
-        return FALCON_UNKNOWN_TARGET;
-    }
-    // Sanity check generation vector
-    if (my_vec.size() != query_gen.size()) {
+    // Ours is gen_vec_ followed by t's generation
+    size_t n = gen_vec_.size();
+    if (query_gen.size() != n + 1) {
         return FALCON_BAD_GEN_VEC;
     }
     // Check Generation vector
-    for (unsigned int i = 0; i < query_gen.size(); ++i) {
-        if (my_vec[i] < query_gen[i]) {
-            LOG("Future gen %i me: %d them: %d", i, my_vec[i], query_gen[i]);
+    for (unsigned int i = 0; i <= n; ++i) {
+        gen_no mine = (i < n) ? gen_vec_[i] : t->generation;
+        if (mine < query_gen[i]) {
+            LOG("Future gen %i me: %d them: %d", i, mine, query_gen[i]);
             return FALCON_FUTURE_GEN;
-        } else if (my_vec[i] > query_gen[i]) {
+        } else if (mine > query_gen[i]) {
             return FALCON_LONG_DEAD;
         }
     }
     return FALCON_SUCCESS;
 }
 
+spy_status
+Enforcer::PrefixCheck(const rpc_vec<gen_no, RPC_INFINITY>& query_gen) {
+    for (size_t i = 0; i < gen_vec_.size(); ++i) {
+        if (gen_vec_[i] != query_gen[i]) {
+            LOG("Wrong gen %zu me: %d them: %d", i, gen_vec_[i],
+                query_gen[i]);
+            return FALCON_WRONG_GEN;
+        }
+    }
+    return FALCON_SUCCESS;
+}
+
+spy_status
+Enforcer::RegisterClient(Target* t, const target_t& target,
+                         const client_addr_t& client, bool lethal,
+                         int32_t up_interval_ms, uint32_t deadline_ms,
+                         bool* watch) {
+    // A vector that stops short of t's own generation registers for its
+    // current incarnation, as if the client had asked with SPY_GET_GEN
+    // just before. The layers below must still match ours exactly.
+    spy_status status = FALCON_SUCCESS;
+    if (target.generation.size() == gen_vec_.size()) {
+        status = PrefixCheck(target.generation);
+    } else {
+        status = GenCheck(t, target.generation);
+    }
+    if (status != FALCON_SUCCESS) {
+        LOG("Gen error target %s", t->handle->cstr());
+        return status;
+    }
+    // Add the client (if necessary)
+    ref<FalconClient> cl = GetClient(client);
+    bool new_client = t->clients.insert(cl).second;
+    registration& reg = cl->registrations_[t];
+    reg.up_interval = up_interval_ms;
+    uint32_t was = reg.deadline_ms;
+    reg.deadline_ms = deadline_ms;
+    // A new registration can only tighten the deadline
+    if (!new_client && was != 0 && was == t->requested_ms) {
+        UpdateDeadline(t);
+    } else if (t->requested_ms == kNoDeadline ||
+               (deadline_ms != 0 && (t->requested_ms == 0 ||
+                                     deadline_ms < t->requested_ms))) {
+        UpdateDeadline(t);
+    }
+    if (!reg.repeat) {
+        reg.repeat = timers_->NewTimer(
+            wrap(mkref(this), &Enforcer::AddToWaiting, t, cl));
+    }
+    RepeatWaiting(t, cl);
+    if (lethal) {
+        t->deadly.insert(cl);
+    }
+    *watch = (t->clients.size() == 1 && new_client);
+    JournalRegistration(t, cl, true);
+    Count(t, &target_stats::registers);
+    return FALCON_REGISTER_ACK;
+}
+
+spy_status
+Enforcer::CancelClient(Target* t, const target_t& target,
+                       const client_addr_t& client, bool* unwatch) {
+    spy_status status = GenCheck(t, target.generation);
+    if (status != FALCON_SUCCESS) {
+        LOG("tried to cancel %s, but couldn't", t->handle->cstr());
+        return status;
+    }
+    ref<FalconClient> cl = GetClient(client);
+    if (t->clients.erase(cl) != 1) {
+        return FALCON_CANCEL_ERROR;
+    }
+    JournalRegistration(t, cl, false);
+    Unregister(cl, t);
+    t->waiting.erase(cl);
+    t->deadly.erase(cl);
+    Count(t, &target_stats::cancels);
+    *unwatch = t->clients.empty();
+    if (*unwatch) {
+        LOG("Cancled %s", t->handle->cstr());
+    } else {
+        LOG("Would cancel %s, but there are other clients",
+            t->handle->cstr());
+    }
+    if (cl->registrations_.size() == 0) {
+        RemoveClient(cl);
+    } else {
+       LOG("At least %s is still in the map.",
+            cl->registrations_.begin()->first->handle->cstr());
+    }
+    return FALCON_CANCEL_ACK;
+}
+
+void
+Enforcer::RegisterBatch(svccb *sbp) {
+    spy_register_batch_arg *argp =
+        sbp->Xtmpl getarg<spy_register_batch_arg> ();
+    size_t n = argp->entries.size();
+    // Look every target up first. The whole batch waits for any generation
+    // bump still in flight.
+    std::vector<Target*> targets(n, static_cast<Target*>(NULL));
+    for (size_t i = 0; i < n; ++i) {
+        const str& handle = argp->entries[i].target.handle;
+        if (!OwnsTarget(handle)) {
+            continue;
+        }
+        targets[i] = GetValidTarget(handle);
+        if (targets[i] && DeferUntilDurable(sbp, targets[i])) {
+            return;
+        }
+    }
+    spy_batch_res res;
+    res.results.setsize(n);
+    std::vector<Target*> watch;
+    for (size_t i = 0; i < n; ++i) {
+        const spy_register_entry& e = argp->entries[i];
+        spy_res& r = res.results[i];
+        r.deadline_ms = 0;
+        r.target.handle = e.target.handle;
+        Target* t = targets[i];
+        if (!OwnsTarget(e.target.handle)) {
+            r.status = FALCON_WRONG_SHARD;
+            continue;
+        } else if (!t) {
+            r.status = FALCON_UNKNOWN_TARGET;
+            continue;
+        }
+        SetReplyGeneration(t, &r.target.generation);
+        bool w = false;
+        r.status = RegisterClient(t, e.target, argp->client, e.lethal,
+                                  e.up_interval_ms, e.deadline_ms, &w);
+        r.deadline_ms = t->deadline_ms;
+        if (w) {
+            watch.push_back(t);
+        }
+    }
+    // Monitoring starts once the whole batch is applied
+    for (size_t i = 0; i < watch.size(); ++i) {
+        StartMonitoring(watch[i]->handle);
+    }
+    LOG("Registered batch of %zu, %zu new targets", n, watch.size());
+    sbp->reply(&res);
+}
+
+void
+Enforcer::CancelBatch(svccb *sbp) {
+    spy_cancel_batch_arg *argp = sbp->Xtmpl getarg<spy_cancel_batch_arg> ();
+    size_t n = argp->targets.size();
+    std::vector<Target*> targets(n, static_cast<Target*>(NULL));
+    for (size_t i = 0; i < n; ++i) {
+        const str& handle = argp->targets[i].handle;
+        if (!OwnsTarget(handle)) {
+            continue;
+        }
+        targets[i] = GetValidTarget(handle);
+        if (targets[i] && DeferUntilDurable(sbp, targets[i])) {
+            return;
+        }
+    }
+    spy_batch_res res;
+    res.results.setsize(n);
+    std::vector<Target*> unwatch;
+    for (size_t i = 0; i < n; ++i) {
+        spy_res& r = res.results[i];
+        r.deadline_ms = 0;
+        r.target.handle = argp->targets[i].handle;
+        Target* t = targets[i];
+        if (!OwnsTarget(argp->targets[i].handle)) {
+            r.status = FALCON_WRONG_SHARD;
+            continue;
+        } else if (!t) {
+            r.status = FALCON_UNKNOWN_TARGET;
+            continue;
+        }
+        SetReplyGeneration(t, &r.target.generation);
+        bool u = false;
+        r.status = CancelClient(t, argp->targets[i], argp->client, &u);
+        if (u) {
+            unwatch.push_back(t);
+        }
+    }
+    for (size_t i = 0; i < unwatch.size(); ++i) {
+        StopMonitoring(unwatch[i]->handle);
+    }
+    LOG("Cancelled batch of %zu, %zu targets unwatched", n, unwatch.size());
+    sbp->reply(&res);
+}
+
+namespace {
+// Event loop lateness at which each shed_level starts
+const uint64_t kShedQueriesNs = 10 * 1000 * 1000;
+const uint64_t kShedRegistersNs = 50 * 1000 * 1000;
+const uint64_t kShedUpsNs = 200 * 1000 * 1000;
+// A batch costs one token plus one per this many entries
+const size_t kBatchEntriesPerToken = 16;
+}  // end anonymous namespace
+
+shed_level
+Enforcer::Overload() const {
+    uint64_t late = timers_->Lateness();
+    if (late >= kShedUpsNs) return SHED_UPS;
+    if (late >= kShedRegistersNs) return SHED_REGISTERS;
+    if (late >= kShedQueriesNs) return SHED_QUERIES;
+    return SHED_NONE;
+}
+
+uint32_t
+Enforcer::SourceOf(svccb *sbp) {
+    const sockaddr* sa = sbp->getsa();
+    if (!sa || sa->sa_family != AF_INET) {
+        return 0;
+    }
+    const sockaddr_in* sin = reinterpret_cast<const sockaddr_in*>(sa);
+    return (sin->sin_addr.s_addr ^
+            (static_cast<uint32_t>(sin->sin_port) << 16)) & 0x7fffffffU;
+}
+
+bool
+Enforcer::Admit(svccb *sbp, uint32_t source) {
+    shed_level cutoff;
+    uint32_t* shed;
+    double cost = 1;
+    switch (sbp->proc()) {
+        case SPY_KILL:
+            return true;
+        case SPY_STATS:
+            // Needed most when things are bad, so only the bucket applies
+            cutoff = SHED_UPS;
+            shed = &shed_queries_;
+            break;
+        case SPY_REGISTER:
+        case SPY_CANCEL:
+            cutoff = SHED_REGISTERS;
+            shed = &shed_registers_;
+            break;
+        case SPY_REGISTER_BATCH:
+            cutoff = SHED_REGISTERS;
+            shed = &shed_registers_;
+            cost += sbp->Xtmpl getarg<spy_register_batch_arg>()->
+                    entries.size() / kBatchEntriesPerToken;
+            break;
+        case SPY_CANCEL_BATCH:
+            cutoff = SHED_REGISTERS;
+            shed = &shed_registers_;
+            cost += sbp->Xtmpl getarg<spy_cancel_batch_arg>()->
+                    targets.size() / kBatchEntriesPerToken;
+            break;
+        default:
+            cutoff = SHED_QUERIES;
+            shed = &shed_queries_;
+            break;
+    }
+    if (cutoff != SHED_UPS && Overload() >= cutoff) {
+        (*shed)++;
+        return false;
+    }
+    if (admission_rate_ == 0) {
+        return true;
+    }
+    token_bucket& b = buckets_[(source * 2654435761U) % kAdmissionBuckets];
+    uint64_t now = TimerWheel::Now();
+    b.tokens = std::min(static_cast<double>(admission_burst_),
+                        b.tokens + (now - b.refilled_ns) *
+                                   kNanosecondsToSeconds * admission_rate_);
+    b.refilled_ns = now;
+    // A batch bigger than the burst goes through on a full bucket
+    if (b.tokens < std::min(cost, static_cast<double>(admission_burst_))) {
+        (*shed)++;
+        return false;
+    }
+    b.tokens -= cost;
+    return true;
+}
+
 void
 Enforcer::Dispatch(svccb *sbp) {
+    if (!Admit(sbp, SourceOf(sbp))) {
+        // Dropped like a lost datagram; the client retries after its
+        // timeout
+        sbp->ignore();
+        return;
+    }
+    Answer(sbp);
+}
+
+void
+Enforcer::Answer(svccb *sbp) {
     switch (sbp->proc()) {
         case SPY_NULL:
             sbp->reply(0);
             break;
         case SPY_REGISTER: {
-            spy_res res;
             spy_register_arg *argp = sbp->Xtmpl getarg<spy_register_arg> ();
-            const ref<str> target = New refcounted<str>(argp->target.handle);
-            res.target.handle = argp->target.handle;
-            rpc_vec<gen_no, RPC_INFINITY> my_vec = gen_vec_;
-            my_vec.push_back(generations_[res.target.handle]);
-            res.target.generation = my_vec;
-            res.status = GenCheck(target, argp->target.generation);
-            if (res.status != FALCON_SUCCESS) {
+            if (Misrouted(sbp, argp->target.handle)) {
+                return;
+            }
+            spy_res& res = StartReply(argp->target.handle);
+            Target* t = GetValidTarget(argp->target.handle);
+            if (!t) {
+                res.status = FALCON_UNKNOWN_TARGET;
                 sbp->reply(&res);
-                LOG("Gen error target %s", target->cstr());
+                LOG("Unknown target %s", argp->target.handle.cstr());
                 return;
             }
-            // Add the client (if necessary)
-            ref<FalconClient> cl = GetClient(argp->client);
-            bool new_client = target_clients_[*target].insert(cl).second;
-            int32_t delay = argp->up_interval_ms;
-            cl->up_intervals_[*target] = delay;
-            RepeatWaiting(target, cl);
-            if (argp->lethal) {
-                deadly_[*target].insert(cl);
+            if (DeferUntilDurable(sbp, t)) {
+                return;
             }
-            if (target_clients_[*target].size() == 1 && new_client) {
-                StartMonitoring(target);
+            SetReplyGeneration(t, &res.target.generation);
+            bool watch = false;
+            res.status = RegisterClient(t, argp->target, argp->client,
+                                        argp->lethal, argp->up_interval_ms,
+                                        argp->deadline_ms, &watch);
+            res.deadline_ms = t->deadline_ms;
+            if (watch) {
+                StartMonitoring(t->handle);
             }
-            res.status = FALCON_REGISTER_ACK;
             sbp->reply(&res);
             return;
         }
         case SPY_CANCEL: {
-            spy_res res;
             spy_cancel_arg *argp = sbp->Xtmpl getarg<spy_cancel_arg> ();
-            const ref<str> target = New refcounted<str>(argp->target.handle);
-            res.target.handle = argp->target.handle;
-            rpc_vec<gen_no, RPC_INFINITY> my_vec = gen_vec_;
-            my_vec.push_back(generations_[res.target.handle]);
-            res.target.generation = my_vec;
-            res.status = GenCheck(target, argp->target.generation);
-            if (res.status != FALCON_SUCCESS) {
-                LOG("tried to cancel %s, but couldn't", target->cstr());
+            if (Misrouted(sbp, argp->target.handle)) {
+                return;
+            }
+            spy_res& res = StartReply(argp->target.handle);
+            Target* t = GetValidTarget(argp->target.handle);
+            if (!t) {
+                res.status = FALCON_UNKNOWN_TARGET;
+                LOG("tried to cancel %s, but couldn't",
+                    argp->target.handle.cstr());
                 sbp->reply(&res);
                 return;
             }
-            ref<FalconClient> cl = GetClient(argp->client);
-            if (target_clients_[*target].erase(cl) == 1) {
-                cl->up_intervals_.erase(*target);
-                deadly_[*target].erase(cl);
-                res.status = FALCON_CANCEL_ACK;
-                if (target_clients_[*target].empty()) {
-                    LOG("Cancled %s", target->cstr());
-                    StopMonitoring(target);
-                } else {
-                    LOG("Would cancel %s, but there are other clients",
-                        target->cstr());
-                }
-                if (cl->up_intervals_.size() == 0) {
-                    RemoveClient(cl);
-                } else {
-                   LOG("At least %s is still in the map.",
-                        cl->up_intervals_.begin()->first.cstr());
-                }
-            } else {
-                res.status = FALCON_CANCEL_ERROR;
+            if (DeferUntilDurable(sbp, t)) {
+                return;
+            }
+            SetReplyGeneration(t, &res.target.generation);
+            bool unwatch = false;
+            res.status = CancelClient(t, argp->target, argp->client,
+                                      &unwatch);
+            if (unwatch) {
+                StopMonitoring(t->handle);
             }
             sbp->reply(&res);
             return;
         }
         case SPY_KILL: {
-            spy_res res;
             spy_kill_arg *argp = sbp->Xtmpl getarg<spy_kill_arg> ();
-            const ref<str> target = New refcounted<str>(argp->target.handle);
-            res.target.handle = argp->target.handle;
-            rpc_vec<gen_no, RPC_INFINITY> my_vec = gen_vec_;
-            my_vec.push_back(generations_[*target]);
-            res.target.generation = my_vec;
-            res.status = GenCheck(target, argp->target.generation);
+            if (Misrouted(sbp, argp->target.handle)) {
+                return;
+            }
+            spy_res& res = StartReply(argp->target.handle);
+            Target* t = GetValidTarget(argp->target.handle);
+            if (!t) {
+                res.status = FALCON_UNKNOWN_TARGET;
+                sbp->reply(&res);
+                return;
+            }
+            if (DeferUntilDurable(sbp, t)) {
+                return;
+            }
+            SetReplyGeneration(t, &res.target.generation);
+            res.status = GenCheck(t, argp->target.generation);
             if (res.status != FALCON_SUCCESS) {
                 sbp->reply(&res);
                 return;
             }
-            Kill(target);
+            Kill(t->handle);
             res.status = FALCON_KILL_ACK;
             sbp->reply(&res);
             return;
         }
         case SPY_GET_GEN: {
-            spy_res res;
             spy_kill_arg *argp = sbp->Xtmpl getarg<spy_kill_arg> ();
-            const ref<str> target = New refcounted<str>(argp->target.handle);
-            res.target.handle = argp->target.handle;
-            if (InvalidTarget(target)) {
+            if (Misrouted(sbp, argp->target.handle)) {
+                return;
+            }
+            spy_res& res = StartReply(argp->target.handle);
+            Target* t = GetValidTarget(argp->target.handle);
+            if (!t) {
                 res.status = FALCON_UNKNOWN_TARGET;
-                LOG("Unknown target %s", target->cstr());
+                LOG("Unknown target %s", argp->target.handle.cstr());
+            } else if (DeferUntilDurable(sbp, t)) {
+                return;
             } else {
-                UpdateGenerations(target);
-                rpc_vec<gen_no, RPC_INFINITY> my_vec = gen_vec_;
-                my_vec.push_back(generations_[*target]);
-                res.target.generation = my_vec;
+                SetReplyGeneration(t, &res.target.generation);
+                res.deadline_ms = t->deadline_ms;
                 res.status = FALCON_GEN_RESP;
             }
             sbp->reply(&res);
             return;
         }
+        case SPY_STATS:
+            ReplyStats(sbp);
+            return;
+        case SPY_REGISTER_BATCH:
+            RegisterBatch(sbp);
+            return;
+        case SPY_CANCEL_BATCH:
+            CancelBatch(sbp);
+            return;
     }
     return;
 }
 
+void
+Enforcer::Count(Target* t, uint32_t target_stats::* counter) {
+    t->stats.*counter += 1;
+    stats_.*counter += 1;
+}
+
+void
+Enforcer::RecordLatency(Target* t, latency_histogram target_stats::* hist,
+                        uint64_t ns) {
+    (t->stats.*hist).Record(ns);
+    (stats_.*hist).Record(ns);
+}
+
+void
+Enforcer::ProbeAnswered(const ref<const str> target, uint64_t rtt_ns) {
+    Target* t = FindTarget(*target);
+    if (t) {
+        RecordLatency(t, &target_stats::probe_rtt, rtt_ns);
+    }
+}
+
+void
+Enforcer::ProbeFailed(const ref<const str> target) {
+    Target* t = FindTarget(*target);
+    if (!t) {
+        return;
+    }
+    Count(t, &target_stats::probe_failures);
+    if (!t->suspect_ns) {
+        t->suspect_ns = TimerWheel::Now();
+    }
+}
+
+void
+Enforcer::ProbeLate(const ref<const str> target, uint64_t late_ns) {
+    Target* t = FindTarget(*target);
+    if (t) {
+        RecordLatency(t, &target_stats::probe_late, late_ns);
+    }
+}
+
+namespace {
+void
+FillHistogram(const latency_histogram& h, spy_histogram* out) {
+    out->count = h.count;
+    out->total_us = h.total_us;
+    out->max_us = h.max_us;
+    for (int i = 0; i < kHistogramBuckets; ++i) {
+        out->buckets[i] = h.buckets[i];
+    }
+}
+}  // end anonymous namespace
+
+void
+Enforcer::FillStats(const target_stats& stats, const str& handle,
+                    spy_target_stats* out) {
+    out->handle = handle;
+    FillHistogram(stats.probe_rtt, &out->probe_rtt);
+    FillHistogram(stats.probe_late, &out->probe_late);
+    FillHistogram(stats.timeout_to_down, &out->timeout_to_down);
+    FillHistogram(stats.down_delivery, &out->down_delivery);
+    out->registers = stats.registers;
+    out->cancels = stats.cancels;
+    out->ups = stats.ups;
+    out->downs = stats.downs;
+    out->down_retries = stats.down_retries;
+    out->down_failures = stats.down_failures;
+    out->probe_failures = stats.probe_failures;
+}
+
+void
+Enforcer::ReplyStats(svccb *sbp) {
+    spy_stats_arg *argp = sbp->Xtmpl getarg<spy_stats_arg> ();
+    if (Misrouted(sbp, argp->handle)) {
+        return;
+    }
+    spy_stats_res res;
+    res.uptime_ms = (TimerWheel::Now() - start_ns_) /
+                    kMillisecondsToNanoseconds;
+    res.shard = shard_;
+    res.shards = shards_;
+    res.targets = targets_.size();
+    res.clients = all_clients_.size();
+    res.heartbeat_failures = heartbeat_failures_;
+    res.shed_queries = shed_queries_;
+    res.shed_registers = shed_registers_;
+    res.shed_ups = shed_ups_;
+    FillStats(stats_, "", &res.total);
+    Target* t = FindTarget(argp->handle);
+    if (t) {
+        res.target.setsize(1);
+        FillStats(t->stats, *t->handle, &res.target[0]);
+    }
+    sbp->reply(&res);
+}
+
 Enforcer::~Enforcer() {
+    if (standby_fd_ >= 0) {
+        close(standby_fd_);
+    }
+    if (primary_fd_ >= 0) {
+        close(primary_fd_);
+    }
+    delete journal_;
+    delete gen_store_;
     return;
 }
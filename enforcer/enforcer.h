@@ -21,27 +21,234 @@
 #include <arpc.h>
 #include "spy_prot.h"
 #include "client_prot.h"
+#include "generation_store.h"
+#include "registration_journal.h"
+#include "stats.h"
+#include "timer_wheel.h"
 
 #include <rpc/xdr.h>
 
 #include <list>
 #include <map>
 #include <set>
+#include <string>
+#include <vector>
+
+struct Target;
+struct ClientEndpoint;
+
+const uint32_t kMaxShards = 64;
+// Retransmission timeout for a client address before any round trip has
+// been measured
+const uint64_t kInitialRtoNs = 100ULL * 1000 * 1000;
+const uint32_t kDefaultDownDeadlineMs = 5000;
+// How long a standby waits to hear from its primary before fencing it
+const uint32_t kDefaultTakeoverMs = 1000;
+// Requests per second and burst allowed to each client by default
+const uint32_t kDefaultAdmissionRate = 2000;
+const uint32_t kDefaultAdmissionBurst = 4000;
+// Admission buckets. Clients hashing to the same bucket share it.
+const size_t kAdmissionBuckets = 1024;
+// Most ups queued on one client address at a time
+const size_t kMaxQueuedUps = 1024;
+const size_t kMaxShardMessage = 4096;
+// Target::requested_ms of a target the layer was never asked about
+const uint32_t kNoDeadline = 0xffffffff;
+
+// What the enforcer sheds once its event loop falls behind, from the least
+// important work up. Down delivery, kills and probes are never shed.
+enum shed_level {
+    SHED_NONE,
+    SHED_QUERIES,       // SPY_GET_GEN and SPY_NULL
+    SHED_REGISTERS,     // and registers and cancels, batched or not
+    SHED_UPS            // and CLIENT_UP notifications
+};
+
+// Requests a client may send now, refilled at the admission rate
+struct token_bucket {
+    token_bucket() : tokens(0), refilled_ns(0) {}
+    double                          tokens;
+    uint64_t                        refilled_ns;
+};
+
+// Binary identity of a client layer: the address it receives callbacks on
+// and its tag. Built on the stack from a client_addr_t, so finding an
+// existing client neither allocates nor formats anything.
+struct client_key {
+    uint32_t    ipaddr;
+    uint32_t    port;
+    uint32_t    tag;
+
+    explicit client_key(const client_addr_t& addr) : ipaddr(addr.ipaddr),
+        port(addr.port), tag(addr.client_tag) {}
+
+    bool operator==(const client_key& other) const {
+        return ipaddr == other.ipaddr && port == other.port &&
+               tag == other.tag;
+    }
+
+    bool operator<(const client_key& other) const {
+        if (ipaddr != other.ipaddr) return ipaddr < other.ipaddr;
+        if (port != other.port) return port < other.port;
+        return tag < other.tag;
+    }
+
+    operator hash_t() const {
+        return ipaddr ^ (port << 16 | port >> 16) ^ (tag * 0x9e3779b1U);
+    }
+
+    // The key of the endpoint (address without tag) this client is at
+    client_key Endpoint() const {
+        client_key k(*this);
+        k.tag = 0;
+        return k;
+    }
+};
+
+// A client's registration for one target
+// up_interval - how often (ms) to notify the client of signs of life
+// deadline_ms - detection deadline the client asked for, 0 for the default
+// repeat - puts the client back on the target's waiting list
+//
+struct registration {
+    registration() : up_interval(0), deadline_ms(0), repeat(NULL) {}
+    int32_t                         up_interval;
+    uint32_t                        deadline_ms;
+    wheel_timer*                    repeat;
+};
 
 // This structure holds the enforcer's state about clients
-// id - client identifier
+// key_ - client identifier
+// endpoint_ - the address this client receives callbacks on
 // clnt_ - the rpc client for sending callbacks to this client
-// up_intervals_ - how often to notify the client of signs of life
+// registrations_ - the targets this client is registered for
 //
 struct FalconClient {
-    str                             id;
+    FalconClient(const client_addr_t& addr, const ref<ClientEndpoint>& ep);
+
+    // "ip:port:tag", for log messages. Built on first use.
+    const str& Id();
+
+    const client_key                key_;
+    const ref<ClientEndpoint>       endpoint_;
     ptr<aclnt>                      clnt_;
-    std::map<str, int32_t>          up_intervals_;
+    std::map<Target*, registration> registrations_;
     uint32_t                        client_tag_;
 
     bool operator<(const FalconClient &other) const {
-        return id < other.id;
+        return key_ < other.key_;
     }
+
+    private:
+        str                         id_;
+};
+
+typedef std::set<ref<FalconClient> > ClientSet;
+
+// A down message queued for delivery to one client
+struct pending_down {
+    pending_down(Target* t, const ref<FalconClient>& cl,
+                 const ref<client_down_arg>& a) : target(t), client(cl),
+                 arg(a) {}
+    Target*                         target;
+    ref<FalconClient>               client;
+    ref<client_down_arg>            arg;
+};
+
+// A CLIENT_DOWN or CLIENT_DOWN_BATCH call waiting for its ack. The enforcer
+// retransmits it whenever the endpoint's retransmission timeout passes
+// without an answer, until the delivery deadline.
+struct down_flight {
+    down_flight(const ref<ClientEndpoint>& e) : ep(e), call(NULL), xmits(1),
+        sent_ns(0), timer(NULL) {}
+
+    const ref<ClientEndpoint>       ep;
+    std::vector<pending_down>       downs;
+    ptr<client_down_batch_arg>      batch;
+
+    // The outstanding rpc; NULL once it has been answered
+    rpccb_unreliable*               call;
+    uint32_t                        xmits;
+    uint64_t                        sent_ns;
+    wheel_timer*                    timer;
+};
+
+// Callbacks queued for one client address. All client layers (tags) at an
+// address share it, and everything queued within one flush window goes out
+// as a single CLIENT_UP_BATCH / CLIENT_DOWN_BATCH call. Liveness of the
+// address is also tracked here, once for all of its tags.
+struct ClientEndpoint {
+    ClientEndpoint(const client_key& key, const ptr<aclnt>& clnt) :
+        key_(key), clnt_(clnt), last_heard_(0), batches_(true),
+        srtt_ns_(0), rttvar_ns_(0), rto_ns_(kInitialRtoNs),
+        flush_timer_(NULL), heartbeat_timer_(NULL) {}
+
+    const client_key                key_;
+    const ptr<aclnt>                clnt_;
+
+    // FalconClients at this address
+    ClientSet                       clients_;
+
+    // Last time an rpc to this address succeeded
+    double                          last_heard_;
+
+    // Cleared if the client does not implement the batch procedures
+    bool                            batches_;
+
+    // Round trip estimate from acked down calls, and the retransmission
+    // timeout derived from it (RFC 6298)
+    uint64_t                        srtt_ns_;
+    uint64_t                        rttvar_ns_;
+    uint64_t                        rto_ns_;
+
+    wheel_timer*                    flush_timer_;
+    wheel_timer*                    heartbeat_timer_;
+    std::vector<client_up_arg>      ups_;
+    std::vector<pending_down>       downs_;
+};
+
+// Everything the enforcer knows about one target. Records are interned: there
+// is exactly one per valid handle and it is never freed, so a Target* (and its
+// handle ref) is a stable identity for the target.
+struct Target {
+    explicit Target(const str& h);
+
+    // The handle handed to layer-specific code
+    const ref<const str>            handle;
+
+    // Last durable generation
+    gen_no                          generation;
+
+    // A bump handed to the generation store but not yet synced
+    bool                            pending;
+    gen_no                          pending_generation;
+
+    // Durable lease ceiling, when generation leases are in use
+    gen_no                          ceiling;
+
+    // Clients registered for this target
+    ClientSet                       clients;
+
+    // Clients waiting for signs of life from this target
+    ClientSet                       waiting;
+
+    // Clients granting a license to kill
+    ClientSet                       deadly;
+
+    // The tightest detection deadline any client asked for (0 for the
+    // layer's default, kNoDeadline before the layer was first asked) and
+    // the deadline the layer said it meets
+    uint32_t                        requested_ms;
+    uint32_t                        deadline_ms;
+
+    // Requests replayed once the pending generation is durable
+    std::list<svccb*>               deferred;
+
+    // Measurements for SPY_STATS. suspect_ns is when a probe last failed
+    // and down_ns when the target was last reported down (0 if never).
+    target_stats                    stats;
+    uint64_t                        suspect_ns;
+    uint64_t                        down_ns;
 };
 
 // Common enforcer code. Layer-specific enforcers inherit from this class and
@@ -78,99 +285,473 @@ class Enforcer : public virtual refcount {
         // outside of the enforcer.
         virtual void UpdateGenerations(const ref<const str> target) = 0;
 
+        // Asks layer-specific code to notice a failure of target within
+        // deadline_ms, or within its default if deadline_ms is 0, and
+        // returns the deadline (ms) it can actually meet. That may be looser
+        // than asked, e.g. when probes cannot go out any faster. Layers that
+        // probe on a fixed schedule need not override it; the default
+        // returns 0, which tells clients nothing.
+        virtual uint32_t SetDeadline(const ref<const str> target,
+                                     uint32_t deadline_ms);
+
+        // Called when a standby takes over, before it loads the primary's
+        // state and starts serving. Layers set up here whatever a primary
+        // and its standby cannot share on one machine (e.g. a listening
+        // socket of their own); Init() of a standby must leave it alone.
+        virtual void BecomePrimary();
+
+        // Called in every process that serves requests (each shard, or a
+        // standby that took over) just before it starts, after any fork.
+        // Layers start threads of their own here.
+        virtual void StartThreads();
+
+        // Receives a message another shard sent with SendToShard(). fd is
+        // the passed descriptor, or -1. Layers that never call SendToShard()
+        // need not override it.
+        virtual void ShardMessage(const char* msg, size_t len, int fd);
+
+        // The shard that owns handle when targets are split shards ways
+        static uint32_t ShardOf(const str& handle, uint32_t shards);
+
     protected:
 
         // Received an up event from layer-specific code
         void ObserveUp(const ref<const str> target);
 
+        // Layer-specific code reports a target it did not know before, so
+        // that registrations saved by an earlier run can be restored.
+        // Targets that are valid when Run() starts need not be reported.
+        void TargetAvailable(const ref<const str> target);
+
         // Received a down event from layer-specific code
         void ObserveDown(const ref<const str> target, const uint32_t status,
                          const bool killed, const bool would_kill);
 
         // Informs layer-specific code about use of lethal force
-        bool Killable(const ref<const str> target) {
-            return !deadly_[*target].empty();
-        }
+        bool Killable(const ref<const str> target);
 
         // Used when layer-specific code is responsible for keeping track of
         // genrations
         void FastForwardGeneration(const ref<const str> target,
                                    uint32_t new_gen);
 
-        // Get the generation for a specific target
-        uint32_t GetGeneration(const ref<const str> target) {
-            return generations_[*target];
-        }
+        // Get the generation for a specific target. Only durable
+        // generations are returned.
+        uint32_t GetGeneration(const ref<const str> target);
+
+        // Layer-specific code reports the round trip time of an answered
+        // probe, and probes that failed or timed out. The time from the
+        // first failure to ObserveDown() is measured from the latter.
+        void ProbeAnswered(const ref<const str> target, uint64_t rtt_ns);
+        void ProbeFailed(const ref<const str> target);
+
+        // Layer-specific code reports how late a probe went out compared to
+        // when it was due. This is the detection jitter the enforcer adds.
+        void ProbeLate(const ref<const str> target, uint64_t late_ns);
+
+        // Timers for the enforcer and layer-specific code
+        const ref<TimerWheel>   timers_;
 
         // Directs LOG messages when in daemon mode
         const char* logfile_name_;
 
+        // Number of generations reserved by each durable write. When
+        // non-zero, a bump only touches the log once the previous
+        // reservation is used up, and a restarted enforcer resumes every
+        // target at its reserved ceiling. Must be set before Run().
+        uint32_t    generation_lease_;
+
+        // How long a client gets to acknowledge a down message before it is
+        // dropped. Must be set before Run().
+        uint32_t    down_deadline_ms_;
+
+        // Number of shards. Each shard is a process with its own event
+        // loop, socket and client state, and owns the targets ShardOf()
+        // assigns to it. Run() forks the extra shards; everything set up
+        // before then (e.g. in Init()) is shared by all of them. Must be set
+        // before Run().
+        uint32_t    shards_;
+
+        // The shard this process runs. The original process is shard 0.
+        uint32_t    shard_;
+
+        // Hot standby. A primary with a replication socket streams its
+        // generation bumps and registrations to the standby connected
+        // there. A standby follows the primary through that socket and
+        // takes over when the primary exits, or fences it (SIGKILL) once it
+        // has been silent for takeover_ms_. It then serves on standby_port_
+        // (kFalconPort unless configured otherwise) and accepts a standby of
+        // its own. Only unsharded enforcers replicate. Must be set before
+        // Run().
+        std::string replication_path_;
+        bool        standby_;
+        uint32_t    takeover_ms_;
+        uint32_t    standby_port_;
+
+        // Admission control. Every request but SPY_KILL is charged to a
+        // token bucket of its source (address and port, or stream
+        // connection) that refills at admission_rate_ per second up to
+        // admission_burst_; requests that find it empty are dropped. Zero
+        // disables the buckets. Shedding by load (shed_level) is always on.
+        // Must be set before Run().
+        uint32_t    admission_rate_;
+        uint32_t    admission_burst_;
+
+        bool OwnsTarget(const str& handle) const {
+            return ShardOf(handle, shards_) == shard_;
+        }
+
+        // Hands msg (at most kMaxShardMessage bytes) and, if fd is not -1,
+        // a descriptor to shard's ShardMessage(). fd is closed here.
+        void SendToShard(uint32_t shard, const void* msg, size_t len, int fd);
+
         // base generation vector
         rpc_vec<gen_no, RPC_INFINITY>                   gen_vec_;
 
+        // Handle enforcer RPCs. Run() serves them on kFalconPort; tools may
+        // feed it from a transport of their own.
+        void Dispatch(svccb *sbp);
+
+        // How far behind the event loop is, going by the timer wheel
+        shed_level Overload() const;
+
     private:
-        // List of target generations
-        std::map<str, gen_no>                           generations_;
+        // Index of all target records
+        qhash<str, ref<Target> >                        targets_;
+
+        // The same records, for walking all of them
+        std::vector<Target*>                            target_list_;
+
+        // Scratch reply for the request being dispatched. Requests are
+        // answered one at a time, and reusing the reply keeps its vector's
+        // storage, so the common requests do not allocate once it has grown.
+        spy_res                                         reply_;
+
+        // Returns the record for handle, or NULL if there is none. Never
+        // creates a record.
+        Target* FindTarget(const str& handle);
+
+        // Returns the record for handle, creating it if necessary
+        Target* InternTarget(const str& handle);
+
+        // Returns the record for handle if layer-specific code accepts it as
+        // a target, or NULL. Bogus handles never get a record, and neither
+        // do handles too long for the generation store's records.
+        Target* GetValidTarget(const str& handle);
+
+        // Fills in the generation vector of a reply about t. Reuses gen's
+        // storage if it is large enough.
+        void SetReplyGeneration(const Target* t,
+                                rpc_vec<gen_no, RPC_INFINITY>* gen);
+
+        // Resets reply_ for a request about handle and returns it
+        spy_res& StartReply(const str& handle);
 
         // Will add a new client to all clients or get the existing client
         ref<FalconClient> GetClient(const client_addr_t& addr);
 
+        // Gets the endpoint for addr, creating it (and its rpc client) if
+        // necessary
+        ref<ClientEndpoint> GetEndpoint(const client_addr_t& addr);
+
+        // Arms the flush timer of ep, if it is not armed already
+        void ScheduleFlush(const ref<ClientEndpoint> ep);
+
+        // Sends everything queued on ep
+        void FlushEndpoint(const ref<ClientEndpoint> ep);
+
+        // Resends a batch of ups one by one if the client turned out not to
+        // support batches
+        void UpBatchSent(const ref<ClientEndpoint> ep,
+                         const ref<client_up_batch_arg> arg,
+                         clnt_stat rpc_status);
+
         // Remove a client. Will stop monitoring any targets it is the sole
         // client of.
         void RemoveClient(const ref<FalconClient> client);
 
-        // Utility for checking generation
-        spy_status GenCheck(const ref <const str> target,
+        // Drops client's registration for t
+        void Unregister(const ref<FalconClient> client, Target* t);
+
+        // Works out the tightest deadline t's clients asked for and passes
+        // it on to layer-specific code if it changed
+        void UpdateDeadline(Target* t);
+
+        // Compares a client's generation vector with t's, in place
+        spy_status GenCheck(const Target* t,
                             const rpc_vec<gen_no, RPC_INFINITY>& gen_vec);
 
-        // Handle a heartbeat from a client. Used for garbage collection of
-        // crashed clients.
-        void HandleClientHeartbeat(const ref<FalconClient> client,
+        // Checks a vector that stops short of a target's own generation
+        // against the layers below us
+        spy_status PrefixCheck(const rpc_vec<gen_no, RPC_INFINITY>& gen_vec);
+
+        // Registers client for t, or cancels its registration. Sets *watch
+        // if t got its first client, or *unwatch if it lost its last one;
+        // the caller then starts or stops monitoring t.
+        spy_status RegisterClient(Target* t, const target_t& target,
+                                  const client_addr_t& client, bool lethal,
+                                  int32_t up_interval_ms,
+                                  uint32_t deadline_ms, bool* watch);
+        spy_status CancelClient(Target* t, const target_t& target,
+                                const client_addr_t& client, bool* unwatch);
+
+        // Answer SPY_REGISTER_BATCH and SPY_CANCEL_BATCH in one pass
+        void RegisterBatch(svccb *sbp);
+        void CancelBatch(svccb *sbp);
+
+        // Handle a heartbeat from a client address. Used for garbage
+        // collection of crashed clients.
+        void HandleClientHeartbeat(const ref<ClientEndpoint> ep,
                                    int retry_count, clnt_stat rpc_status);
 
-        // Send heartbeat message to the client
-        void DoHeartbeat(const ref<FalconClient> client, int retry_count);
+        // Send heartbeat message to the client address, unless other
+        // traffic has shown it to be alive recently
+        void DoHeartbeat(const ref<ClientEndpoint> ep, int retry_count);
+
+        // Notes that an rpc to ep completed
+        void EndpointReplied(const ref<ClientEndpoint> ep,
+                             clnt_stat rpc_status);
+
+        // True if ep has not been dropped (with all of its clients)
+        bool LiveEndpoint(const ref<ClientEndpoint> ep);
 
         // Add client to list of clients waiting for an up response from this
         // layer
-        void AddToWaiting(const ref<const str> target,
-                          const ref<FalconClient> client);
+        void AddToWaiting(Target* t, const ref<FalconClient> client);
 
         // Set timer for when this client will begin actively waiting for
         // signs of life.
-        void RepeatWaiting(const ref<const str> target,
-                           const ref<FalconClient> client);
+        void RepeatWaiting(Target* t, const ref<FalconClient> client);
 
-        // Handle enforcer RPCs
-        void Dispatch(svccb *sbp);
+        // Bump a counter or record a latency for t and in aggregate
+        void Count(Target* t, uint32_t target_stats::* counter);
+        void RecordLatency(Target* t, latency_histogram target_stats::* hist,
+                           uint64_t ns);
+
+        // Converts stats to their wire format
+        static void FillStats(const target_stats& stats, const str& handle,
+                              spy_target_stats* out);
+
+        // Answers SPY_STATS
+        void ReplyStats(svccb *sbp);
+
+        // Answers a request that has been admitted
+        void Answer(svccb *sbp);
+
+        // Decides whether to serve sbp, charging the bucket of source.
+        // Counts the request as shed if not.
+        bool Admit(svccb *sbp, uint32_t source);
+
+        // The admission source of a datagram request
+        static uint32_t SourceOf(svccb *sbp);
+
+        // Rejects sbp if handle belongs to another shard. Only malformed
+        // requests get past the socket filter to the wrong shard.
+        bool Misrouted(svccb *sbp, const str& handle);
+
+        // Listens for stream connections on kFalconPort, next to the
+        // datagram socket. Only unsharded enforcers do: the socket filter
+        // cannot steer requests inside a connection to their shard.
+        void StartStreamListener(int fd);
+
+        // Accepts pending stream connections on listener fd
+        void AcceptStream(int fd);
+
+        // Dispatches a request from stream connection id. A NULL sbp means
+        // the connection closed.
+        void StreamDispatch(uint32_t id, svccb *sbp);
+
+        // Starts answering requests on datagram socket fd, and on a stream
+        // socket at port
+        void Serve(int fd, uint16_t port);
+
+        // Primary side of replication: listens on replication_path_ and
+        // streams state to the standby that connects
+        void StartReplication();
+        void AcceptStandby(int fd);
+        void StandbyReadable();
+        void DropStandby();
+
+        // Queues a line for the standby
+        void Replicate(const char* line, size_t len);
 
-        // Send Down rpc call to this client
-        void ReportDown(const ref<FalconClient> client,
-                        const ref<client_down_arg> rpc_arg,
-                        int32_t retries, clnt_stat rpc_status);
+        // Sends the standby everything it needs to take over
+        void SendSnapshot();
+
+        // Writes queued lines until the socket is full
+        void WriteReplica();
+
+        // Keeps a quiet primary from looking dead
+        void ReplicationHeartbeat();
+
+        // Standby side: connects to the primary (retrying until there is
+        // one) and applies what it sends
+        void WatchPrimary();
+        void ReadReplica();
+        void ApplyReplica(const char* line);
+
+        // Connection to the primary closed: follow it again if it is still
+        // alive, otherwise take over
+        void LostPrimary();
+
+        // Primary has been silent for too long
+        void PrimaryUnresponsive();
+
+        // True if the primary's process exists and is not a zombie
+        bool PrimaryAlive();
+
+        // Becomes the primary, with the state of the old one
+        void TakeOver();
+
+        // Binds standby_port_ once the old primary has let go of it, then
+        // serves
+        void BindAfterPrimary(int attempt);
+
+        // Creates the shard sockets and links, forks the other shards and
+        // returns this shard's server socket. Returns in every shard.
+        int StartShards();
+
+        // Joins the kFalconPort SO_REUSEPORT group
+        int ShardSocket();
+
+        // Reads one message from this shard's link
+        void ReceiveShardMessage();
+
+        // Called when another shard's lifeline closes
+        void ShardExited(uint32_t shard);
+
+        // Generation log of a shard other than 0
+        std::string ShardLogName(uint32_t shard);
+
+        // Holds sbp if target has a generation bump that is not yet durable.
+        // Returns true if the request was deferred.
+        bool DeferUntilDurable(svccb *sbp, Target* t);
+
+        // Called when the generation store finishes a group commit
+        void GenerationsDurable();
+
+        // The newest generation of target, durable or not
+        gen_no LatestGeneration(const Target* t);
+
+        // Moves target to generation next, publishing it at once if it is
+        // covered by a lease and staging it for a group commit otherwise
+        void AdvanceGeneration(Target* t, gen_no next);
+
+        // Sends downs to ep as one call (a batch if there are several)
+        // and tracks it until it is acked or the deadline passes
+        void SendDowns(const ref<ClientEndpoint> ep,
+                       const std::vector<pending_down>& downs);
+
+        // Retransmits a down call that has not been acked in time
+        void RetransmitDowns(uint32_t id);
+
+        // Completion of a down call: acked, unsupported, or past deadline
+        void DownsAnswered(uint32_t id, clnt_stat rpc_status);
+
+        // Folds a round trip sample into ep's retransmission timeout
+        void SampleRtt(const ref<ClientEndpoint> ep, uint64_t rtt_ns);
+
+        // Forget about target t for client once it has been told it is down
+        void DownDelivered(Target* t, const ref<FalconClient> client);
 
         // Initialize the generations at this layer
         void InitGenerations();
 
-        // Increment the generation of handle by 1 and sync the local logs
-        void IncrementGeneration(const ref<const str> target);
-
-        // FILE* for the generation write-ahead-log
-        FILE* generation_log_;
+        // Registration journal of shard
+        std::string JournalName(uint32_t shard);
+
+        // Keeps the saved registrations this shard can still honor, starts
+        // its journal and restores them for targets that are valid already
+        void RestoreRegistrations();
+
+        // Restores the saved registrations for handle
+        void RestoreTarget(const str& handle);
+
+        // Forgets saved registrations whose target never showed up
+        void ExpireRestores();
+
+        // Journals client's registration for t, or its end, and passes it
+        // on to the standby
+        void JournalRegistration(Target* t, const ref<FalconClient> client,
+                                 bool registered);
+
+        // Describes client's registration for t in journal terms
+        void DescribeRegistration(Target* t, const ref<FalconClient> client,
+                                  registration_key* key,
+                                  registration_state* state);
+
+        // Arranges for FlushJournal() to run at the end of this turn of the
+        // loop
+        void ScheduleJournalFlush();
+
+        // Writes out journal and replication entries made during this turn
+        // of the loop
+        void FlushJournal();
+
+        // Increment the generation of handle by 1. The new generation
+        // becomes visible once the store has synced it.
+        void IncrementGeneration(Target* t);
+
+        // Durable generation table and write-ahead-log
+        GenerationStore* gen_store_;
+
+        // Registrations for warm restarts. NULL when generations are not
+        // kept on disk.
+        RegistrationJournal*                            journal_;
+        bool                                            journal_flush_;
+
+        // Registrations saved by an earlier run, waiting for their target
+        RegistrationMap                                 restoring_;
+
+        // Connection to our standby, the lines not yet written to it and
+        // the heartbeat timer
+        int                                             standby_fd_;
+        std::string                                     replica_out_;
+        size_t                                          replica_sent_;
+        wheel_timer*                                    replica_timer_;
+
+        // Standby state: connection to the primary, its pid, a partial
+        // line, and the primary's state as replicated so far
+        int                                             primary_fd_;
+        pid_t                                           primary_pid_;
+        std::string                                     replica_in_;
+        wheel_timer*                                    primary_timer_;
+        std::vector<uint32_t>                           replica_base_;
+        std::map<std::string, uint32_t>                 replica_gens_;
+        RegistrationMap                                 replica_regs_;
 
         // Set of all clients
-        std::set<ref<FalconClient> > all_clients_;
+        qhash<client_key, ref<FalconClient> >           all_clients_;
+
+        // Client addresses, keyed by client_key::Endpoint()
+        qhash<client_key, ref<ClientEndpoint> >         endpoints_;
+
+        // Down calls awaiting an ack, by id
+        qhash<uint32_t, ref<down_flight> >              down_flights_;
+        uint32_t                                        next_flight_;
+
+        // Datagram socketpair per shard. A shard reads the first socket of
+        // its own pair and sends to others through the second of theirs.
+        std::vector<int>                                shard_recv_;
+        std::vector<int>                                shard_send_;
 
-        // Maps targets to clients waiting for signs of life from those targets
-        std::map<str, std::set<ref<FalconClient> > > waiting_for_up_;
+        // Aggregate of every target's stats, plus what is not per target
+        target_stats                                    stats_;
+        uint32_t                                        heartbeat_failures_;
 
-        // List of all clients for each target
-        std::map<str, std::set<ref<FalconClient> > >    target_clients_;
+        // Admission buckets, by hash of the source, and what was shed
+        token_bucket                            buckets_[kAdmissionBuckets];
+        uint32_t                                        shed_queries_;
+        uint32_t                                        shed_registers_;
+        uint32_t                                        shed_ups_;
+        uint64_t                                        start_ns_;
 
         // rpc srv
         ptr<asrv>                                       srv_;
 
-        // List of clients granting a license to kill.
-        std::map<str, std::set<ref<FalconClient> > >    deadly_;
+        // Servers of stream connections, by id. Each connection can carry
+        // any number of requests at once.
+        qhash<uint32_t, ref<asrv> >                     streams_;
+        uint32_t                                        next_stream_;
 };
 #endif  // _NTFA_ENFORCER_ENFORCER_H_
@@ -20,6 +20,14 @@
 
 #include "common.h"
 
+// How a scripted target behaves once monitored
+enum script {
+    SCRIPT_NONE,
+    SCRIPT_ALIVE,   // up every 100 ms
+    SCRIPT_DEAD,    // down after 100 ms
+    SCRIPT_STUCK    // never heard from again
+};
+
 class DummyEnforcer : public virtual Enforcer {
   public:
     virtual ~DummyEnforcer() {}
@@ -33,31 +41,41 @@ class DummyEnforcer : public virtual Enforcer {
         return;
     }
 
+    // Replicates through a fixed socket, so that a primary and a standby
+    // can be tried out on one machine
+    void SetRole(bool standby, uint32_t port) {
+        replication_path_ = "/tmp/dummy.repl";
+        standby_ = standby;
+        standby_port_ = port;
+    }
+
     virtual void StartMonitoring(const ref<const str> handle) {
         LOG("START MONITORING %s", handle->cstr());
-        timecb_t* cb = delaycb(0, 100 * 1000 * 1000, wrap(mkref(this),
-                               &DummyEnforcer::MonitorAction, handle));
-        monitored_cb_[*handle] = cb;
+        wheel_timer*& timer = monitored_timer_[*handle];
+        if (timer == NULL) {
+            timer = timers_->NewTimer(wrap(mkref(this),
+                                      &DummyEnforcer::MonitorAction, handle));
+        }
+        ArmMonitor(*handle, timer);
         return;
     }
 
     virtual void StopMonitoring(const ref<const str> handle) {
         LOG("STOP MONITORING %s", handle->cstr());
-        timecb_t* cb = monitored_cb_[*handle];
-        if (cb == NULL) {
-            return;
+        std::map<str, wheel_timer*>::iterator it =
+            monitored_timer_.find(*handle);
+        if (it != monitored_timer_.end()) {
+            timers_->Cancel(it->second);
         }
-        monitored_cb_[*handle] = NULL;
-        timecb_remove(cb);
         return;
     }
 
     virtual bool InvalidTarget(const ref<const str> handle) {
-        return (monitored_.count(*handle) == 0);
+        return Script(*handle) == SCRIPT_NONE;
     }
 
     virtual void Kill(const ref<const str> handle) {
-        CHECK(1 == monitored_.count(*handle));
+        CHECK(!InvalidTarget(handle));
         LOG("Got kill for %s", handle->cstr());
         ObserveDown(handle, 0, true, true);
         return;
@@ -67,35 +85,73 @@ class DummyEnforcer : public virtual Enforcer {
         return;
     }
 
-    void MonitorAction(const ref<const str> handle) {
-        timecb_t* cb = monitored_cb_[*handle];
-        if (cb == NULL) {
-            return;
+    // Targets report in every 100 ms, or as often as their deadline needs
+    virtual uint32_t SetDeadline(const ref<const str> handle,
+                                 uint32_t deadline_ms) {
+        if (deadline_ms == 0) {
+            period_ms_.erase(*handle);
+            return kDefaultPeriodMs;
         }
-        monitored_cb_[*handle] = NULL;
-        if (handle->cmp("dead") == 0) {
+        period_ms_[*handle] = deadline_ms;
+        return deadline_ms;
+    }
+
+    void MonitorAction(const ref<const str> handle) {
+        script s = Script(*handle);
+        if (s == SCRIPT_DEAD) {
             bool killed = Killable(handle);
             ObserveDown(handle, 0, killed, true);
             return;
-        } else if (handle->cmp("stuck") == 0) {
+        } else if (s == SCRIPT_STUCK) {
             return;
         }
+        // The tick that fired this is as late as the probe
+        ProbeLate(handle, timers_->Lateness());
         ObserveUp(handle);
-        cb = delaycb(0, 100 * 1000 * 1000, wrap(mkref(this),
-                     &DummyEnforcer::MonitorAction, handle));
-        monitored_cb_[*handle] = cb;
+        ArmMonitor(*handle, monitored_timer_[*handle]);
         return;
     }
   private:
-    std::map<str, timecb_t*>    monitored_cb_;
+    static const uint32_t kDefaultPeriodMs = 100;
+
+    void ArmMonitor(const str& handle, wheel_timer* timer) {
+        std::map<str, uint32_t>::iterator it = period_ms_.find(handle);
+        uint32_t period = (it == period_ms_.end()) ? kDefaultPeriodMs :
+                                                     it->second;
+        timers_->Arm(timer, period / 1000, (period % 1000) * 1000 * 1000);
+    }
+
+    // Besides the fixed targets, "alive-<n>", "dead-<n>" and "stuck-<n>"
+    // behave like alive, dead and stuck, so load tests can use any number
+    // of targets.
+    script Script(const str& handle) {
+        static const char* kScripts[] = {"alive", "dead", "stuck"};
+        for (int i = 0; i < 3; ++i) {
+            size_t len = strlen(kScripts[i]);
+            if (handle.len() >= len &&
+                0 == strncmp(handle.cstr(), kScripts[i], len) &&
+                (handle.len() == len || handle[len] == '-')) {
+                return static_cast<script>(SCRIPT_ALIVE + i);
+            }
+        }
+        return monitored_.count(handle) ? SCRIPT_ALIVE : SCRIPT_NONE;
+    }
+
+    std::map<str, wheel_timer*> monitored_timer_;
+    std::map<str, uint32_t>     period_ms_;
     std::set<str>               monitored_;
 };
 
+// usage: fake_enforcer [primary | standby [port]]
 int
-main() {
+main(int argc, char** argv) {
     async_init();
     ref<DummyEnforcer> e = New refcounted<DummyEnforcer>;
     e->Init();
+    if (argc > 1) {
+        uint32_t port = (argc > 2) ? atoi(argv[2]) : kFalconPort;
+        e->SetRole(0 == strcmp(argv[1], "standby"), port);
+    }
     e->Run();
     return EXIT_FAILURE;
 }
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+// Measures the cost of generation bumps as seen by the enforcer's event
+// loop. Bursts of targets go down together (as when a host dies). In "sync"
+// mode every bump is appended and fsynced inline, which is what
+// IncrementGeneration used to do. In "group" mode bumps are staged and
+// synced by the GenerationStore helper thread while the loop keeps running.
+//
+// usage: gen_bench <log path> [targets per burst] [bursts] [gap us]
+#include <poll.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "generation_store.h"
+
+namespace {
+
+struct Result {
+    size_t  bumps;
+    size_t  syncs;
+    double  elapsed;
+    double  stall_max;
+    double  stall_total;
+};
+
+double
+Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + kNanosecondsToSeconds * ts.tv_nsec;
+}
+
+void
+Reset(const char* path) {
+    std::string table(path);
+    table += ".tbl";
+    unlink(path);
+    unlink(table.c_str());
+}
+
+void
+Report(const char* mode, const Result& r, int bursts) {
+    printf("mode=%s bumps=%zu fsyncs=%zu elapsed_s=%.3f fsyncs_per_s=%.1f "
+           "bumps_per_s=%.1f stall_mean_us=%.1f stall_max_us=%.1f\n",
+           mode, r.bumps, r.syncs, r.elapsed, r.syncs / r.elapsed,
+           r.bumps / r.elapsed, 1e6 * r.stall_total / bursts,
+           1e6 * r.stall_max);
+}
+
+void
+RunSync(const char* path, int per_burst, int bursts, int gap_us) {
+    Reset(path);
+    GenerationStore store(path);
+    std::map<std::string, uint32_t> gens;
+    store.Load(&gens);
+    Result r = {0, 0, 0, 0, 0};
+    double start = Now();
+    for (int b = 0; b < bursts; ++b) {
+        double t0 = Now();
+        for (int i = 0; i < per_burst; ++i) {
+            char target[32];
+            snprintf(target, sizeof(target), "target-%d", i);
+            store.Append(target, ++gens[target]);
+            r.bumps++;
+        }
+        double stall = Now() - t0;
+        r.stall_total += stall;
+        if (stall > r.stall_max) r.stall_max = stall;
+        if (gap_us) usleep(gap_us);
+    }
+    r.elapsed = Now() - start;
+    r.syncs = store.Syncs();
+    Report("sync", r, bursts);
+}
+
+void
+RunGroup(const char* path, int per_burst, int bursts, int gap_us) {
+    Reset(path);
+    GenerationStore store(path);
+    std::map<std::string, uint32_t> gens;
+    store.Load(&gens);
+    store.StartSyncThread();
+    Result r = {0, 0, 0, 0, 0};
+    size_t durable = 0;
+    double start = Now();
+    struct pollfd pfd;
+    pfd.fd = store.NotifyFd();
+    pfd.events = POLLIN;
+    for (int b = 0; b < bursts || durable < r.bumps; ++b) {
+        double t0 = Now();
+        if (b < bursts) {
+            for (int i = 0; i < per_burst; ++i) {
+                char target[32];
+                snprintf(target, sizeof(target), "target-%d", i);
+                store.Stage(target, ++gens[target]);
+                r.bumps++;
+            }
+        }
+        double stall = Now() - t0;
+        // The event loop: wait for the next burst or a completed commit
+        while (0 < poll(&pfd, 1, (gap_us + 999) / 1000)) {
+            GenerationBatch done;
+            double t1 = Now();
+            store.Reap(&done);
+            stall += Now() - t1;
+            durable += done.size();
+            if (b < bursts) break;
+        }
+        if (b < bursts) {
+            r.stall_total += stall;
+            if (stall > r.stall_max) r.stall_max = stall;
+        }
+    }
+    r.elapsed = Now() - start;
+    r.syncs = store.Syncs();
+    Report("group", r, bursts);
+}
+
+}  // end anonymous namespace
+
+int
+main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <log path> [targets per burst] [bursts] "
+                "[gap us]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int per_burst = (argc > 2) ? atoi(argv[2]) : 32;
+    int bursts = (argc > 3) ? atoi(argv[3]) : 200;
+    int gap_us = (argc > 4) ? atoi(argv[4]) : 1000;
+    RunSync(argv[1], per_burst, bursts, gap_us);
+    RunGroup(argv[1], per_burst, bursts, gap_us);
+    Reset(argv[1]);
+    return EXIT_SUCCESS;
+}
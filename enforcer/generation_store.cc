@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+#include "generation_store.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "common.h"
+
+namespace {
+const size_t kLogLineSize = kGenerationHandleSize + 16;
+// Never checkpoint more often than this many log entries.
+const size_t kMinCheckpointEntries = 64;
+}  // end anonymous namespace
+
+GenerationStore::GenerationStore(const char* log_path) :
+        log_path_(log_path), table_path_(log_path), log_(NULL),
+        log_entries_(0), checkpoints_(false), syncs_(0), threaded_(false),
+        busy_(false), running_(JOB_NONE), job_(JOB_NONE) {
+    table_path_ += ".tbl";
+    notify_[0] = notify_[1] = -1;
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&cond_, NULL);
+}
+
+GenerationStore::~GenerationStore() {
+    if (threaded_) {
+        pthread_mutex_lock(&lock_);
+        while (job_ != JOB_NONE) {
+            pthread_cond_wait(&cond_, &lock_);
+        }
+        job_ = JOB_EXIT;
+        pthread_cond_broadcast(&cond_);
+        pthread_mutex_unlock(&lock_);
+        pthread_join(thread_, NULL);
+        close(notify_[0]);
+        close(notify_[1]);
+    }
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&lock_);
+    if (log_) fclose(log_);
+}
+
+void
+GenerationStore::Sync(int fd) {
+    if (0 != fsync(fd)) {
+        CHECK(EROFS == errno || EINVAL == errno);
+    }
+}
+
+void
+GenerationStore::Load(std::map<std::string, uint32_t>* gens) {
+    log_ = fopen(log_path_.c_str(), "a+");
+    CHECK(log_);
+    struct stat st;
+    CHECK(0 == fstat(fileno(log_), &st));
+    checkpoints_ = S_ISREG(st.st_mode);
+    if (checkpoints_) LoadTable();
+    ReplayLog();
+    if (checkpoints_) Checkpoint();
+    gens->insert(durable_.begin(), durable_.end());
+    LOG("Loaded %zu generations from %s", durable_.size(), log_path_.c_str());
+}
+
+void
+GenerationStore::Absorb(const char* path,
+                        std::map<std::string, uint32_t>* gens) {
+    CHECK(!threaded_);
+    GenerationStore other(path);
+    other.log_ = fopen(path, "r");
+    if (other.log_ == NULL) {
+        CHECK(ENOENT == errno);
+        errno = 0;
+        return;
+    }
+    other.LoadTable();
+    other.ReplayLog();
+    std::map<std::string, uint32_t>::const_iterator it;
+    for (it = other.durable_.begin(); it != other.durable_.end(); ++it) {
+        uint32_t& mine = durable_[it->first];
+        mine = std::max(mine, it->second);
+        uint32_t& theirs = (*gens)[it->first];
+        theirs = std::max(theirs, it->second);
+    }
+    LOG("Absorbed %zu generations from %s", other.durable_.size(), path);
+    if (!checkpoints_) return;
+    Checkpoint();
+    CHECK(0 == unlink(path));
+    if (0 != unlink(other.table_path_.c_str())) {
+        CHECK(ENOENT == errno);
+        errno = 0;
+    }
+}
+
+void
+GenerationStore::LoadTable() {
+    int fd = open(table_path_.c_str(), O_RDONLY);
+    if (fd < 0) {
+        CHECK(ENOENT == errno);
+        errno = 0;
+        return;
+    }
+    struct stat st;
+    CHECK(0 == fstat(fd, &st));
+    size_t size = st.st_size;
+    CHECK(size >= sizeof(generation_table_header));
+    void* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    CHECK(base != MAP_FAILED);
+    close(fd);
+
+    const generation_table_header* hdr =
+        static_cast<const generation_table_header*>(base);
+    CHECK(hdr->magic == kGenerationTableMagic);
+    CHECK(hdr->version == kGenerationTableVersion);
+    CHECK(hdr->record_size == sizeof(generation_record));
+    CHECK(size == sizeof(*hdr) + hdr->count * sizeof(generation_record));
+    const generation_record* rec =
+        reinterpret_cast<const generation_record*>(hdr + 1);
+    for (uint32_t i = 0; i < hdr->count; ++i) {
+        CHECK(rec[i].handle[kGenerationHandleSize - 1] == '\0');
+        durable_[rec[i].handle] = rec[i].generation;
+    }
+    CHECK(0 == munmap(base, size));
+}
+
+void
+GenerationStore::ReplayLog() {
+    char line[kLogLineSize];
+    rewind(log_);
+    while (NULL != fgets(line, kLogLineSize, log_)) {
+        size_t len = strlen(line);
+        // An unterminated line was never synced, so it was never exposed.
+        if (len == 0 || line[len - 1] != '\n') break;
+        line[len - 1] = '\0';
+        char* sep = strchr(line, '\t');
+        if (sep) {
+            *sep = '\0';
+            durable_[line] = strtoul(sep + 1, NULL, 10);
+        } else {
+            // Old format: one line per increment
+            durable_[line]++;
+        }
+        log_entries_++;
+    }
+}
+
+void
+GenerationStore::Append(const char* target, uint32_t generation) {
+    CHECK(!threaded_);
+    GenerationBatch batch(1, std::make_pair(std::string(target), generation));
+    WriteLog(batch);
+    durable_[target] = generation;
+    log_entries_++;
+    syncs_++;
+    if (CheckpointDue()) Checkpoint();
+}
+
+void
+GenerationStore::Checkpoint() {
+    CHECK(!threaded_);
+    if (!checkpoints_) return;
+    std::vector<generation_record> records;
+    Snapshot(&records);
+    WriteTable(records);
+    log_entries_ = 0;
+}
+
+bool
+GenerationStore::CheckpointDue() const {
+    return checkpoints_ && log_entries_ >= kMinCheckpointEntries &&
+           log_entries_ >= durable_.size();
+}
+
+void
+GenerationStore::WriteLog(const GenerationBatch& batch) {
+    GenerationBatch::const_iterator it;
+    for (it = batch.begin(); it != batch.end(); ++it) {
+        CHECK(it->first.size() < kGenerationHandleSize);
+        CHECK(0 <= fprintf(log_, "%s\t%u\n", it->first.c_str(), it->second));
+    }
+    CHECK(0 == fflush(log_));
+    Sync(fileno(log_));
+}
+
+void
+GenerationStore::Snapshot(std::vector<generation_record>* records) const {
+    records->resize(durable_.size());
+    std::map<std::string, uint32_t>::const_iterator it;
+    size_t i = 0;
+    for (it = durable_.begin(); it != durable_.end(); ++it, ++i) {
+        generation_record& rec = (*records)[i];
+        memset(&rec, 0, sizeof(rec));
+        strncpy(rec.handle, it->first.c_str(), kGenerationHandleSize - 1);
+        rec.generation = it->second;
+    }
+}
+
+void
+GenerationStore::WriteTable(const std::vector<generation_record>& records) {
+    std::string tmp_path = table_path_ + ".tmp";
+    FILE* out = fopen(tmp_path.c_str(), "w");
+    CHECK(out);
+
+    generation_table_header hdr;
+    hdr.magic = kGenerationTableMagic;
+    hdr.version = kGenerationTableVersion;
+    hdr.record_size = sizeof(generation_record);
+    hdr.count = records.size();
+    CHECK(1 == fwrite(&hdr, sizeof(hdr), 1, out));
+    if (!records.empty()) {
+        CHECK(records.size() ==
+              fwrite(&records[0], sizeof(records[0]), records.size(), out));
+    }
+    CHECK(0 == fflush(out));
+    Sync(fileno(out));
+    int ret = fclose(out);
+    CHECK(0 == ret);
+    CHECK(0 == rename(tmp_path.c_str(), table_path_.c_str()));
+
+    // Make the rename durable before throwing away the log.
+    size_t slash = table_path_.rfind('/');
+    std::string dir = (slash == std::string::npos) ?
+                      "." : table_path_.substr(0, slash + 1);
+    int dfd = open(dir.c_str(), O_RDONLY);
+    if (dfd >= 0) {
+        Sync(dfd);
+        close(dfd);
+    }
+
+    // The log holds absolute generations, so a crash before the truncate
+    // only means replaying entries the table already has.
+    CHECK(0 == ftruncate(fileno(log_), 0));
+    Sync(fileno(log_));
+}
+
+void
+GenerationStore::StartSyncThread() {
+    CHECK(!threaded_);
+    CHECK(0 == pipe(notify_));
+    threaded_ = true;
+    CHECK(0 == pthread_create(&thread_, NULL, &GenerationStore::SyncThread,
+                              this));
+}
+
+void
+GenerationStore::Stage(const char* target, uint32_t generation) {
+    CHECK(threaded_);
+    CHECK(strlen(target) < kGenerationHandleSize);
+    staged_.push_back(std::make_pair(std::string(target), generation));
+    if (!busy_) StartJob();
+}
+
+void
+GenerationStore::StartJob() {
+    if (CheckpointDue()) {
+        Snapshot(&snapshot_);
+        running_ = JOB_CHECKPOINT;
+    } else if (!staged_.empty()) {
+        in_flight_.swap(staged_);
+        running_ = JOB_SYNC;
+    } else {
+        return;
+    }
+    busy_ = true;
+    pthread_mutex_lock(&lock_);
+    job_ = running_;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&lock_);
+}
+
+void
+GenerationStore::Reap(GenerationBatch* done) {
+    char buf;
+    if (1 != read(notify_[0], &buf, 1)) {
+        CHECK(EAGAIN == errno || EINTR == errno);
+        return;
+    }
+    CHECK(busy_);
+    busy_ = false;
+    if (running_ == JOB_SYNC) {
+        GenerationBatch::const_iterator it;
+        for (it = in_flight_.begin(); it != in_flight_.end(); ++it) {
+            durable_[it->first] = it->second;
+        }
+        log_entries_ += in_flight_.size();
+        syncs_++;
+        done->insert(done->end(), in_flight_.begin(), in_flight_.end());
+        in_flight_.clear();
+    } else if (running_ == JOB_CHECKPOINT) {
+        log_entries_ = 0;
+        snapshot_.clear();
+    }
+    running_ = JOB_NONE;
+    StartJob();
+}
+
+void*
+GenerationStore::SyncThread(void* arg) {
+    GenerationStore* store = static_cast<GenerationStore*>(arg);
+    for (;;) {
+        pthread_mutex_lock(&store->lock_);
+        while (store->job_ == JOB_NONE) {
+            pthread_cond_wait(&store->cond_, &store->lock_);
+        }
+        sync_job job = store->job_;
+        pthread_mutex_unlock(&store->lock_);
+        if (job == JOB_EXIT) break;
+
+        // Only log I/O happens here; durable_ is updated by Reap().
+        if (job == JOB_SYNC) {
+            store->WriteLog(store->in_flight_);
+        } else {
+            store->WriteTable(store->snapshot_);
+        }
+
+        pthread_mutex_lock(&store->lock_);
+        store->job_ = JOB_NONE;
+        pthread_cond_broadcast(&store->cond_);
+        pthread_mutex_unlock(&store->lock_);
+        char c = 0;
+        CHECK(1 == write(store->notify_[1], &c, 1));
+    }
+    return NULL;
+}
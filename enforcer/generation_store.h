@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+#ifndef _NTFA_ENFORCER_GENERATION_STORE_H_
+#define _NTFA_ENFORCER_GENERATION_STORE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// On-disk layout of the checkpointed generation table. The table is a header
+// followed by count fixed-size records and is only ever replaced wholesale
+// by rename(), so a reader never sees a partially written table.
+const uint32_t kGenerationTableMagic = 0x4e454746;  // "FGEN"
+const uint32_t kGenerationTableVersion = 1;
+const size_t kGenerationHandleSize = 256;
+
+struct generation_table_header {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    record_size;
+    uint32_t    count;
+} __attribute__((__packed__));
+
+struct generation_record {
+    char        handle[kGenerationHandleSize];
+    uint32_t    generation;
+} __attribute__((__packed__));
+
+typedef std::vector<std::pair<std::string, uint32_t> > GenerationBatch;
+
+// Durable generation state for an enforcer.
+//
+// Generation bumps are appended to a small log as "handle\tgeneration" lines
+// holding the absolute generation, so replaying an entry twice is harmless
+// and the last entry for a target wins. Once the log holds as many entries
+// as there are live targets it is folded into the table file (<log>.tbl)
+// and truncated. Startup cost is therefore proportional to the number of
+// targets, not to the number of failures ever observed.
+//
+// Old logs holding bare "handle" lines (one line per increment) are still
+// understood and are converted to a table on the first Load().
+//
+// Append() syncs inline. Once StartSyncThread() has been called, callers
+// should use Stage() instead: staged entries are written and fsynced by a
+// helper thread, and everything staged while one fsync is running goes out
+// together in the next one (group commit). The helper writes a byte to
+// NotifyFd() after each job, at which point Reap() hands back the entries
+// that are now durable. All methods except the helper thread itself must be
+// called from one thread.
+class GenerationStore {
+    public:
+        explicit GenerationStore(const char* log_path);
+        ~GenerationStore();
+
+        // Reads the table and replays the log into gens, then checkpoints.
+        void Load(std::map<std::string, uint32_t>* gens);
+
+        // Merges the table and log of another store at path (left by a
+        // shard of an earlier run) into this one and into gens, keeping the
+        // higher generation of each target. Once the merged table is durable
+        // the other store's files are removed. Call after Load().
+        void Absorb(const char* path, std::map<std::string, uint32_t>* gens);
+
+        // False when the log is not a regular file (e.g. /dev/null)
+        bool Checkpoints() const { return checkpoints_; }
+
+        // Durably records that target is now at generation. Returns once
+        // the entry is on stable storage. Handles, here and in Stage(), must
+        // be shorter than kGenerationHandleSize; the enforcer refuses longer
+        // ones before they become targets (Enforcer::GetValidTarget()).
+        void Append(const char* target, uint32_t generation);
+
+        // Writes every known generation to a fresh table and truncates the
+        // log behind it.
+        void Checkpoint();
+
+        // Starts the helper thread. Append() and Checkpoint() may not be
+        // used afterwards.
+        void StartSyncThread();
+
+        // Queues an entry for the next group commit.
+        void Stage(const char* target, uint32_t generation);
+
+        // Becomes readable when the helper thread finishes a job
+        int NotifyFd() const { return notify_[0]; }
+
+        // Collects the entries made durable by the last job into done and
+        // starts the next job, if any.
+        void Reap(GenerationBatch* done);
+
+        // Number of entries in the log since the last checkpoint
+        size_t LogEntries() const { return log_entries_; }
+
+        // Number of log fsyncs issued so far
+        size_t Syncs() const { return syncs_; }
+
+    private:
+        enum sync_job {
+            JOB_NONE,
+            JOB_SYNC,
+            JOB_CHECKPOINT,
+            JOB_EXIT
+        };
+
+        // Hands the next batch (or a due checkpoint) to the helper thread.
+        void StartJob();
+
+        // Helper thread body
+        static void* SyncThread(void* store);
+
+        // Writes batch to the log and syncs it
+        void WriteLog(const GenerationBatch& batch);
+
+        // Builds a table image of durable_ in records
+        void Snapshot(std::vector<generation_record>* records) const;
+
+        // Replaces the table with records and truncates the log
+        void WriteTable(const std::vector<generation_record>& records);
+
+        // True when the log is long enough to be worth folding into the table
+        bool CheckpointDue() const;
+
+        // Maps the table read-only and merges its records into durable_
+        void LoadTable();
+
+        // Replays the write-ahead log into durable_
+        void ReplayLog();
+
+        // fsync that tolerates file systems without sync support (tmpfs,
+        // /dev/null)
+        static void Sync(int fd);
+
+        std::string                         log_path_;
+        std::string                         table_path_;
+        FILE*                               log_;
+        size_t                              log_entries_;
+
+        // Only regular files get a table. Logging to /dev/null is allowed.
+        bool                                checkpoints_;
+
+        // Last durable generation of every target
+        std::map<std::string, uint32_t>     durable_;
+        size_t                              syncs_;
+
+        // Group commit state. staged_ belongs to the caller's thread. While
+        // busy_ is set, in_flight_ and snapshot_ belong to the helper.
+        bool                                threaded_;
+        bool                                busy_;
+        GenerationBatch                     staged_;
+        GenerationBatch                     in_flight_;
+        std::vector<generation_record>      snapshot_;
+        sync_job                            running_;
+        int                                 notify_[2];
+
+        // Protects job_
+        pthread_mutex_t                     lock_;
+        pthread_cond_t                      cond_;
+        sync_job                            job_;
+        pthread_t                           thread_;
+};
+#endif  // _NTFA_ENFORCER_GENERATION_STORE_H_
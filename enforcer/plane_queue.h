@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+#ifndef _NTFA_ENFORCER_PLANE_QUEUE_H_
+#define _NTFA_ENFORCER_PLANE_QUEUE_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "common.h"
+
+// Lock-free queue from one thread to one other, e.g. between an enforcer's
+// control plane (the libasync loop) and a data-plane thread. Neither side
+// ever blocks on the other: pushing and popping touch only the ring and,
+// when the consumer may be asleep, one byte on a pipe the consumer polls.
+//
+// The consumer calls Acknowledge() when NotifyFd() is readable and then
+// pops until the queue is empty. A push that races with the drain either
+// lands in it or raises a fresh notification.
+template <class T>
+class PlaneQueue {
+    public:
+        // capacity must be a power of two
+        explicit PlaneQueue(size_t capacity) : ring_(capacity),
+                mask_(capacity - 1), head_(0), tail_(0), notified_(0) {
+            CHECK(capacity > 0 && (capacity & mask_) == 0);
+            CHECK(0 == pipe(pipe_));
+            for (int i = 0; i < 2; ++i) {
+                fcntl(pipe_[i], F_SETFL, O_NONBLOCK);
+                fcntl(pipe_[i], F_SETFD, FD_CLOEXEC);
+            }
+        }
+
+        ~PlaneQueue() {
+            close(pipe_[0]);
+            close(pipe_[1]);
+        }
+
+        // Producer: appends v. A full queue means the consumer is far
+        // behind; the producer sleeps rather than spins, since it may
+        // outrank the consumer on the same CPU.
+        void Push(const T& v) {
+            while (tail_ - head_ > mask_) {
+                usleep(kFullWaitUs);
+            }
+            ring_[tail_ & mask_] = v;
+            // Publish the element before the new tail
+            __sync_synchronize();
+            tail_++;
+            if (__sync_bool_compare_and_swap(&notified_, 0, 1)) {
+                char c = 0;
+                while (write(pipe_[1], &c, 1) < 0 && errno == EINTR) {}
+            }
+        }
+
+        // Consumer: readable while there may be something to pop
+        int NotifyFd() const { return pipe_[0]; }
+
+        // Consumer: clears the notification. Call before draining.
+        void Acknowledge() {
+            char buf[64];
+            while (read(pipe_[0], buf, sizeof(buf)) > 0) {}
+            errno = 0;
+            __sync_lock_release(&notified_);
+            __sync_synchronize();
+        }
+
+        // Consumer: takes the oldest element, if any
+        bool Pop(T* v) {
+            if (head_ == tail_) return false;
+            // Read the element only after seeing the tail that published it
+            __sync_synchronize();
+            *v = ring_[head_ & mask_];
+            __sync_synchronize();
+            head_++;
+            return true;
+        }
+
+    private:
+        enum { kFullWaitUs = 100 };
+
+        std::vector<T>          ring_;
+        const size_t            mask_;
+        // Written by the consumer only
+        volatile size_t         head_;
+        // Written by the producer only
+        volatile size_t         tail_;
+        volatile int            notified_;
+        int                     pipe_[2];
+};
+#endif  // _NTFA_ENFORCER_PLANE_QUEUE_H_
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+// Checks how SPY_REGISTER treats the handle and generation vector it is
+// given, and the detection deadline a target is left with as clients come
+// and go. The enforcer runs in-process, serving kFalconPort as a spy would,
+// and sits on top of one lower layer at generation kLowerGen. Each case
+// sends one request and exits non-zero if the answer is not the one
+// expected.
+//
+// usage: register_check
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <arpc.h>
+#include <async.h>
+
+#include <string>
+
+#include "common.h"
+#include "enforcer.h"
+
+namespace {
+
+const gen_no kLowerGen = 5;
+const gen_no kNone = 0xffffffff;
+const uint32_t kAny = 0xffffffff;
+
+// Downs nobody answers fail after this long, which removes their client
+const uint32_t kDownDeadlineMs = 100;
+
+struct register_case {
+    const char* name;
+    // How long to wait before sending
+    uint32_t    wait_ms;
+    uint32_t    proc;
+    // NULL for a handle too long for the generation store
+    const char* handle;
+    uint32_t    client_tag;
+    // Generations to send; kNone ends the vector
+    gen_no      gen[3];
+    uint32_t    deadline_ms;
+    uint32_t    expect;
+    // Detection deadline the reply should carry, or kAny
+    uint32_t    expect_deadline_ms;
+};
+
+// Targets' own generations are 0, their first incarnation. Client 1 holds
+// the tightest deadline for "tight" and is removed when the down for
+// "doomed" goes unanswered; client 2 then must not inherit its deadline.
+const register_case kCases[] = {
+    {"current prefix", 0, SPY_REGISTER, "target", 0,
+     {kLowerGen, kNone, kNone}, 0, FALCON_REGISTER_ACK, 0},
+    {"stale prefix", 0, SPY_REGISTER, "target", 0,
+     {kLowerGen - 1, kNone, kNone}, 0, FALCON_WRONG_GEN, kAny},
+    {"future prefix", 0, SPY_REGISTER, "target", 0,
+     {kLowerGen + 1, kNone, kNone}, 0, FALCON_WRONG_GEN, kAny},
+    {"full vector", 0, SPY_REGISTER, "target", 0,
+     {kLowerGen, 0, kNone}, 0, FALCON_REGISTER_ACK, 0},
+    {"stale full vector", 0, SPY_REGISTER, "target", 0,
+     {kLowerGen - 1, 0, kNone}, 0, FALCON_LONG_DEAD, kAny},
+    {"empty vector", 0, SPY_REGISTER, "target", 0,
+     {kNone, kNone, kNone}, 0, FALCON_BAD_GEN_VEC, kAny},
+    {"long vector", 0, SPY_REGISTER, "target", 0,
+     {kLowerGen, 0, 0}, 0, FALCON_BAD_GEN_VEC, kAny},
+    {"long handle", 0, SPY_REGISTER, NULL, 0,
+     {kLowerGen, kNone, kNone}, 0, FALCON_UNKNOWN_TARGET, kAny},
+    {"tight deadline", 0, SPY_REGISTER, "tight", 1,
+     {kLowerGen, kNone, kNone}, 10, FALCON_REGISTER_ACK, 10},
+    {"second target", 0, SPY_REGISTER, "doomed", 1,
+     {kLowerGen, kNone, kNone}, 0, FALCON_REGISTER_ACK, 0},
+    {"default deadline", 0, SPY_REGISTER, "tight", 2,
+     {kLowerGen, kNone, kNone}, 0, FALCON_REGISTER_ACK, 10},
+    {"kill second target", 0, SPY_KILL, "doomed", 0,
+     {kLowerGen, 0, kNone}, 0, FALCON_KILL_ACK, kAny},
+    {"tightest client removed", 5 * kDownDeadlineMs, SPY_REGISTER, "tight", 2,
+     {kLowerGen, kNone, kNone}, 0, FALCON_REGISTER_ACK, 0},
+};
+const size_t kNumCases = sizeof(kCases) / sizeof(kCases[0]);
+
+// An enforcer whose layer accepts every target, meets every deadline and
+// reports a target down when asked to kill it, above one lower layer
+class CheckEnforcer : public virtual Enforcer {
+  public:
+    CheckEnforcer() {
+        gen_vec_.push_back(kLowerGen);
+        down_deadline_ms_ = kDownDeadlineMs;
+    }
+    virtual ~CheckEnforcer() {}
+    virtual void Init() {}
+    virtual void StartMonitoring(const ref<const str> handle) {}
+    virtual void StopMonitoring(const ref<const str> handle) {}
+    virtual bool InvalidTarget(const ref<const str> handle) { return false; }
+    virtual void Kill(const ref<const str> handle) {
+        ObserveDown(handle, 0, true, true);
+    }
+    virtual void UpdateGenerations(const ref<const str> handle) {}
+    virtual uint32_t SetDeadline(const ref<const str> handle,
+                                 uint32_t deadline_ms) {
+        return deadline_ms;
+    }
+};
+
+ptr<aclnt>      enforcer;
+client_addr_t   client;
+std::string     long_handle(kGenerationHandleSize, 'x');
+size_t          current;
+bool            failed;
+
+int
+LoopbackSocket(sockaddr_in* addr) {
+    int fd = inetsocket(SOCK_DGRAM, 0, INADDR_LOOPBACK);
+    CHECK(fd >= 0);
+    make_async(fd);
+    close_on_exec(fd);
+    socklen_t len = sizeof(*addr);
+    CHECK(0 == getsockname(fd, reinterpret_cast<sockaddr*>(addr), &len));
+    return fd;
+}
+
+void Issue();
+
+void
+Answered(ref<spy_res> res, clnt_stat st) {
+    const register_case& c = kCases[current];
+    if (st != RPC_SUCCESS) {
+        fprintf(stderr, "%s: rpc %d\n", c.name, st);
+        exit(EXIT_FAILURE);
+    }
+    bool ok = (res->status == c.expect &&
+               (c.expect_deadline_ms == kAny ||
+                res->deadline_ms == c.expect_deadline_ms));
+    printf("case=\"%s\" status=%u expected=%u deadline_ms=%u %s\n", c.name,
+           res->status, c.expect, res->deadline_ms, ok ? "ok" : "FAILED");
+    fflush(stdout);
+    if (!ok) {
+        failed = true;
+    }
+    if (++current == kNumCases) {
+        exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    const register_case& next = kCases[current];
+    if (next.wait_ms) {
+        delaycb(next.wait_ms / kSecondsToMilliseconds,
+                (next.wait_ms % kSecondsToMilliseconds) *
+                kMillisecondsToNanoseconds, wrap(Issue));
+    } else {
+        Issue();
+    }
+}
+
+void
+FillTarget(const register_case& c, target_t* target) {
+    if (c.handle) {
+        target->handle = c.handle;
+    } else {
+        target->handle = long_handle.c_str();
+    }
+    size_t n = 0;
+    while (n < 3 && c.gen[n] != kNone) {
+        n++;
+    }
+    target->generation.setsize(n);
+    for (size_t i = 0; i < n; ++i) {
+        target->generation[i] = c.gen[i];
+    }
+}
+
+void
+Issue() {
+    const register_case& c = kCases[current];
+    ref<spy_res> res = New refcounted<spy_res>;
+    if (c.proc == SPY_KILL) {
+        ref<spy_kill_arg> a = New refcounted<spy_kill_arg>;
+        FillTarget(c, &a->target);
+        enforcer->call(SPY_KILL, a, res, wrap(Answered, res));
+        return;
+    }
+    ref<spy_register_arg> a = New refcounted<spy_register_arg>;
+    FillTarget(c, &a->target);
+    a->lethal = false;
+    // No ups, so nothing is sent to the client address but downs
+    a->up_interval_ms = -1;
+    a->deadline_ms = c.deadline_ms;
+    a->client = client;
+    a->client.client_tag = c.client_tag;
+    enforcer->call(SPY_REGISTER, a, res, wrap(Answered, res));
+}
+
+}  // end anonymous namespace
+
+int
+main(int argc, char** argv) {
+    async_init();
+    ref<CheckEnforcer> e = New refcounted<CheckEnforcer>();
+
+    // Registered as the clients' callback address; never read
+    sockaddr_in client_addr;
+    LoopbackSocket(&client_addr);
+    client.ipaddr = client_addr.sin_addr.s_addr;
+    client.port = client_addr.sin_port;
+    client.client_tag = 0;
+
+    sockaddr_in enforcer_addr;
+    memset(&enforcer_addr, 0, sizeof(enforcer_addr));
+    enforcer_addr.sin_family = AF_INET;
+    enforcer_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    enforcer_addr.sin_port = htons(kFalconPort);
+    int fd = inetsocket(SOCK_DGRAM, 0, 0);
+    CHECK(fd >= 0);
+    make_async(fd);
+    close_on_exec(fd);
+    enforcer = aclnt::alloc(axprt_dgram::alloc(fd), spy_prog_1,
+                            reinterpret_cast<sockaddr*>(&enforcer_addr));
+    // Runs once the enforcer serves
+    delaycb(0, 0, wrap(Issue));
+    e->Run();
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+#include "registration_journal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+
+namespace {
+// Never compact more often than this many entries.
+const size_t kMinCompactEntries = 64;
+}  // end anonymous namespace
+
+RegistrationJournal::RegistrationJournal(const char* path) :
+        path_(path), log_(NULL), entries_(0) {}
+
+RegistrationJournal::~RegistrationJournal() {
+    if (log_) {
+        fflush(log_);
+        fclose(log_);
+    }
+}
+
+void
+RegistrationJournal::Read(const char* path, const std::vector<uint32_t>& base,
+                          RegistrationMap* regs) {
+    FILE* in = fopen(path, "r");
+    if (in == NULL) {
+        CHECK(ENOENT == errno);
+        errno = 0;
+        return;
+    }
+    char line[kJournalLineSize];
+    size_t count = 0;
+    std::vector<uint32_t> theirs;
+    bool ours = (NULL != fgets(line, kJournalLineSize, in) &&
+                 ParseBase(line, &theirs) && theirs == base);
+    while (ours && NULL != fgets(line, kJournalLineSize, in)) {
+        size_t len = strlen(line);
+        // An unterminated line was cut short by a crash
+        if (len == 0 || line[len - 1] != '\n') break;
+        line[len - 1] = '\0';
+        if (!ApplyLine(line, regs)) {
+            LOG("Bad registration journal entry in %s: %s", path, line);
+            break;
+        }
+        count++;
+    }
+    fclose(in);
+    if (ours) {
+        LOG("Replayed %zu registration entries from %s", count, path);
+    } else {
+        LOG("Ignoring registrations from another incarnation in %s", path);
+    }
+}
+
+bool
+RegistrationJournal::ApplyLine(const char* line, RegistrationMap* regs) {
+    registration_key key;
+    registration_state state;
+    int lethal = 0;
+    int off = 0;
+    // Lines written before registrations had a deadline lack the last
+    // number. The handle must follow a tab either way; a format that
+    // swallowed part of it leaves off elsewhere.
+    if (7 != sscanf(line, "R\t%u\t%u\t%u\t%u\t%d\t%d\t%u\t%n",
+                    &key.ipaddr, &key.port, &key.tag, &state.generation,
+                    &state.up_interval_ms, &lethal, &state.deadline_ms,
+                    &off) || off == 0 || line[off - 1] != '\t' ||
+        line[off] == '\0') {
+        off = 0;
+        state.deadline_ms = 0;
+        if (6 != sscanf(line, "R\t%u\t%u\t%u\t%u\t%d\t%d\t%n",
+                        &key.ipaddr, &key.port, &key.tag, &state.generation,
+                        &state.up_interval_ms, &lethal, &off)) {
+            off = 0;
+        }
+    }
+    if (off > 0) {
+        key.handle = line + off;
+        state.lethal = (lethal != 0);
+        (*regs)[key] = state;
+        return true;
+    }
+    if (3 == sscanf(line, "C\t%u\t%u\t%u\t%n", &key.ipaddr, &key.port,
+                    &key.tag, &off) && off > 0) {
+        key.handle = line + off;
+        regs->erase(key);
+        return true;
+    }
+    return false;
+}
+
+bool
+RegistrationJournal::ParseBase(const char* line, std::vector<uint32_t>* base) {
+    if (line[0] != 'V' || line[1] != '\t') return false;
+    const char* pos = line + 2;
+    char* end;
+    unsigned long n = strtoul(pos, &end, 10);
+    if (end == pos || n > kJournalLineSize) return false;
+    base->clear();
+    for (size_t i = 0; i < n; ++i) {
+        pos = end;
+        unsigned long g = strtoul(pos, &end, 10);
+        if (end == pos) return false;
+        base->push_back(g);
+    }
+    return *end == '\n' || *end == '\0';
+}
+
+size_t
+RegistrationJournal::FormatBase(char* buf, size_t len,
+                                const std::vector<uint32_t>& base) {
+    size_t used = snprintf(buf, len, "V\t%zu", base.size());
+    for (size_t i = 0; i < base.size() && used < len; ++i) {
+        used += snprintf(buf + used, len - used, "\t%u", base[i]);
+    }
+    if (used < len) used += snprintf(buf + used, len - used, "\n");
+    return (used < len) ? used : 0;
+}
+
+size_t
+RegistrationJournal::FormatRegister(char* buf, size_t len,
+                                    const registration_key& key,
+                                    const registration_state& state) {
+    size_t used = snprintf(buf, len, "R\t%u\t%u\t%u\t%u\t%d\t%d\t%u\t%s\n",
+                           key.ipaddr, key.port, key.tag, state.generation,
+                           state.up_interval_ms, state.lethal ? 1 : 0,
+                           state.deadline_ms, key.handle.c_str());
+    return (used < len) ? used : 0;
+}
+
+size_t
+RegistrationJournal::FormatCancel(char* buf, size_t len,
+                                  const registration_key& key) {
+    size_t used = snprintf(buf, len, "C\t%u\t%u\t%u\t%s\n", key.ipaddr,
+                           key.port, key.tag, key.handle.c_str());
+    return (used < len) ? used : 0;
+}
+
+void
+RegistrationJournal::Open(const std::vector<uint32_t>& base,
+                          const RegistrationMap& regs) {
+    base_ = base;
+    live_ = regs;
+    Rewrite();
+}
+
+void
+RegistrationJournal::Write(FILE* out, const char* line, size_t len) {
+    CHECK(len > 0);
+    CHECK(len == fwrite(line, 1, len, out));
+}
+
+void
+RegistrationJournal::Register(const registration_key& key,
+                              const registration_state& state) {
+    CHECK(log_);
+    // The enforcer refuses such targets (see Enforcer::GetValidTarget()),
+    // so this only guards the fixed-size line below
+    if (key.handle.size() >= kGenerationHandleSize) {
+        LOG("Not journaling a registration for a %zu byte handle",
+            key.handle.size());
+        return;
+    }
+    std::pair<RegistrationMap::iterator, bool> ins =
+        live_.insert(std::make_pair(key, state));
+    if (!ins.second) {
+        if (ins.first->second == state) return;
+        ins.first->second = state;
+    }
+    char line[kJournalLineSize];
+    Write(log_, line, FormatRegister(line, sizeof(line), key, state));
+    entries_++;
+}
+
+void
+RegistrationJournal::Cancel(const registration_key& key) {
+    CHECK(log_);
+    if (live_.erase(key) == 0) return;
+    char line[kJournalLineSize];
+    Write(log_, line, FormatCancel(line, sizeof(line), key));
+    entries_++;
+}
+
+void
+RegistrationJournal::Flush() {
+    CHECK(log_);
+    if (entries_ >= kMinCompactEntries && entries_ >= 2 * live_.size()) {
+        Rewrite();
+        return;
+    }
+    CHECK(0 == fflush(log_));
+}
+
+void
+RegistrationJournal::Rewrite() {
+    std::string tmp_path = path_ + ".tmp";
+    FILE* out = fopen(tmp_path.c_str(), "w");
+    CHECK(out);
+    char line[kJournalLineSize];
+    Write(out, line, FormatBase(line, sizeof(line), base_));
+    RegistrationMap::const_iterator it;
+    for (it = live_.begin(); it != live_.end(); ++it) {
+        Write(out, line, FormatRegister(line, sizeof(line), it->first,
+                                        it->second));
+    }
+    CHECK(0 == fflush(out));
+    int ret = fclose(out);
+    CHECK(0 == ret);
+    CHECK(0 == rename(tmp_path.c_str(), path_.c_str()));
+    // Whatever was buffered for the old file is in the new one already
+    if (log_) fclose(log_);
+    log_ = fopen(path_.c_str(), "a");
+    CHECK(log_);
+    entries_ = live_.size();
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+#ifndef _NTFA_ENFORCER_REGISTRATION_JOURNAL_H_
+#define _NTFA_ENFORCER_REGISTRATION_JOURNAL_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "generation_store.h"
+
+// Identity of a registration: a target and a client layer (callback address
+// and tag, in network byte order as they arrive on the wire)
+struct registration_key {
+    std::string handle;
+    uint32_t    ipaddr;
+    uint32_t    port;
+    uint32_t    tag;
+
+    bool operator<(const registration_key& other) const {
+        int c = handle.compare(other.handle);
+        if (c != 0) return c < 0;
+        if (ipaddr != other.ipaddr) return ipaddr < other.ipaddr;
+        if (port != other.port) return port < other.port;
+        return tag < other.tag;
+    }
+};
+
+// What a registration asked for, and the target generation it was made at
+struct registration_state {
+    registration_state() : generation(0), up_interval_ms(0), lethal(false),
+                           deadline_ms(0) {}
+
+    uint32_t    generation;
+    int32_t     up_interval_ms;
+    bool        lethal;
+    uint32_t    deadline_ms;
+
+    bool operator==(const registration_state& other) const {
+        return generation == other.generation &&
+               up_interval_ms == other.up_interval_ms &&
+               lethal == other.lethal && deadline_ms == other.deadline_ms;
+    }
+};
+
+typedef std::map<registration_key, registration_state> RegistrationMap;
+
+// Longest journal line: a handle the generation store accepts plus the
+// numeric fields
+const size_t kJournalLineSize = kGenerationHandleSize + 96;
+
+// Client registrations of an enforcer, kept next to its generation log
+// (<log>.reg) so that a restarted enforcer can pick up where it left off.
+//
+// The journal is a text file that starts with a "V" line holding the
+// enforcer's base generation vector, followed by "R" (registered or changed)
+// and "C" (cancelled) lines replayed in order. A journal written under a
+// different base vector describes another incarnation of the layers below
+// and is ignored. Entries are buffered and written
+// out by Flush(), which the enforcer calls once per turn of its event loop,
+// and are not fsynced: the journal is meant to survive the enforcer
+// crashing or being restarted, not the machine going down, which takes the
+// clients' view of it along anyway. Once the journal holds twice as many
+// entries as there are live registrations it is rewritten from scratch and
+// swapped in by rename(). Call from one thread only.
+class RegistrationJournal {
+    public:
+        explicit RegistrationJournal(const char* path);
+        ~RegistrationJournal();
+
+        // Replays the journal at path, if there is one and it was written
+        // under base, into regs
+        static void Read(const char* path, const std::vector<uint32_t>& base,
+                         RegistrationMap* regs);
+
+        // Replaces the journal with one holding just regs under base and
+        // opens it for appending
+        void Open(const std::vector<uint32_t>& base,
+                  const RegistrationMap& regs);
+
+        // Records that key is registered with state. Repeating the current
+        // state writes nothing, and so does a handle of kGenerationHandleSize
+        // bytes or more.
+        void Register(const registration_key& key,
+                      const registration_state& state);
+
+        // Records that key is no longer registered, if it was
+        void Cancel(const registration_key& key);
+
+        // Writes out buffered entries, compacting the journal if it is due
+        void Flush();
+
+        // Live registrations
+        const RegistrationMap& Live() const { return live_; }
+
+        // Journal lines, also used to replicate registrations to a standby
+        // enforcer. The Format routines return the length of the line
+        // written to buf, newline included, or 0 if it does not fit.
+        static size_t FormatBase(char* buf, size_t len,
+                                 const std::vector<uint32_t>& base);
+        static size_t FormatRegister(char* buf, size_t len,
+                                     const registration_key& key,
+                                     const registration_state& state);
+        static size_t FormatCancel(char* buf, size_t len,
+                                   const registration_key& key);
+
+        // Parses a "V" line
+        static bool ParseBase(const char* line, std::vector<uint32_t>* base);
+
+        // Applies an "R" or "C" line, without its newline, to regs. Returns
+        // false for anything else.
+        static bool ApplyLine(const char* line, RegistrationMap* regs);
+
+    private:
+        // Writes live_ to a fresh file and renames it over the journal
+        void Rewrite();
+
+        // Writes a formatted line to out
+        static void Write(FILE* out, const char* line, size_t len);
+
+        std::string             path_;
+        std::vector<uint32_t>   base_;
+        FILE*                   log_;
+        size_t                  entries_;
+        RegistrationMap         live_;
+};
+#endif  // _NTFA_ENFORCER_REGISTRATION_JOURNAL_H_
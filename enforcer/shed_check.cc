@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+// Checks that load shedding lets go once the event loop catches up. The
+// enforcer's timer wheel is polled by hand 300 ms after a timer was due, and
+// the shed level is read back after the wheel drains and after the
+// measurement gets old. Exits non-zero if any level is not the one expected.
+//
+// usage: shed_check
+#include <unistd.h>
+
+#include <async.h>
+
+#include "common.h"
+#include "enforcer.h"
+
+namespace {
+
+const uint64_t kLateNs = 300 * 1000 * 1000;
+
+void Nothing() {}
+
+const char* kLevels[] = {"SHED_NONE", "SHED_QUERIES", "SHED_REGISTERS",
+                         "SHED_UPS"};
+
+// An enforcer that monitors nothing, for its timer wheel and shed level
+class ShedEnforcer : public virtual Enforcer {
+  public:
+    virtual ~ShedEnforcer() {}
+    virtual void Init() {}
+    virtual void StartMonitoring(const ref<const str> handle) {}
+    virtual void StopMonitoring(const ref<const str> handle) {}
+    virtual bool InvalidTarget(const ref<const str> handle) { return false; }
+    virtual void Kill(const ref<const str> handle) {}
+    virtual void UpdateGenerations(const ref<const str> handle) {}
+
+    // Fires a 1 ms timer kLateNs late while a 10 s one stays armed. The
+    // 10 s one is left in *pending.
+    void PollLate(wheel_timer** pending) {
+        wheel_timer* soon = timers_->NewTimer(wrap(Nothing));
+        *pending = timers_->NewTimer(wrap(Nothing));
+        timers_->Arm(soon, 0, 1000 * 1000);
+        timers_->Arm(*pending, 10, 0);
+        usleep((1000 * 1000 + kLateNs) / 1000);
+        timers_->Poll(TimerWheel::Now());
+        timers_->FreeTimer(soon);
+    }
+
+    void Drain(wheel_timer* pending) { timers_->FreeTimer(pending); }
+
+    bool Expect(const char* when, shed_level expect) {
+        shed_level level = Overload();
+        bool ok = (level == expect);
+        printf("when=\"%s\" level=%s expected=%s %s\n", when, kLevels[level],
+               kLevels[expect], ok ? "ok" : "FAILED");
+        return ok;
+    }
+};
+
+}  // end anonymous namespace
+
+int
+main(int argc, char** argv) {
+    async_init();
+    ref<ShedEnforcer> e = New refcounted<ShedEnforcer>();
+    bool ok = e->Expect("idle", SHED_NONE);
+
+    wheel_timer* pending;
+    e->PollLate(&pending);
+    ok = e->Expect("late poll", SHED_UPS) && ok;
+    e->Drain(pending);
+    ok = e->Expect("drained", SHED_NONE) && ok;
+
+    e->PollLate(&pending);
+    ok = e->Expect("late poll again", SHED_UPS) && ok;
+    usleep(kLatenessLifetimeNs / 1000);
+    ok = e->Expect("measurement aged", SHED_NONE) && ok;
+    e->Drain(pending);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
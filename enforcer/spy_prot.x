@@ -18,12 +18,16 @@ struct client_addr_t {
     uint32_t    client_tag;
 };
 
-/* Arguments to the register RPC */
+/* Arguments to the register RPC. deadline_ms asks the spy to notice a
+   failure of the target within that many milliseconds (0: the spy's
+   default). A target is probed for the tightest deadline any of its
+   clients asked for. */
 struct spy_register_arg {
     target_t        target;
     bool            lethal;
     int32_t         up_interval_ms;
     client_addr_t   client;
+    uint32_t        deadline_ms;
 };
 
 struct spy_cancel_arg {
@@ -39,9 +43,94 @@ struct spy_get_gen_arg {
     target_t    target;
 };
 
+/* Answers to SPY_REGISTER and SPY_GET_GEN carry the detection deadline
+   (ms) the spy meets for the target now, which may be looser than asked
+   for; 0 if the spy cannot tell. */
 struct spy_res {
     target_t    target;
     status_t    status;
+    uint32_t    deadline_ms;
+};
+
+/* One target of a batch registration. A generation vector that stops
+   short of the target's own generation registers for the target's current
+   incarnation, as SPY_GET_GEN followed by SPY_REGISTER would. Its
+   generation comes back in the entry's result. The single SPY_REGISTER
+   accepts such vectors too. */
+struct spy_register_entry {
+    target_t        target;
+    bool            lethal;
+    int32_t         up_interval_ms;
+    uint32_t        deadline_ms;
+};
+
+/* Batches are not steered to a shard like the other calls. A sharded
+   enforcer answers FALCON_WRONG_SHARD for entries another shard owns; the
+   client resends those one by one. */
+struct spy_register_batch_arg {
+    client_addr_t       client;
+    spy_register_entry  entries<>;
+};
+
+struct spy_cancel_batch_arg {
+    client_addr_t   client;
+    target_t        targets<>;
+};
+
+/* results[i] answers entry i of the batch */
+struct spy_batch_res {
+    spy_res         results<>;
+};
+
+/* Latency histogram with power-of-two buckets: bucket 0 counts samples
+   under 1 us, bucket i samples in [2^(i-1), 2^i) us, the last bucket the
+   rest. */
+const SPY_HIST_BUCKETS = 24;
+
+struct spy_histogram {
+    unsigned hyper  count;
+    unsigned hyper  total_us;
+    unsigned hyper  max_us;
+    uint32_t        buckets[SPY_HIST_BUCKETS];
+};
+
+/* Counters since the enforcer started. Rates are left to the caller, who
+   can diff two replies against uptime_ms. */
+struct spy_target_stats {
+    string          handle<>;
+    spy_histogram   probe_rtt;          /* probe to answer */
+    spy_histogram   probe_late;         /* probe due to probe sent */
+    spy_histogram   timeout_to_down;    /* probe failure to down */
+    spy_histogram   down_delivery;      /* down to client ack */
+    uint32_t        registers;
+    uint32_t        cancels;
+    uint32_t        ups;
+    uint32_t        downs;
+    uint32_t        down_retries;
+    uint32_t        down_failures;      /* not acked by the deadline */
+    uint32_t        probe_failures;
+};
+
+/* handle: a target to report on as well, or "" for the aggregate only */
+struct spy_stats_arg {
+    string          handle<>;
+};
+
+/* With several shards each shard reports on its own targets. A request
+   goes to the shard owning handle ("" goes to shard 0). The shed_ counters
+   count requests and ups dropped by admission control. */
+struct spy_stats_res {
+    unsigned hyper      uptime_ms;
+    uint32_t            shard;
+    uint32_t            shards;
+    uint32_t            targets;
+    uint32_t            clients;
+    uint32_t            heartbeat_failures;
+    uint32_t            shed_queries;
+    uint32_t            shed_registers;
+    uint32_t            shed_ups;
+    spy_target_stats    total;
+    spy_target_stats    target<1>;
 };
 
 program SPY_PROG {
@@ -60,5 +149,14 @@ program SPY_PROG {
 
         spy_res
         SPY_GET_GEN(spy_get_gen_arg) = 4;
+
+        spy_stats_res
+        SPY_STATS(spy_stats_arg) = 5;
+
+        spy_batch_res
+        SPY_REGISTER_BATCH(spy_register_batch_arg) = 6;
+
+        spy_batch_res
+        SPY_CANCEL_BATCH(spy_cancel_batch_arg) = 7;
     } = 1;
 } = 2000111;
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+#ifndef _NTFA_ENFORCER_STATS_H_
+#define _NTFA_ENFORCER_STATS_H_
+
+#include <stdint.h>
+#include <string.h>
+
+// Must match SPY_HIST_BUCKETS in spy_prot.x
+const int kHistogramBuckets = 24;
+
+// Latency histogram with fixed power-of-two buckets. Bucket 0 counts samples
+// under 1 us, bucket i (0 < i < kHistogramBuckets - 1) samples in
+// [2^(i-1), 2^i) us and the last bucket everything slower (about 4 s and
+// up). Recording is a handful of arithmetic instructions and never
+// allocates.
+struct latency_histogram {
+    latency_histogram() { memset(this, 0, sizeof(*this)); }
+
+    void Record(uint64_t ns) {
+        uint64_t us = ns / 1000;
+        int bucket = (us == 0) ? 0 : 64 - __builtin_clzll(us);
+        if (bucket >= kHistogramBuckets) bucket = kHistogramBuckets - 1;
+        buckets[bucket]++;
+        count++;
+        total_us += us;
+        if (us > max_us) max_us = us;
+    }
+
+    uint64_t    count;
+    uint64_t    total_us;
+    uint64_t    max_us;
+    uint32_t    buckets[kHistogramBuckets];
+};
+
+// What the enforcer measures, kept per target and in aggregate
+// probe_rtt - layer probe sent to answer received
+// probe_late - probe due to probe sent
+// timeout_to_down - probe failure (or timeout) to ObserveDown
+// down_delivery - ObserveDown to the client acknowledging the down message
+//
+struct target_stats {
+    target_stats() : registers(0), cancels(0), ups(0), downs(0),
+                     down_retries(0), down_failures(0), probe_failures(0) {}
+
+    latency_histogram   probe_rtt;
+    latency_histogram   probe_late;
+    latency_histogram   timeout_to_down;
+    latency_histogram   down_delivery;
+    uint32_t            registers;
+    uint32_t            cancels;
+    uint32_t            ups;
+    uint32_t            downs;
+    uint32_t            down_retries;
+    // Down messages not acked by the delivery deadline
+    uint32_t            down_failures;
+    uint32_t            probe_failures;
+};
+#endif  // _NTFA_ENFORCER_STATS_H_
@@ -30,6 +30,8 @@ enum spy_status {
     FALCON_GEN_RESP = 9,
     FALCON_UP = 10,
     FALCON_DOWN = 11,
-    FALCON_UNKNOWN_ERROR = 12
+    FALCON_UNKNOWN_ERROR = 12,
+    FALCON_WRONG_SHARD = 13,
+    FALCON_WRONG_GEN = 14
 };
 #endif  // _NTFA_ENFORCER_STATUS_H_
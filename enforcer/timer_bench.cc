@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+// Compares libasync delaycb with the TimerWheel for the pattern the spies
+// use: every target has a periodic timer (100 ms, with phases spread over
+// the period) that is re-armed each time it fires. For each timer count the
+// benchmark reports the cost of arming and cancelling every timer once, then
+// runs the event loop and reports CPU time per fire and how late timers
+// fired. Each run happens in its own process since amain() never returns.
+//
+// usage: timer_bench [seconds per run]
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <async.h>
+
+#include "common.h"
+#include "timer_wheel.h"
+
+namespace {
+
+const size_t kCounts[] = {1000, 10000, 100000};
+const uint32_t kPeriodNs = 100 * 1000 * 1000;
+
+// Shared by both modes. Each child process runs one mode.
+const char*             mode;
+size_t                  count;
+uint64_t                fires;
+uint64_t                late_total_ns;
+uint64_t                start_ns;
+double                  arm_ns;
+double                  cancel_ns;
+struct rusage           start_usage;
+std::vector<uint64_t>   due;
+
+std::vector<timecb_t*>      delay_cbs;
+ptr<TimerWheel>             wheel;
+std::vector<wheel_timer*>   wheel_timers;
+
+uint32_t
+Phase(size_t i) {
+    return (i * 1000003ULL) % kPeriodNs;
+}
+
+double
+CPUSeconds(const struct rusage& ru) {
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           1e-6 * (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+void
+Fired(size_t i) {
+    uint64_t now = TimerWheel::Now();
+    if (now > due[i]) late_total_ns += now - due[i];
+    due[i] = now + kPeriodNs;
+    fires++;
+}
+
+void
+FireDelaycb(size_t i) {
+    Fired(i);
+    delay_cbs[i] = delaycb(0, kPeriodNs, wrap(FireDelaycb, i));
+}
+
+void
+FireWheel(size_t i) {
+    Fired(i);
+    wheel->Arm(wheel_timers[i], 0, kPeriodNs);
+}
+
+void
+ArmAll() {
+    uint64_t now = TimerWheel::Now();
+    for (size_t i = 0; i < count; ++i) {
+        due[i] = now + Phase(i);
+        if (wheel) {
+            wheel->Arm(wheel_timers[i], 0, Phase(i));
+        } else {
+            delay_cbs[i] = delaycb(0, Phase(i), wrap(FireDelaycb, i));
+        }
+    }
+}
+
+void
+CancelAll() {
+    for (size_t i = 0; i < count; ++i) {
+        if (wheel) {
+            wheel->Cancel(wheel_timers[i]);
+        } else {
+            timecb_remove(delay_cbs[i]);
+            delay_cbs[i] = NULL;
+        }
+    }
+}
+
+void
+Finish() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double elapsed = (TimerWheel::Now() - start_ns) * 1e-9;
+    double cpu = CPUSeconds(usage) - CPUSeconds(start_usage);
+    printf("mode=%s timers=%zu arm_ns=%.1f cancel_ns=%.1f fires=%llu "
+           "fires_per_s=%.1f cpu_ns_per_fire=%.1f late_mean_us=%.1f\n",
+           mode, count, arm_ns, cancel_ns,
+           static_cast<unsigned long long>(fires), fires / elapsed,
+           fires ? 1e9 * cpu / fires : 0.0,
+           fires ? 1e-3 * late_total_ns / fires : 0.0);
+    fflush(stdout);
+    exit(EXIT_SUCCESS);
+}
+
+void
+Run(const char* m, size_t n, int seconds) {
+    async_init();
+    mode = m;
+    count = n;
+    due.resize(n);
+    if (strcmp(mode, "wheel") == 0) {
+        wheel = New refcounted<TimerWheel>();
+        wheel_timers.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            wheel_timers[i] = wheel->NewTimer(wrap(FireWheel, i));
+        }
+    } else {
+        delay_cbs.resize(n);
+    }
+
+    uint64_t t0 = TimerWheel::Now();
+    ArmAll();
+    uint64_t t1 = TimerWheel::Now();
+    CancelAll();
+    uint64_t t2 = TimerWheel::Now();
+    arm_ns = static_cast<double>(t1 - t0) / n;
+    cancel_ns = static_cast<double>(t2 - t1) / n;
+
+    ArmAll();
+    start_ns = TimerWheel::Now();
+    getrusage(RUSAGE_SELF, &start_usage);
+    delaycb(seconds, 0, wrap(Finish));
+    amain();
+}
+
+}  // end anonymous namespace
+
+int
+main(int argc, char** argv) {
+    int seconds = (argc > 1) ? atoi(argv[1]) : 5;
+    const char* modes[] = {"delaycb", "wheel"};
+    for (size_t c = 0; c < sizeof(kCounts) / sizeof(kCounts[0]); ++c) {
+        for (size_t m = 0; m < 2; ++m) {
+            pid_t pid = fork();
+            CHECK(pid >= 0);
+            if (pid == 0) {
+                Run(modes[m], kCounts[c], seconds);
+            }
+            int status;
+            CHECK(pid == waitpid(pid, &status, 0));
+            CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+#include "timer_wheel.h"
+
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "common.h"
+
+namespace {
+const uint64_t kNanosecondsPerSecond = 1000ULL * 1000 * 1000;
+// Timers further out than this are clamped to it
+const uint64_t kMaxTicks = (1ULL << 32) - 1;
+}  // end anonymous namespace
+
+TimerWheel::TimerWheel(uint32_t resolution_ns, bool event_loop) :
+        resolution_(resolution_ns), event_loop_(event_loop),
+        current_(Now() / resolution_ns), armed_(0), free_(NULL),
+        running_(false), scheduled_(false), wake_cb_(NULL), wake_tick_(0),
+        late_ns_(0), late_at_(0), wake_(wrap(this, &TimerWheel::Wake)) {
+    CHECK(resolution_ns > 0);
+    memset(slots_, 0, sizeof(slots_));
+}
+
+TimerWheel::~TimerWheel() {
+    if (wake_cb_) timecb_remove(wake_cb_);
+    for (size_t i = 0; i < chunks_.size(); ++i) {
+        delete[] chunks_[i];
+    }
+}
+
+uint64_t
+TimerWheel::Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * kNanosecondsPerSecond + ts.tv_nsec;
+}
+
+wheel_timer*
+TimerWheel::NewTimer(cbv action) {
+    if (free_ == NULL) {
+        wheel_timer* chunk = new wheel_timer[kPoolChunk];
+        chunks_.push_back(chunk);
+        for (int i = 0; i < kPoolChunk; ++i) {
+            chunk[i].next = free_;
+            chunk[i].pprev = NULL;
+            free_ = &chunk[i];
+        }
+    }
+    wheel_timer* t = free_;
+    free_ = t->next;
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->action = action;
+    return t;
+}
+
+void
+TimerWheel::FreeTimer(wheel_timer* t) {
+    Cancel(t);
+    t->action = NULL;
+    t->next = free_;
+    free_ = t;
+}
+
+void
+TimerWheel::Arm(wheel_timer* t, uint32_t s, uint32_t ns) {
+    uint64_t now = Now() / resolution_;
+    uint64_t delay = s * kNanosecondsPerSecond + ns;
+    Cancel(t);
+    if (armed_ == 0 && now > current_) {
+        // Nothing to catch up on
+        current_ = now;
+    }
+    t->expires = std::max(now, current_) +
+                 (delay + resolution_ - 1) / resolution_;
+    Insert(t);
+    armed_++;
+    if (!running_ && (!scheduled_ || t->expires < wake_tick_)) {
+        Schedule();
+    }
+}
+
+void
+TimerWheel::Cancel(wheel_timer* t) {
+    if (!Armed(t)) return;
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+    armed_--;
+}
+
+void
+TimerWheel::Insert(wheel_timer* t) {
+    if (t->expires < current_) {
+        t->expires = current_;
+    }
+    uint64_t delta = t->expires - current_;
+    if (delta > kMaxTicks) {
+        delta = kMaxTicks;
+        t->expires = current_ + delta;
+    }
+    int level = 0;
+    while (level < kLevels - 1 &&
+           delta >= (1ULL << ((level + 1) * kSlotBits))) {
+        level++;
+    }
+    uint32_t idx = (t->expires >> (level * kSlotBits)) & kSlotMask;
+    wheel_timer** head = &slots_[level][idx];
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+}
+
+void
+TimerWheel::Cascade(int level, uint32_t idx) {
+    wheel_timer* t = slots_[level][idx];
+    slots_[level][idx] = NULL;
+    while (t) {
+        wheel_timer* next = t->next;
+        Insert(t);
+        t = next;
+    }
+}
+
+void
+TimerWheel::Advance(uint64_t now_ns) {
+    uint64_t target = now_ns / resolution_;
+    running_ = true;
+    while (current_ <= target) {
+        if (armed_ == 0) {
+            current_ = target;
+            break;
+        }
+        uint32_t idx = current_ & kSlotMask;
+        if (idx == 0) {
+            // Level 0 wrapped: pull the next stretch of timers down
+            for (int level = 1; level < kLevels; ++level) {
+                uint32_t li = (current_ >> (level * kSlotBits)) & kSlotMask;
+                Cascade(level, li);
+                if (li != 0) break;
+            }
+        }
+        // Detach the slot so that timers armed by the actions below land
+        // in a later tick. Cancel() still works on the detached list.
+        wheel_timer* due = slots_[0][idx];
+        slots_[0][idx] = NULL;
+        if (due) due->pprev = &due;
+        current_++;
+        while (due) {
+            wheel_timer* t = due;
+            due = t->next;
+            if (due) due->pprev = &due;
+            t->next = NULL;
+            t->pprev = NULL;
+            armed_--;
+            // The action may free its own timer
+            callback<void>::ptr action = t->action;
+            (*action)();
+        }
+    }
+    running_ = false;
+}
+
+void
+TimerWheel::Schedule() {
+    if (wake_cb_) {
+        timecb_remove(wake_cb_);
+        wake_cb_ = NULL;
+    }
+    scheduled_ = false;
+    if (armed_ == 0) return;
+    // The first busy slot before level 0 wraps, or the wrap itself, where
+    // the next cascade happens
+    uint64_t boundary = (current_ | kSlotMask) + 1;
+    uint64_t tick = current_;
+    while (tick < boundary && slots_[0][tick & kSlotMask] == NULL) {
+        tick++;
+    }
+    wake_tick_ = tick;
+    scheduled_ = true;
+    if (!event_loop_) return;
+    uint64_t now = Now();
+    uint64_t at = tick * resolution_;
+    uint64_t delay = (at > now) ? at - now : 0;
+    wake_cb_ = delaycb(delay / kNanosecondsPerSecond,
+                       delay % kNanosecondsPerSecond, wake_);
+}
+
+void
+TimerWheel::Wake() {
+    wake_cb_ = NULL;
+    Poll(Now());
+}
+
+void
+TimerWheel::Poll(uint64_t now_ns) {
+    uint64_t due = Deadline();
+    late_ns_ = (due && now_ns > due) ? now_ns - due : 0;
+    late_at_ = now_ns;
+    Advance(now_ns);
+    Schedule();
+}
+
+uint64_t
+TimerWheel::Lateness() const {
+    if (armed_ == 0 || late_ns_ == 0) return 0;
+    return (Now() < late_at_ + kLatenessLifetimeNs) ? late_ns_ : 0;
+}
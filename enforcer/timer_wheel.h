@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+#ifndef _NTFA_ENFORCER_TIMER_WHEEL_H_
+#define _NTFA_ENFORCER_TIMER_WHEEL_H_
+
+#include <async.h>
+#include <stdint.h>
+
+#include <vector>
+
+const uint32_t kTimerResolutionNs = 1000 * 1000;  // 1 ms
+const uint64_t kLatenessLifetimeNs = 1000 * 1000 * 1000;  // 1 s
+
+// A timer owned by a TimerWheel. Timers are allocated once per target (or
+// client) and re-armed for every event, so arming never allocates.
+struct wheel_timer {
+    wheel_timer*            next;
+    // Points at whatever points at us; NULL when the timer is not armed
+    wheel_timer**           pprev;
+    uint64_t                expires;
+    callback<void>::ptr     action;
+};
+
+// Hierarchical timing wheel shared by all timers of an enforcer.
+//
+// Four levels of 256 slots each cover 2^32 ticks of the wheel's resolution.
+// A timer sits in the slot of the coarsest level that matches its distance
+// from now and moves down a level each time the level below wraps around, so
+// arming and cancelling are O(1) and every timer is touched at most four
+// times before it fires. Timers fire on the tick at or after their expiry.
+//
+// The wheel keeps a single libasync timer for the next tick that needs
+// attention, instead of one per armed timer. A wheel made without an event
+// loop arms no libasync timer at all: whoever owns it (e.g. a thread with a
+// poll loop of its own) waits until Deadline() and calls Poll().
+class TimerWheel : public virtual refcount {
+    public:
+        explicit TimerWheel(uint32_t resolution_ns = kTimerResolutionNs,
+                            bool event_loop = true);
+        ~TimerWheel();
+
+        // Returns a disarmed timer that runs action each time it fires
+        wheel_timer* NewTimer(cbv action);
+
+        // Disarms t, drops its action and returns it to the pool
+        void FreeTimer(wheel_timer* t);
+
+        // Fires t once after s seconds and ns nanoseconds. Arming an armed
+        // timer moves it.
+        void Arm(wheel_timer* t, uint32_t s, uint32_t ns);
+
+        // Disarms t. It is fine to cancel a timer that is not armed.
+        void Cancel(wheel_timer* t);
+
+        static bool Armed(const wheel_timer* t) { return t->pprev != NULL; }
+
+        // Number of armed timers
+        size_t Pending() const { return armed_; }
+
+        // How late the event loop last got around to a due tick, in
+        // nanoseconds. Grows when other work holds up the loop. A
+        // measurement stops counting after kLatenessLifetimeNs, and at
+        // once when no timer is left armed: there is nothing to be late for.
+        uint64_t Lateness() const;
+
+        // Runs every timer that is due at now_ns (CLOCK_MONOTONIC). Called
+        // from the event loop, but usable without one.
+        void Advance(uint64_t now_ns);
+
+        // When the next tick that needs attention is due (CLOCK_MONOTONIC
+        // ns), or 0 if no timer is armed
+        uint64_t Deadline() const {
+            return scheduled_ ? wake_tick_ * resolution_ : 0;
+        }
+
+        // Advances to now_ns and works out the next deadline. This is what
+        // the libasync timer does; wheels without an event loop call it
+        // themselves.
+        void Poll(uint64_t now_ns);
+
+        // Current CLOCK_MONOTONIC time in nanoseconds
+        static uint64_t Now();
+
+    private:
+        enum {
+            kLevels = 4,
+            kSlotBits = 8,
+            kSlots = 1 << kSlotBits,
+            kSlotMask = kSlots - 1,
+            kPoolChunk = 256
+        };
+
+        // Puts t into the slot matching t->expires
+        void Insert(wheel_timer* t);
+
+        // Moves every timer of slot idx at level down to finer levels
+        void Cascade(int level, uint32_t idx);
+
+        // Finds the next tick that needs attention and arms the libasync
+        // timer for it
+        void Schedule();
+
+        // libasync timer callback
+        void Wake();
+
+        const uint64_t              resolution_;
+        const bool                  event_loop_;
+
+        // Next tick to process
+        uint64_t                    current_;
+        size_t                      armed_;
+        wheel_timer*                slots_[kLevels][kSlots];
+
+        // Pooled timer nodes
+        wheel_timer*                free_;
+        std::vector<wheel_timer*>   chunks_;
+
+        // Event loop glue
+        bool                        running_;
+        bool                        scheduled_;
+        timecb_t*                   wake_cb_;
+        uint64_t                    wake_tick_;
+        uint64_t                    late_ns_;
+        // When late_ns_ was measured
+        uint64_t                    late_at_;
+        const cbv                   wake_;
+};
+#endif  // _NTFA_ENFORCER_TIMER_WHEEL_H_
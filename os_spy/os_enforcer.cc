@@ -31,6 +31,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <algorithm>
 #include <string>
 
 static const uint32_t kHostnameLength = 64;
@@ -112,8 +113,18 @@ class OSEnforcer : public virtual Enforcer {
         int devnull = open("/dev/null", O_RDONLY);
         CHECK(devnull >= 0);
 
-        const char* av[] = {worker_path_.cstr(), handle->cstr(), 0};
-        const char* lethal_av[] = {worker_path_.cstr(), handle->cstr(), "lethal", 0};
+        uint32_t period_ms = kDefaultProbePeriod_ms;
+        std::map<str, uint32_t>::iterator period = periods_.find(*handle);
+        if (period != periods_.end()) {
+            period_ms = period->second;
+        }
+        running_periods_[*handle] = period_ms;
+        char period_arg[16];
+        snprintf(period_arg, sizeof(period_arg), "%u", period_ms);
+        const char* av[] = {worker_path_.cstr(), handle->cstr(), period_arg,
+                            0};
+        const char* lethal_av[] = {worker_path_.cstr(), handle->cstr(), "lethal",
+                                   period_arg, 0};
 
         make_async(pipefds[0]);
         close_on_exec(pipefds[0]);
@@ -180,6 +191,23 @@ class OSEnforcer : public virtual Enforcer {
         return;
     }
 
+    // A worker probes at the period it was spawned with, so a new deadline
+    // only takes effect once monitoring restarts. The answer is what the
+    // running worker achieves.
+    virtual uint32_t SetDeadline(const ref<const str> handle,
+                                 uint32_t deadline_ms) {
+        if (deadline_ms == 0) {
+            periods_.erase(*handle);
+        } else {
+            periods_[*handle] = std::max(deadline_ms, kMinProbePeriod_ms);
+        }
+        if (active_domains_[*handle]) {
+            return running_periods_[*handle];
+        }
+        return (deadline_ms == 0) ? kDefaultProbePeriod_ms :
+                                    periods_[*handle];
+    }
+
   private:
     void HandleWorker(const ref<const str> handle, int fd) {
         // If we aren't monitoring it, we don't care. Close the
@@ -192,7 +220,10 @@ class OSEnforcer : public virtual Enforcer {
         worker_state state;
         size_t rsize = read(fd, &state, sizeof(state));
         CHECK(rsize == sizeof(state));
-        if (state != VM_OK) LOG("Vm not OK: %s %d", handle->cstr(), state);
+        if (state != VM_OK) {
+            LOG("Vm not OK: %s %d", handle->cstr(), state);
+            ProbeFailed(handle);
+        }
         switch (state) {
             case VM_OK: {
                 ObserveUp(handle);
@@ -220,6 +251,9 @@ class OSEnforcer : public virtual Enforcer {
     }
 
     std::map<str, virDomainPtr> active_domains_;
+    // Requested and current worker probe periods (ms)
+    std::map<str, uint32_t> periods_;
+    std::map<str, uint32_t> running_periods_;
     virConnectPtr vmm_connection_;
     std::string _worker_path_;
     str worker_path_;
@@ -21,8 +21,6 @@
 
 #include "common.h"
 
-// How to config file this? Maybe pass it in from parent?
-static const uint32_t kMemoryPollPeriod_ms = 100;
 char* name;
 
 inline static void
@@ -60,15 +58,24 @@ main(int argc, char** argv) {
     signal(SIGUSR1, shutdown_notification_callback);
     virConnectPtr conn = virConnectOpen(kHypervisorPath);
     CHECK(conn);
+    // os_worker <domain> [lethal] [probe period ms]
     name = argv[1];
-    bool lethal = (argc == 3);
+    bool lethal = false;
+    uint32_t period_ms = kDefaultProbePeriod_ms;
+    for (int i = 2; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "lethal")) {
+            lethal = true;
+        } else if (atoi(argv[i]) > 0) {
+            period_ms = atoi(argv[i]);
+        }
+    }
     dom = virDomainLookupByName(conn, name);
     if (!dom) {
         put_status(VM_ERROR);
         return EXIT_FAILURE;
     }
     for (;;) {
-        int ret = virDomainDoNtfaProbe(dom, kMemoryPollPeriod_ms);
+        int ret = virDomainDoNtfaProbe(dom, period_ms);
         switch (ret) {
             case NTFA_ALIVE:
                 put_status(VM_OK);
@@ -16,6 +16,9 @@
  */
 #ifndef _NTFA_OS_ENFORCER_OS_WORKER_H_
 #define _NTFA_OS_ENFORCER_OS_WORKER_H_
+
+#include <stdint.h>
+
 enum worker_state {
     VM_OK,
     VM_ERROR,
@@ -25,4 +28,9 @@ enum worker_state {
 };
 
 const char* kHypervisorPath = "qemu:///system";
+
+// How often a worker probes its domain, unless the enforcer passes a period
+// (for a client's detection deadline) on the command line
+const uint32_t kDefaultProbePeriod_ms = 100;
+const uint32_t kMinProbePeriod_ms = 10;
 #endif  // _NTFA_OS_ENFORCER_OS_WORKER_H_
@@ -25,7 +25,9 @@ typedef enum delay_type {
 typedef enum enforcer_state {
     SOCKET_ERROR,
     ENF_TIMEDOUT,
-    ENF_CPU_TIMEOUT
+    ENF_CPU_TIMEOUT,
+    ENF_EXITED,
+    ENF_FENCED
 } enforcer_state;
 
 const size_t kHandleSize = 32;
@@ -49,4 +51,51 @@ struct process_observer_reply {
 #define PROC_OBS_ALIVE 0
 #define PROC_OBS_DEAD 1
 
+// In heartbeat mode the observer also publishes Spy()'s answer to a shared
+// memory page named falcon_process_heartbeat_prefix<pid>, so that the spy
+// can check on it without a round trip over the socket. The observer is the
+// only writer. Readers retry while seq is odd or changes under them.
+#define falcon_process_heartbeat_prefix "/falcon-hb."
+const uint32_t kHeartbeatMagic = 0x46484231;  // "FHB1"
+
+struct process_observer_heartbeat {
+    uint32_t            magic;
+    uint32_t            pid;
+    volatile uint32_t   seq;
+    volatile uint32_t   state;
+    // Bumped on every publication
+    volatile uint64_t   progress;
+    // CLOCK_MONOTONIC when state was published
+    volatile uint64_t   stamp_ns;
+} __attribute__((__aligned__(64)));
+
+inline void
+PublishHeartbeat(process_observer_heartbeat* hb, uint32_t state,
+                 uint64_t stamp_ns) {
+    hb->seq++;
+    __sync_synchronize();
+    hb->state = state;
+    hb->progress++;
+    hb->stamp_ns = stamp_ns;
+    __sync_synchronize();
+    hb->seq++;
+}
+
+// Returns false if no consistent copy could be read in a few tries
+inline bool
+ReadHeartbeat(const process_observer_heartbeat* hb, uint32_t* state,
+              uint64_t* progress, uint64_t* stamp_ns) {
+    for (int i = 0; i < 4; ++i) {
+        uint32_t seq = hb->seq;
+        if (seq & 1) continue;
+        __sync_synchronize();
+        *state = hb->state;
+        *progress = hb->progress;
+        *stamp_ns = hb->stamp_ns;
+        __sync_synchronize();
+        if (hb->seq == seq) return true;
+    }
+    return false;
+}
+
 #endif  // _NTFA_PROCESS_ENFORCER_OBS_PROT_H_
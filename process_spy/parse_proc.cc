@@ -18,11 +18,13 @@
 
 #include <assert.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <list>
 #include <map>
@@ -34,6 +36,8 @@ const int kNumProcStatFields = 44;
 // Format of /proc/pid/stat
 const char *kStatLineFmt = "%d %s %c %d %d %d %d %d %u %lu %lu %lu %lu %lu %lu %ld %ld %ld %ld %ld %ld %llu %lu %ld %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %d %d %u %u %llu %lu %ld\n";
 
+}  // end anonymous namespace
+
 // Processes stat_line from /proc/pid/stat
 // Fills info with the contents.
 void
@@ -56,7 +60,6 @@ ParseStat(const char *stat_line, proc_info_p info) {
     assert(scanned == kNumProcStatFields);
     return;
 }
-}  // end anonymous namespace
 
 proc_info_p
 GetProcByPid(int pid) {
@@ -75,3 +78,90 @@ GetProcByPid(int pid) {
     assert(!ret);
     return stat;
 }
+
+char
+GetProcState(pid_t pid) {
+    char path_buffer[kBufferSize];
+    char line_buffer[kMaxLineSize];
+    snprintf(path_buffer, kBufferSize, "/proc/%d/stat", pid);
+    int fd = open(path_buffer, O_RDONLY);
+    if (fd < 0) {
+        errno = 0;  // Acknowledged the file not found error.
+        return 0;
+    }
+    ssize_t len = read(fd, line_buffer, sizeof(line_buffer));
+    close(fd);
+    if (len <= 0) {
+        errno = 0;  // ESRCH: the process is gone
+        return 0;
+    }
+    // The state follows the command name, which ends at the last ')'
+    const char *p = static_cast<const char *>(memrchr(line_buffer, ')', len));
+    if (p == NULL || p + 2 >= line_buffer + len) return 0;
+    return p[2];
+}
+
+bool
+ScanStatFields(const char *line, size_t len, const int *fields, size_t n,
+               unsigned long long *values) {
+    // The command name (field 2) is in parentheses but may contain anything,
+    // ") " included, so the other fields start after the last ')'
+    const char *end = line + len;
+    const char *p = static_cast<const char *>(memrchr(line, ')', len));
+    if (p == NULL) return false;
+    ++p;
+    int field = 2;
+    size_t next = 0;
+    while (next < n) {
+        while (p < end && (*p == ' ' || *p == '\n')) ++p;
+        if (p == end) return false;
+        if (++field == fields[next]) {
+            bool negative = (*p == '-');
+            if (negative) ++p;
+            unsigned long long v = 0;
+            while (p < end && *p >= '0' && *p <= '9') {
+                v = v * 10 + (*p++ - '0');
+            }
+            values[next++] = negative ? -v : v;
+        }
+        while (p < end && *p != ' ' && *p != '\n') ++p;
+    }
+    return true;
+}
+
+ProcStatReader::ProcStatReader(pid_t pid) {
+    char path_buffer[kBufferSize];
+    snprintf(path_buffer, kBufferSize, "/proc/%d/stat", pid);
+    fd_ = open(path_buffer, O_RDONLY);
+    if (fd_ < 0) {
+        errno = 0;  // Acknowledged the file not found error.
+    } else {
+        fcntl(fd_, F_SETFD, FD_CLOEXEC);
+    }
+}
+
+ProcStatReader::~ProcStatReader() {
+    if (fd_ >= 0) close(fd_);
+}
+
+bool
+ProcStatReader::ReadFields(const int *fields, size_t n,
+                           unsigned long long *values) {
+    if (fd_ < 0) return false;
+    char line_buffer[kMaxLineSize];
+    ssize_t len = pread(fd_, line_buffer, sizeof(line_buffer), 0);
+    if (len <= 0) {
+        errno = 0;  // ESRCH: the process is gone
+        return false;
+    }
+    return ScanStatFields(line_buffer, len, fields, n, values);
+}
+
+bool
+ProcStatReader::ReadCPUTime(unsigned long long *ticks) {
+    static const int kFields[] = {kStatUtime, kStatStime};
+    unsigned long long values[2];
+    if (!ReadFields(kFields, 2, values)) return false;
+    *ticks = values[0] + values[1];
+    return true;
+}
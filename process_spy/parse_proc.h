@@ -72,4 +72,49 @@ typedef struct proc_info {
 }*proc_info_p, proc_info_s;
 
 proc_info_p GetProcByPid(int pid);
+
+// Fills info from a line of /proc/pid/stat. Exposed for benchmarks.
+void ParseStat(const char *stat_line, proc_info_p info);
+
+// The state letter of /proc/pid/stat (field 3, e.g. 'R' or 'Z'), or 0 if
+// the process is gone
+char GetProcState(pid_t pid);
+
+// Field numbers of /proc/pid/stat, as in proc(5)
+const int kStatUtime = 14;
+const int kStatStime = 15;
+
+// Scans the numeric fields numbered fields[0..n) (increasing, past the
+// command name) out of the len bytes of a /proc/pid/stat line, into values.
+// The command name may contain spaces and parentheses. Returns false if the
+// line ends first.
+bool ScanStatFields(const char *line, size_t len, const int *fields,
+                    size_t n, unsigned long long *values);
+
+// Reads one process's /proc/pid/stat again and again without allocating:
+// the file stays open, and each read is a pread into a stack buffer that is
+// scanned for just the fields asked for. The open file keeps referring to
+// the same process, so a reused pid never answers for it.
+class ProcStatReader {
+    public:
+        explicit ProcStatReader(pid_t pid);
+        ~ProcStatReader();
+
+        // Whether the file could be opened
+        bool Valid() const { return fd_ >= 0; }
+
+        // See ScanStatFields. Returns false once the process is gone.
+        bool ReadFields(const int *fields, size_t n,
+                        unsigned long long *values);
+
+        // User plus system time, in clock ticks
+        bool ReadCPUTime(unsigned long long *ticks);
+
+    private:
+        int fd_;
+
+        // Not copyable: we own fd_
+        ProcStatReader(const ProcStatReader&);
+        ProcStatReader& operator=(const ProcStatReader&);
+};
 #endif  // _NTFA_PROCESS_ENFORCER_PARSE_PROC_
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+// Compares the scheduling cost of the process spy's data plane before and
+// after the ProbeSlots rewrite. "wheel" gives every process a timer of its
+// own on a TimerWheel, as the data plane used to. "slots" keeps deadlines in
+// a ProbeSlots array swept by a single tick. Each process is probed every
+// 100 ms (phases spread over the period); a probe arms the response
+// deadline, and the answer, which comes back at once, arms the next probe.
+// Sockets are left out, since both schemes make the same system calls.
+//
+// For each process count the benchmark reports CPU time per process per
+// second of monitoring, CPU time per probe and how late probes went out.
+//
+// usage: probe_bench [seconds per run] [tick ms]
+#include <sys/resource.h>
+#include <time.h>
+
+#include <vector>
+
+#include "common.h"
+#include "enforcer/timer_wheel.h"
+#include "process_spy/probe_slots.h"
+
+namespace {
+
+const size_t kCounts[] = {1000, 10000, 100000};
+const uint64_t kPeriodNs = 100 * 1000 * 1000;
+const uint64_t kResponseNs = 100 * 1000 * 1000;
+
+enum action {
+    PROBE,
+    RESPONSE
+};
+
+struct Sim {
+    size_t          slot;
+    wheel_timer*    timer;
+    bool            waiting;
+};
+
+uint64_t    probes;
+uint64_t    late_total_ns;
+
+uint64_t
+Phase(size_t i) {
+    return (i * 1000003ULL) % kPeriodNs;
+}
+
+double
+CPUSeconds() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           1e-6 * (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+void
+SleepUntil(uint64_t at_ns) {
+    struct timespec ts;
+    ts.tv_sec = at_ns / kSecondsToNanoseconds;
+    ts.tv_nsec = at_ns % kSecondsToNanoseconds;
+    while (0 != clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) {}
+}
+
+void
+Report(const char* mode, size_t count, int seconds, double cpu) {
+    printf("mode=%s processes=%zu probes=%llu cpu_pct=%.2f "
+           "cpu_ns_per_process_s=%.1f cpu_ns_per_probe=%.1f "
+           "late_mean_us=%.1f\n",
+           mode, count, static_cast<unsigned long long>(probes),
+           100.0 * cpu / seconds, 1e9 * cpu / seconds / count,
+           probes ? 1e9 * cpu / probes : 0.0,
+           probes ? 1e-3 * late_total_ns / probes : 0.0);
+    fflush(stdout);
+}
+
+// The old data plane: a timer per process
+
+ptr<TimerWheel>     wheel;
+std::vector<Sim>    sims;
+std::vector<uint64_t> due;
+
+void
+WheelFired(size_t i) {
+    Sim* s = &sims[i];
+    uint64_t now = TimerWheel::Now();
+    if (!s->waiting) {
+        // Send the probe
+        if (now > due[i]) late_total_ns += now - due[i];
+        probes++;
+        s->waiting = true;
+        wheel->Arm(s->timer, 0, kResponseNs);
+        // ... and take the answer
+        wheel->Cancel(s->timer);
+        s->waiting = false;
+        due[i] = now + kPeriodNs;
+        wheel->Arm(s->timer, 0, kPeriodNs);
+    }
+}
+
+void
+RunWheel(size_t count, int seconds) {
+    wheel = New refcounted<TimerWheel>(kTimerResolutionNs, false);
+    sims.assign(count, Sim());
+    due.resize(count);
+    uint64_t now = TimerWheel::Now();
+    for (size_t i = 0; i < count; ++i) {
+        sims[i].waiting = false;
+        sims[i].timer = wheel->NewTimer(wrap(WheelFired, i));
+        due[i] = now + Phase(i);
+        wheel->Arm(sims[i].timer, 0, Phase(i));
+    }
+    probes = 0;
+    late_total_ns = 0;
+    double cpu = CPUSeconds();
+    uint64_t end = now + seconds * kSecondsToNanoseconds;
+    while ((now = TimerWheel::Now()) < end) {
+        uint64_t deadline = wheel->Deadline();
+        if (deadline > now) SleepUntil(std::min(deadline, end));
+        wheel->Poll(TimerWheel::Now());
+    }
+    Report("wheel", count, seconds, CPUSeconds() - cpu);
+    for (size_t i = 0; i < count; ++i) {
+        wheel->FreeTimer(sims[i].timer);
+    }
+    wheel = NULL;
+}
+
+// The new one: a slot per process and one tick
+
+void
+RunSlots(size_t count, int seconds, uint64_t tick_ns) {
+    ProbeSlots<Sim> slots;
+    sims.assign(count, Sim());
+    uint64_t now = TimerWheel::Now();
+    for (size_t i = 0; i < count; ++i) {
+        slots.Add(&sims[i], &sims[i].slot, 0, -1);
+        slots.Arm(i, PROBE, now + Phase(i));
+    }
+    std::vector<uint32_t> ready;
+    probes = 0;
+    late_total_ns = 0;
+    double cpu = CPUSeconds();
+    uint64_t end = now + seconds * kSecondsToNanoseconds;
+    uint64_t next = now;
+    while ((now = TimerWheel::Now()) < end) {
+        if (next > now) SleepUntil(std::min(next, end));
+        now = TimerWheel::Now();
+        ready.clear();
+        next = slots.Sweep(now, &ready);
+        for (size_t k = 0; k < ready.size(); ++k) {
+            uint32_t i = ready[k];
+            if (slots.Action(i) != PROBE) continue;
+            late_total_ns += now - slots.Due(i);
+            probes++;
+            slots.Arm(i, RESPONSE, now + kResponseNs);
+            slots.Arm(i, PROBE, now + kPeriodNs);
+            next = std::min(next, now + kPeriodNs);
+        }
+        next = std::max(next, now + tick_ns);
+    }
+    Report("slots", count, seconds, CPUSeconds() - cpu);
+}
+
+}  // end anonymous namespace
+
+int
+main(int argc, char** argv) {
+    int seconds = (argc > 1) ? atoi(argv[1]) : 5;
+    uint64_t tick_ns = ((argc > 2) ? atoi(argv[2]) : 1) *
+                       kMillisecondsToNanoseconds;
+    for (size_t c = 0; c < sizeof(kCounts) / sizeof(kCounts[0]); ++c) {
+        RunWheel(kCounts[c], seconds);
+        RunSlots(kCounts[c], seconds, tick_ns);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+#ifndef _NTFA_PROCESS_SPY_PROBE_SLOTS_H_
+#define _NTFA_PROCESS_SPY_PROBE_SLOTS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <vector>
+
+#include "common.h"
+
+// The hot half of every probed process, laid out as parallel arrays so that
+// a tick can sweep all deadlines in one pass over contiguous memory. Each
+// slot has a pid, a socket, a deadline (CLOCK_MONOTONIC ns) and what to do
+// when the deadline passes. Owners keep their slot index; removing a slot
+// moves the last one into its place and tells its owner through the index
+// pointer each slot holds.
+template <class Owner>
+class ProbeSlots {
+    public:
+        // The deadline of a slot with nothing to do
+        static const uint64_t kIdle = ~0ULL;
+
+        size_t Size() const { return due_.size(); }
+
+        // Returns the new slot's index, which is also stored in *index
+        size_t Add(Owner* owner, size_t* index, pid_t pid, int fd) {
+            *index = due_.size();
+            due_.push_back(kIdle);
+            pid_.push_back(pid);
+            fd_.push_back(fd);
+            action_.push_back(0);
+            owner_.push_back(owner);
+            index_.push_back(index);
+            return *index;
+        }
+
+        void Remove(size_t i) {
+            size_t last = due_.size() - 1;
+            due_[i] = due_[last];
+            pid_[i] = pid_[last];
+            fd_[i] = fd_[last];
+            action_[i] = action_[last];
+            owner_[i] = owner_[last];
+            index_[i] = index_[last];
+            *index_[i] = i;
+            due_.pop_back();
+            pid_.pop_back();
+            fd_.pop_back();
+            action_.pop_back();
+            owner_.pop_back();
+            index_.pop_back();
+        }
+
+        void Arm(size_t i, uint8_t action, uint64_t due_ns) {
+            action_[i] = action;
+            due_[i] = due_ns;
+        }
+
+        void Disarm(size_t i) { due_[i] = kIdle; }
+
+        bool Armed(size_t i) const { return due_[i] != kIdle; }
+
+        // Appends the index of every slot due at now_ns to due, and returns
+        // the earliest deadline of the others (kIdle if there is none). The
+        // loop has no branches, so the compiler can vectorize the minimum.
+        uint64_t Sweep(uint64_t now_ns, std::vector<uint32_t>* due) const {
+            size_t n = due_.size();
+            size_t start = due->size();
+            due->resize(start + n);
+            uint32_t* out = &(*due)[0] + start;
+            const uint64_t* d = n ? &due_[0] : NULL;
+            size_t found = 0;
+            uint64_t next = kIdle;
+            for (size_t i = 0; i < n; ++i) {
+                bool ready = d[i] <= now_ns;
+                out[found] = i;
+                found += ready;
+                uint64_t later = ready ? kIdle : d[i];
+                next = (later < next) ? later : next;
+            }
+            due->resize(start + found);
+            return next;
+        }
+
+        uint64_t Due(size_t i) const { return due_[i]; }
+        uint8_t Action(size_t i) const { return action_[i]; }
+        pid_t Pid(size_t i) const { return pid_[i]; }
+        int Fd(size_t i) const { return fd_[i]; }
+        void SetFd(size_t i, int fd) { fd_[i] = fd; }
+        Owner* At(size_t i) const { return owner_[i]; }
+
+    private:
+        std::vector<uint64_t>   due_;
+        std::vector<pid_t>      pid_;
+        std::vector<int>        fd_;
+        std::vector<uint8_t>    action_;
+        std::vector<Owner*>     owner_;
+        std::vector<size_t*>    index_;
+};
+
+template <class Owner>
+const uint64_t ProbeSlots<Owner>::kIdle;
+#endif  // _NTFA_PROCESS_SPY_PROBE_SLOTS_H_
@@ -16,72 +16,241 @@
  */
 #include "process_spy/process_enforcer.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
 #include "async.h"
 
 #include "common.h"
 #include "config.h"
 #include "enforcer/enforcer.h"
+#include "enforcer/plane_queue.h"
 #include "process_spy/obs_prot.h"
 #include "process_spy/parse_proc.h"
+#include "process_spy/probe_slots.h"
 
 namespace {
+// Although the process has control over its timeout, the enforcer has control
+// over the polling frequency. Clients asking for a detection deadline can
+// make it as short as min_poll_ns for their processes.
+uint32_t confirm_wait_ns;
+uint32_t poll_freq_ns;
+uint32_t min_poll_ns;
+int32_t cpu_time_wait_multiplier;
+// Freeze a process's cgroup before killing it
+bool fence_freezer;
+// Thaw the cgroup after this long even if the process is not yet gone: a
+// parent frozen with it may be what keeps it from being reaped
+uint32_t fence_thaw_ms;
+// Deadlines closer together than this are handled in one pass
+uint32_t probe_tick_ns;
+
+// What happens when a process's deadline passes
+enum timer_action {
+    TIMER_PROBE,            // send the next probe
+    TIMER_RESPONSE,         // the probe went unanswered for too long
+    TIMER_CPU_CHECK,        // compare CPU time used against the delay
+    TIMER_HEARTBEAT         // check the heartbeat page, or else probe
+};
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+// A descriptor that becomes readable when pid exits, or -1 if the kernel
+// is too old for pidfds
+int
+PidfdOpen(pid_t pid) {
+    return syscall(__NR_pidfd_open, pid, 0);
+}
+
+struct Process;
+
+// What a descriptor the data plane waits on belongs to
+enum watch_kind {
+    WATCH_SOCKET,           // the process's socket: answers and hangups
+    WATCH_EXIT              // its pidfd: the process exited
+};
+
+struct plane_watch {
+    Process*    p;
+    watch_kind  kind;
+};
+
+// Probing runs on the data plane, everything else on the control plane (the
+// libasync loop). Fields are owned by one plane or the other, or set when
+// the process connects and never changed. The data plane keeps the socket
+// and the next deadline in the process's ProbeSlots slot.
 struct Process {
     public:
-        Process(const process_observer_handshake* h, int cfd) {
+        explicit Process(const process_observer_handshake* h) {
             handle = New refcounted<const str>(static_cast<const char*>
                                                (h->handle));
             pid = h->pid;
             delay = static_cast<delay_type>(h->delay);
             delay_ms = h->delay_ms;
-            fd = cfd;
-            cb = NULL;
+            heartbeat = NULL;
+            exit_events = false;
+            slot = 0;
+            pidfd = -1;
+            socket_watch.p = this;
+            socket_watch.kind = WATCH_SOCKET;
+            exit_watch.p = this;
+            exit_watch.kind = WATCH_EXIT;
+            stat = NULL;
+            cpu_start = 0;
+            probe_ns = 0;
+            period_ns = poll_freq_ns;
+            late_ns = 0;
+            probe_state = 0;
+            probing = false;
+            watched = false;
+            beats = 0;
+            confirm_timer = NULL;
+            killed_ns = 0;
             state = 0;
             active = false;
+            removed = false;
+            exited = false;
         }
 
+        // Fixed
         ptr<const str> handle;
         pid_t pid;
         delay_type delay;
         uint32_t delay_ms;
-        int fd;
-        timecb_t* cb;
+        // The page the process publishes its state to, if any
+        const process_observer_heartbeat* heartbeat;
+        // Whether the data plane watches a pidfd for the process
+        bool exit_events;
+
+        // Data plane
+        size_t slot;
+        int pidfd;
+        plane_watch socket_watch;
+        plane_watch exit_watch;
+        // Opened at the first CPU-time check
+        ProcStatReader* stat;
+        unsigned long long cpu_start;
+        uint64_t probe_ns;
+        uint64_t period_ns;
+        uint64_t late_ns;
+        uint32_t probe_state;
+        bool probing;
+        bool watched;
+        // Heartbeat progress last seen
+        uint64_t beats;
+
+        // Control plane
+        wheel_timer* confirm_timer;
+        // When we fenced and killed the process, until it is gone
+        uint64_t killed_ns;
+        // The cgroup we froze to fence it, if any
+        std::string frozen_cgroup;
         uint32_t state;
         bool active;
+        bool removed;
+        // The data plane saw the process exit
+        bool exited;
 };
 
-// Although the process has control over its timeout, the enforcer has control
-// over the polling frequency.
-uint32_t confirm_wait_ns;
-uint32_t poll_freq_ns;
-int32_t cpu_time_wait_multiplier;
+// Commands from the control plane to the data plane, and events back
+enum plane_op {
+    PLANE_ADD,              // set p up for probing on socket fd, and
+                            // watch pidfd (if >= 0) for its exit
+    PLANE_START,            // start probing p
+    PLANE_STOP,             // stop probing p
+    PLANE_REMOVE,           // forget p; answered by PLANE_REMOVED
+    PLANE_PERIOD,           // probe p every period_ns
+    PLANE_UP,               // p answered a probe
+    PLANE_FAILED,           // a probe of p failed with state
+    PLANE_EXITED,           // p's process exited
+    PLANE_REMOVED           // the data plane is done with p
+};
+
+struct plane_msg {
+    plane_op    op;
+    Process*    p;
+    uint32_t    state;
+    uint64_t    rtt_ns;
+    uint64_t    late_ns;
+    uint64_t    period_ns;
+    int         fd;
+    int         pidfd;
+};
+
+const size_t kPlaneQueueSize = 1 << 16;
+const int kMaxPlaneEvents = 256;
 }
 
+// With split_planes (the default) probing runs on a data-plane thread of
+// its own, pinned to one CPU at the top SCHED_FIFO priority, with its own
+// timer wheel and an epoll loop over the process sockets. The libasync loop
+// keeps client RPCs, registrations, kills and down delivery, so a burst of
+// control traffic no longer delays probes. The two planes talk through a
+// PlaneQueue each way. Without split_planes both run on the libasync loop as
+// before.
+//
+// The data plane keeps every process it probes in a flat ProbeSlots array
+// and has a single timer. Each tick sweeps all deadlines, sends the probes
+// that are due and handles expired responses in one pass, and sleeps until
+// the next deadline (at least probe_tick_ms later).
+//
+// Besides probing, the data plane waits on every process's socket, where a
+// hangup shows at once, and on a pidfd for the process, which becomes
+// readable the moment it exits. A process that exits is reported down
+// within the data plane's wakeup latency, not at its next probe; probes
+// remain to catch processes that hang.
+//
+// Killing a process fences it first: SIGKILL, after freezing the process's
+// cgroup with fence_freezer. A process with SIGKILL pending never runs
+// another instruction of its own, so clients hear that it is down (with
+// status ENF_FENCED) right away rather than once it has been reaped, which
+// for a process stuck in the kernel can take a while. Its pidfd tells us
+// when it is finally gone; without pidfds we poll every confirm_wait_ms,
+// and a zombie counts as gone. The cgroup is thawed once the process is
+// gone, or after fence_thaw_ms in any case, since it may hold the parent
+// that has to reap the process.
+//
+// Processes that publish heartbeats (see EnableHeartbeat()) are not probed
+// over their sockets while their page keeps advancing, so probing them
+// costs no system calls.
 class ProcessEnforcer : public virtual Enforcer {
   public:
+    ProcessEnforcer() : split_planes_(true), plane_cpu_(-1),
+                        commands_(NULL), events_(NULL), epoll_fd_(-1),
+                        tick_timer_(NULL),
+                        next_tick_ns_(ProbeSlots<Process>::kIdle),
+                        ticking_(false) {}
     virtual ~ProcessEnforcer() {}
 
     virtual void Init() {
-        // Set up the UNIX socket
-        int unix_socket = socket(AF_UNIX, SOCK_STREAM, 0);
-        CHECK(unix_socket > 0);
-        int tmp = 1;
-        CHECK(0 == setsockopt(unix_socket, SOL_SOCKET, SO_REUSEADDR, &tmp,
-                              sizeof(tmp)));
-        struct sockaddr_un handler_addr;
-        memset(&handler_addr, 0, sizeof(handler_addr));
-        handler_addr.sun_family = AF_UNIX;
-#define UNIX_MAX_PATH 108  // from the man pages
-        strncpy(handler_addr.sun_path, falcon_process_enforcer_socket,
-                UNIX_MAX_PATH);
-        CHECK(0 == bind(unix_socket, (struct sockaddr *) &handler_addr,
-                        sizeof(handler_addr)));
-        chmod(falcon_process_enforcer_socket, 722);
-        CHECK(0 == listen(unix_socket, 10));
-        fdcb(unix_socket, selread, wrap(mkref(this),
-             &ProcessEnforcer::AcceptProcess, unix_socket));
-
         // Obligatory enforcer business
         logfile_name_ = "/dev/shm/falcon.log";
+        Config::GetFromConfig("generation_lease", &generation_lease_,
+                              (uint32_t) 0);
+        Config::GetFromConfig("enforcer_shards", &shards_, (uint32_t) 1);
+        Config::GetFromConfig("down_deadline_ms", &down_deadline_ms_,
+                              kDefaultDownDeadlineMs);
+        Config::GetFromConfig("replication_socket", &replication_path_,
+                              std::string());
+        Config::GetFromConfig("enforcer_standby", &standby_, false);
+        Config::GetFromConfig("takeover_ms", &takeover_ms_,
+                              kDefaultTakeoverMs);
+        Config::GetFromConfig("standby_port", &standby_port_,
+                              static_cast<uint32_t>(kFalconPort));
+        Config::GetFromConfig("admission_rate", &admission_rate_,
+                              kDefaultAdmissionRate);
+        Config::GetFromConfig("admission_burst", &admission_burst_,
+                              kDefaultAdmissionBurst);
+
+        // The primary owns the process socket
+        if (!standby_) {
+            ListenForProcesses();
+        }
 
         // Initialize our generations
         SetGenVec();
@@ -109,27 +278,114 @@ class ProcessEnforcer : public virtual Enforcer {
         Config::GetFromConfig("confirm_wait_ms", &confirm_wait_ms,
                               (uint32_t) 5);
         Config::GetFromConfig("poll_freq_ms", &poll_freq_ms, (uint32_t) 100);
+        uint32_t min_poll_ms, probe_tick_ms;
+        Config::GetFromConfig("min_poll_ms", &min_poll_ms, (uint32_t) 1);
+        Config::GetFromConfig("probe_tick_ms", &probe_tick_ms, (uint32_t) 1);
         Config::GetFromConfig("cpu_time_wait_multiplier",
                               &cpu_time_wait_multiplier, (int32_t) 1);
+        Config::GetFromConfig("fence_freezer", &fence_freezer, false);
+        Config::GetFromConfig("fence_thaw_ms", &fence_thaw_ms,
+                              (uint32_t) 1000);
 
         confirm_wait_ns = confirm_wait_ms * kMillisecondsToNanoseconds;
         poll_freq_ns = poll_freq_ms * kMillisecondsToNanoseconds;
+        min_poll_ns = min_poll_ms * kMillisecondsToNanoseconds;
+        probe_tick_ns = probe_tick_ms * kMillisecondsToNanoseconds;
+
+        Config::GetFromConfig("split_planes", &split_planes_, true);
+        Config::GetFromConfig("data_plane_cpu", &plane_cpu_, (int32_t) -1);
         return;
     }
 
+    // Runs after the shards fork, so that every shard gets a data plane of
+    // its own
+    virtual void StartThreads() {
+        if (!split_planes_) {
+            probe_timers_ = timers_;
+            tick_timer_ = probe_timers_->NewTimer(
+                wrap(this, &ProcessEnforcer::Tick));
+            return;
+        }
+        probe_timers_ = New refcounted<TimerWheel>(kTimerResolutionNs,
+                                                   false);
+        tick_timer_ = probe_timers_->NewTimer(
+            wrap(this, &ProcessEnforcer::Tick));
+        commands_ = New PlaneQueue<plane_msg>(kPlaneQueueSize);
+        events_ = New PlaneQueue<plane_msg>(kPlaneQueueSize);
+        epoll_fd_ = epoll_create(kMaxPlaneEvents);
+        CHECK(epoll_fd_ >= 0);
+        close_on_exec(epoll_fd_);
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        CHECK(0 == epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, commands_->NotifyFd(),
+                             &ev));
+        fdcb(events_->NotifyFd(), selread,
+             wrap(mkref(this), &ProcessEnforcer::HandleEvents));
+        if (plane_cpu_ < 0) {
+            // Count down from the last CPU, one per shard
+            int32_t cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            plane_cpu_ = cpus - 1 - static_cast<int32_t>(shard_ % cpus);
+        }
+        pthread_t thread;
+        CHECK(0 == pthread_create(&thread, NULL,
+                                  &ProcessEnforcer::DataPlaneMain, this));
+        CHECK(0 == pthread_detach(thread));
+
+        // Stay above everything but the data plane
+        int policy;
+        struct sched_param param;
+        CHECK(0 == pthread_getschedparam(pthread_self(), &policy, &param));
+        if (policy == SCHED_FIFO &&
+            param.sched_priority > sched_get_priority_min(SCHED_FIFO)) {
+            param.sched_priority--;
+            CHECK(0 == pthread_setschedparam(pthread_self(), policy, &param));
+        }
+    }
+
+    virtual void BecomePrimary() {
+        // The old primary is gone, but its socket file is not
+        unlink(falcon_process_enforcer_socket);
+        ListenForProcesses();
+    }
+
+    void ListenForProcesses() {
+        // Set up the UNIX socket
+        int unix_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        CHECK(unix_socket > 0);
+        int tmp = 1;
+        CHECK(0 == setsockopt(unix_socket, SOL_SOCKET, SO_REUSEADDR, &tmp,
+                              sizeof(tmp)));
+        struct sockaddr_un handler_addr;
+        memset(&handler_addr, 0, sizeof(handler_addr));
+        handler_addr.sun_family = AF_UNIX;
+#define UNIX_MAX_PATH 108  // from the man pages
+        strncpy(handler_addr.sun_path, falcon_process_enforcer_socket,
+                UNIX_MAX_PATH);
+        CHECK(0 == bind(unix_socket, (struct sockaddr *) &handler_addr,
+                        sizeof(handler_addr)));
+        chmod(falcon_process_enforcer_socket, 722);
+        CHECK(0 == listen(unix_socket, 10));
+        // Every shard accepts on this socket and passes processes it does
+        // not own to the shard that does
+        make_async(unix_socket);
+        fdcb(unix_socket, selread, wrap(mkref(this),
+             &ProcessEnforcer::AcceptProcess, unix_socket));
+    }
+
     virtual void StartMonitoring(const ref<const str> handle) {
         LOG("START MONITORING %s", handle->cstr());
         Process* p = monitored_[*handle];
         p->active = true;
-        ProbeProcess(p);
+        Post(PLANE_START, p);
         return;
     }
 
     virtual void StopMonitoring(const ref<const str> handle) {
         LOG("STOP MONITORING %s", handle->cstr());
         Process* p = monitored_[*handle];
-        if (p->cb) timecb_remove(p->cb);
-        p->cb = NULL;
+        Post(PLANE_STOP, p);
         p->active = false;
         return;
     }
@@ -143,18 +399,29 @@ class ProcessEnforcer : public virtual Enforcer {
         CHECK(p);
         if (!p->active) return;
         LOG("killing %s", handle->cstr());
-        if (!check_process_table(p->pid)) {
+        if (p->exited || Dead(p->pid)) {
             ObserveDown(handle, p->state, false, false);
         } else if (Killable(handle)) {
+            if (fence_freezer) {
+                Freeze(p);
+            }
             int ret = kill(p->pid, SIGKILL);
             // The following covers the race condition in which the process goes
             // away between our first check and our kill attempt.
             if (ret != 0 && errno == ESRCH) {
+                errno = 0;
+                Thaw(p);
                 ObserveDown(handle, p->state, false, false);
                 return;
             }
-            delaycb(0, confirm_wait_ns, wrap(mkref(this),
-                    &ProcessEnforcer::ConfirmDeath, handle, true, true));
+            LOG("fenced %s (state %u)", handle->cstr(), p->state);
+            p->killed_ns = TimerWheel::Now();
+            if (!p->exit_events) {
+                timers_->Arm(p->confirm_timer, 0, confirm_wait_ns);
+            } else if (!p->frozen_cgroup.empty()) {
+                ArmThaw(p);
+            }
+            ObserveDown(handle, ENF_FENCED, true, true);
         } else {
           ObserveDown(handle, p->state, false, true);
         }
@@ -165,11 +432,60 @@ class ProcessEnforcer : public virtual Enforcer {
         return;
     }
 
+    // A failure shows within a poll period plus the response timeout. The
+    // process picked the latter, so only the period is ours to shorten.
+    virtual uint32_t SetDeadline(const ref<const str> handle,
+                                 uint32_t deadline_ms) {
+        std::map<str, Process*>::iterator it = monitored_.find(*handle);
+        if (it == monitored_.end()) return 0;
+        Process* p = it->second;
+        uint64_t timeout_ns = p->delay_ms * kMillisecondsToNanoseconds;
+        uint64_t period_ns = poll_freq_ns;
+        if (deadline_ms != 0) {
+            uint64_t deadline_ns = deadline_ms * kMillisecondsToNanoseconds;
+            period_ns = (deadline_ns > timeout_ns + min_poll_ns) ?
+                        deadline_ns - timeout_ns : min_poll_ns;
+        }
+        Post(PLANE_PERIOD, p, period_ns);
+        return (period_ns + timeout_ns) / kMillisecondsToNanoseconds;
+    }
+
+    // A process that connected to another shard
+    virtual void ShardMessage(const char* msg, size_t len, int fd) {
+        process_observer_handshake handshake;
+        if (len != sizeof(handshake) || fd < 0) {
+            LOG("bad handshake from another shard");
+            if (fd >= 0) close(fd);
+            return;
+        }
+        memcpy(&handshake, msg, sizeof(handshake));
+        AddProcess(&handshake, fd);
+    }
+
   private:
     std::map<str, timecb_t*> monitored_cb_;
     std::map<str, Process*> monitored_;
     double clck_tick_;
 
+    bool split_planes_;
+    int32_t plane_cpu_;
+    // The data plane's timers; timers_ itself without split_planes_
+    ptr<TimerWheel> probe_timers_;
+    // Control plane to data plane, and back. NULL without split_planes_.
+    PlaneQueue<plane_msg>* commands_;
+    PlaneQueue<plane_msg>* events_;
+    // The data plane waits on the process sockets and commands_ here
+    int epoll_fd_;
+    // What the data plane probes, and the one timer that drives it
+    ProbeSlots<Process> slots_;
+    wheel_timer* tick_timer_;
+    // When tick_timer_ fires next
+    uint64_t next_tick_ns_;
+    bool ticking_;
+    // Scratch space for Tick()
+    std::vector<uint32_t> due_slots_;
+    std::vector<Process*> due_;
+
 //    void Incrementer(int fd) {
 //        char crap;
 //        CHECK(1 == write(fd, &crap, 1));
@@ -204,88 +520,431 @@ class ProcessEnforcer : public virtual Enforcer {
         return (0 == kill(pid, 0));
     }
 
-    void ConfirmDeath(const ref<const str> handle, bool killed,
-                      bool would_kill) {
-        Process* p = monitored_[*handle];
-        CHECK(p);
-        if (!check_process_table(p->pid) || !Killable(handle)) {
-            ObserveDown(handle, p->state, killed, would_kill);
+    // Whether pid will never run again: gone from the process table, or a
+    // zombie, which kill() still finds until its parent reaps it
+    static bool Dead(pid_t pid) {
+        if (!check_process_table(pid)) return true;
+        char state = GetProcState(pid);
+        return (state == 0 || state == 'Z' || state == 'X');
+    }
+
+    static plane_msg Msg(plane_op op, Process* p) {
+        plane_msg m;
+        memset(&m, 0, sizeof(m));
+        m.op = op;
+        m.p = p;
+        return m;
+    }
+
+    // Control plane: hands op on p to the data plane
+    void Post(plane_op op, Process* p, uint64_t period_ns = 0) {
+        plane_msg m = Msg(op, p);
+        m.period_ns = period_ns;
+        Post(m);
+    }
+
+    void Post(const plane_msg& m) {
+        if (commands_) {
+            commands_->Push(m);
+        } else {
+            HandleCommand(m);
+        }
+    }
+
+    // Data plane: tells the control plane about m
+    void Emit(const plane_msg& m) {
+        if (events_) {
+            events_->Push(m);
+        } else {
+            HandleEvent(m);
+        }
+    }
+
+    void HandleEvents() {
+        events_->Acknowledge();
+        plane_msg m;
+        while (events_->Pop(&m)) {
+            HandleEvent(m);
+        }
+    }
+
+    void HandleEvent(const plane_msg& m) {
+        Process* p = m.p;
+        if (p->removed && m.op != PLANE_REMOVED) return;
+        switch (m.op) {
+            case PLANE_UP:
+                ProbeAnswered(p->handle, m.rtt_ns);
+                ProbeLate(p->handle, m.late_ns);
+                ObserveUp(p->handle);
+                break;
+            case PLANE_FAILED:
+                p->state = m.state;
+                ProbeFailed(p->handle);
+                Kill(p->handle);
+                break;
+            case PLANE_EXITED:
+                p->exited = true;
+                p->state = m.state;
+                // Nothing left to confirm
+                timers_->Cancel(p->confirm_timer);
+                if (p->killed_ns) {
+                    KillConfirmed(p);
+                }
+                Kill(p->handle);
+                break;
+            case PLANE_REMOVED:
+                timers_->FreeTimer(p->confirm_timer);
+                UnmapHeartbeat(p);
+                delete p;
+                break;
+            default:
+                CHECK(0);
+        }
+    }
+
+    static void* DataPlaneMain(void* arg) {
+        static_cast<ProcessEnforcer*>(arg)->DataPlane();
+        return NULL;
+    }
+
+    // The data plane's event loop. Never returns.
+    void DataPlane() {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(plane_cpu_, &cpus);
+        if (0 != sched_setaffinity(0, sizeof(cpus), &cpus)) {
+            LOG("cannot pin the data plane to CPU %d: %s", plane_cpu_,
+                strerror(errno));
+        }
+        struct sched_param param;
+        param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+        if (0 != pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+            LOG("data plane runs without SCHED_FIFO");
+        }
+        errno = 0;
+        struct epoll_event ready[kMaxPlaneEvents];
+        for (;;) {
+            int timeout = -1;
+            uint64_t deadline = probe_timers_->Deadline();
+            if (deadline) {
+                uint64_t now = TimerWheel::Now();
+                timeout = (deadline <= now) ? 0 : static_cast<int>(
+                    (deadline - now + kMillisecondsToNanoseconds - 1) /
+                    kMillisecondsToNanoseconds);
+            }
+            int n = epoll_wait(epoll_fd_, ready, kMaxPlaneEvents, timeout);
+            if (n < 0) {
+                CHECK(EINTR == errno);
+                errno = 0;
+                n = 0;
+            }
+            // Commands go last: a removed process may still be in ready
+            bool commands = false;
+            for (int i = 0; i < n; ++i) {
+                plane_watch* w = static_cast<plane_watch*>(ready[i].data.ptr);
+                if (w) {
+                    Ready(w);
+                } else {
+                    commands = true;
+                }
+            }
+            if (commands) {
+                commands_->Acknowledge();
+                plane_msg m;
+                while (commands_->Pop(&m)) {
+                    HandleCommand(m);
+                }
+            }
+            probe_timers_->Poll(TimerWheel::Now());
+        }
+    }
+
+    // Everything from here to ClientAcceptor() runs on the data plane
+
+    void HandleCommand(const plane_msg& m) {
+        Process* p = m.p;
+        switch (m.op) {
+            case PLANE_ADD:
+                slots_.Add(p, &p->slot, p->pid, m.fd);
+                Watch(p);
+                p->pidfd = m.pidfd;
+                if (p->pidfd >= 0) {
+                    AddWatch(p->pidfd, &p->exit_watch, EPOLLIN);
+                }
+                break;
+            case PLANE_START: {
+                p->probing = true;
+                p->late_ns = 0;
+                uint32_t state;
+                uint64_t stamp_ns;
+                if (p->heartbeat) {
+                    // Only beats from now on count
+                    ReadHeartbeat(p->heartbeat, &state, &p->beats, &stamp_ns);
+                }
+                ProbeProcess(p);
+                break;
+            }
+            case PLANE_STOP:
+                p->probing = false;
+                slots_.Disarm(p->slot);
+                break;
+            case PLANE_REMOVE:
+                Unwatch(p);
+                ClosePidfd(p);
+                delete p->stat;
+                p->stat = NULL;
+                slots_.Remove(p->slot);
+                Emit(Msg(PLANE_REMOVED, p));
+                break;
+            case PLANE_PERIOD:
+                p->period_ns = m.period_ns;
+                // A shorter period applies to the probe already waiting
+                if (slots_.Armed(p->slot) &&
+                    (slots_.Action(p->slot) == TIMER_PROBE ||
+                     slots_.Action(p->slot) == TIMER_HEARTBEAT) &&
+                    slots_.Due(p->slot) > TimerWheel::Now() + p->period_ns) {
+                    ArmProbe(p);
+                }
+                break;
+            default:
+                CHECK(0);
+        }
+    }
+
+    void ArmTimer(Process* p, timer_action action, uint32_t s, uint32_t ns) {
+        uint64_t due_ns = TimerWheel::Now() +
+                          static_cast<uint64_t>(s) * kSecondsToNanoseconds + ns;
+        slots_.Arm(p->slot, action, due_ns);
+        if (due_ns < next_tick_ns_) {
+            ScheduleTick(due_ns);
+        }
+    }
+
+    void ArmProbe(Process* p) {
+        ArmTimer(p, p->heartbeat ? TIMER_HEARTBEAT : TIMER_PROBE,
+                 p->period_ns / kSecondsToNanoseconds,
+                 p->period_ns % kSecondsToNanoseconds);
+    }
+
+    void ScheduleTick(uint64_t at_ns) {
+        next_tick_ns_ = at_ns;
+        // Tick() schedules the next one when it is done
+        if (ticking_) return;
+        uint64_t now = TimerWheel::Now();
+        uint64_t delay = (at_ns > now) ? at_ns - now : 0;
+        probe_timers_->Arm(tick_timer_, delay / kSecondsToNanoseconds,
+                           delay % kSecondsToNanoseconds);
+    }
+
+    // Handles every slot that is due in one pass
+    void Tick() {
+        uint64_t now = TimerWheel::Now();
+        ticking_ = true;
+        due_slots_.clear();
+        next_tick_ns_ = slots_.Sweep(now, &due_slots_);
+        // Owners, not slot numbers: handling one may move another
+        due_.resize(due_slots_.size());
+        for (size_t i = 0; i < due_slots_.size(); ++i) {
+            due_[i] = slots_.At(due_slots_[i]);
+        }
+        for (size_t i = 0; i < due_.size(); ++i) {
+            Process* p = due_[i];
+            uint64_t due_ns = slots_.Due(p->slot);
+            if (due_ns > now) continue;
+            slots_.Disarm(p->slot);
+            TimerFired(p, static_cast<timer_action>(slots_.Action(p->slot)),
+                       now - due_ns);
+        }
+        ticking_ = false;
+        if (next_tick_ns_ != ProbeSlots<Process>::kIdle) {
+            ScheduleTick(std::max(next_tick_ns_, now + probe_tick_ns));
+        }
+    }
+
+    // Takes a heartbeat that advanced since the last one as an answer to
+    // the probe; otherwise probes over the socket
+    void CheckHeartbeat(Process* p, uint64_t now) {
+        uint32_t state;
+        uint64_t progress, stamp_ns;
+        if (!ReadHeartbeat(p->heartbeat, &state, &progress, &stamp_ns) ||
+            progress == p->beats) {
+            ProbeProcess(p);
+            return;
+        }
+        p->beats = progress;
+        if (state != PROC_OBS_ALIVE) {
+            Fail(p, state);
+            return;
+        }
+        // The age of the heartbeat stands in for the probe's round trip
+        plane_msg m = Msg(PLANE_UP, p);
+        m.rtt_ns = (now > stamp_ns) ? now - stamp_ns : 0;
+        m.late_ns = p->late_ns;
+        Emit(m);
+        ArmProbe(p);
+    }
+
+    void TimerFired(Process* p, timer_action action, uint64_t late_ns) {
+        switch (action) {
+            case TIMER_PROBE:
+                p->late_ns = late_ns;
+                ProbeProcess(p);
+                break;
+            case TIMER_HEARTBEAT:
+                p->late_ns = late_ns;
+                CheckHeartbeat(p, TimerWheel::Now());
+                break;
+            case TIMER_RESPONSE:
+                ProcessTimeout(p);
+                break;
+            case TIMER_CPU_CHECK:
+                CheckCPUTime(p);
+                break;
+        }
+    }
+
+    void AddWatch(int fd, plane_watch* w, uint32_t events) {
+        if (epoll_fd_ < 0) {
+            fdcb(fd, selread, wrap(mkref(this), &ProcessEnforcer::Ready, w));
+            return;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.ptr = w;
+        CHECK(0 == epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev));
+    }
+
+    void DelWatch(int fd) {
+        if (epoll_fd_ < 0) {
+            fdcb(fd, selread, 0);
         } else {
-            delaycb(0, confirm_wait_ns, wrap(mkref(this),
-                    &ProcessEnforcer::ConfirmDeath, handle, killed,
-                    would_kill));
+            CHECK(0 == epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL));
         }
     }
 
+    void Ready(plane_watch* w) {
+        if (w->kind == WATCH_EXIT) {
+            ProcessExited(w->p);
+        } else {
+            ProcessResponse(w->p);
+        }
+    }
+
+    // Waits for answers and hangups on p's socket
+    void Watch(Process* p) {
+        if (p->watched || slots_.Fd(p->slot) < 0) return;
+        p->watched = true;
+        AddWatch(slots_.Fd(p->slot), &p->socket_watch, EPOLLIN | EPOLLRDHUP);
+    }
+
+    void Unwatch(Process* p) {
+        if (!p->watched) return;
+        p->watched = false;
+        DelWatch(slots_.Fd(p->slot));
+    }
+
+    void ClosePidfd(Process* p) {
+        if (p->pidfd < 0) return;
+        DelWatch(p->pidfd);
+        close(p->pidfd);
+        p->pidfd = -1;
+    }
+
+    // The kernel told us the process is gone, so there is no point in
+    // waiting for its probe to fail
+    void ProcessExited(Process* p) {
+        ClosePidfd(p);
+        slots_.Disarm(p->slot);
+        CloseSocket(p);
+        plane_msg m = Msg(PLANE_EXITED, p);
+        p->probe_state = ENF_EXITED;
+        m.state = ENF_EXITED;
+        Emit(m);
+    }
+
+    void CloseSocket(Process* p) {
+        Unwatch(p);
+        if (slots_.Fd(p->slot) >= 0) {
+            close(slots_.Fd(p->slot));
+            slots_.SetFd(p->slot, -1);
+        }
+    }
+
+    // The probe failed; the control plane decides whether to kill
+    void Fail(Process* p, uint32_t state) {
+        plane_msg m = Msg(PLANE_FAILED, p);
+        p->probe_state = state;
+        m.state = state;
+        Emit(m);
+    }
+
     void ProcessResponse(Process* p) {
         process_observer_reply reply;
         memset(&reply, 0, sizeof(reply));
-        if (p->cb) timecb_remove(p->cb);
-        p->cb = NULL;
+        slots_.Disarm(p->slot);
         if (sizeof(reply) ==
-                recv(p->fd, &reply, sizeof(reply), 0)) {
-            if (!p->active) {
-                fdcb(p->fd, selread, 0);
+                recv(slots_.Fd(p->slot), &reply, sizeof(reply), 0)) {
+            if (!p->probing) {
+                // A late answer; keep watching for hangups
                 return;
             }
             if (reply.state == PROC_OBS_ALIVE) {
-                ObserveUp(p->handle);
-                delaycb(0, poll_freq_ns, wrap(mkref(this),
-                        &ProcessEnforcer::ProbeProcess, p));
+                plane_msg m = Msg(PLANE_UP, p);
+                m.rtt_ns = TimerWheel::Now() - p->probe_ns;
+                m.late_ns = p->late_ns;
+                Emit(m);
+                ArmProbe(p);
                 return;
             } else {
-                p->state = reply.state;
-                Kill(p->handle);
+                Fail(p, reply.state);
                 return;
             }
         }
-        close(p->fd);
-        fdcb(p->fd, selread, 0);
-        Kill(p->handle);
+        CloseSocket(p);
+        Fail(p, p->probe_state);
     }
 
     void ProcessTimeout(Process* p) {
         LOG("Response timeout");
-        p->state = ENF_TIMEDOUT;
-        close(p->fd);
-        fdcb(p->fd, selread, 0);
-        p->cb = NULL;
-        Kill(p->handle);
+        CloseSocket(p);
+        Fail(p, ENF_TIMEDOUT);
     }
 
-    uint32_t GetCPUTime(Process* p) {
-        uint32_t ret;
-        proc_info_p pi = GetProcByPid(p->pid);
-        ret = pi->utime + pi->stime;
-        free(pi);
-        return ret;
+    // CPU time used by p in clock ticks. Fails once p is gone.
+    bool GetCPUTime(Process* p, unsigned long long* ticks) {
+        if (!p->stat) {
+            p->stat = New ProcStatReader(p->pid);
+        }
+        return p->stat->ReadCPUTime(ticks);
     }
 
-    void CheckCPUTime(Process* p, uint32_t start_time) {
-        if (((GetCPUTime(p) - start_time)/clck_tick_) >
+    void CheckCPUTime(Process* p) {
+        unsigned long long ticks;
+        if (!GetCPUTime(p, &ticks)) {
+            CloseSocket(p);
+            Fail(p, ENF_EXITED);
+        } else if (((ticks - p->cpu_start)/clck_tick_) >
             (kMillisecondsToSeconds * p->delay_ms)) {
-            p->state = ENF_CPU_TIMEOUT;
-            close(p->fd);
-            fdcb(p->fd, selread, 0);
-            p->cb = NULL;
-            Kill(p->handle);
+            CloseSocket(p);
+            Fail(p, ENF_CPU_TIMEOUT);
         } else {
             int32_t delay_ms = p->delay_ms * cpu_time_wait_multiplier;
             int32_t delay_s = delay_ms / kSecondsToMilliseconds;
             int32_t delay_ns = (delay_ms%kSecondsToMilliseconds)
                                * kMillisecondsToNanoseconds;
 
-            p->cb = delaycb(delay_s, delay_ns, wrap(mkref(this),
-                            &ProcessEnforcer::CheckCPUTime, p, start_time));
+            ArmTimer(p, TIMER_CPU_CHECK, delay_s, delay_ns);
         }
     }
 
     void ProbeProcess(Process* p) {
-        if (check_process_table(p->pid)) {
+        if (check_process_table(slots_.Pid(p->slot))) {
             process_observer_probe probe;
             memset(&probe, 0, sizeof(probe));
             if (sizeof(probe) ==
-                    send(p->fd, &probe, sizeof(probe), 0)) {
+                    send(slots_.Fd(p->slot), &probe, sizeof(probe), 0)) {
+                p->probe_ns = TimerWheel::Now();
                 // Construct the delay
                 int32_t delay_ms = (p->delay == DELAY_REALTIME) ?
                                    1 :
@@ -296,23 +955,123 @@ class ProcessEnforcer : public virtual Enforcer {
                                    * kMillisecondsToNanoseconds;
 
                 if (p->delay == DELAY_REALTIME) {
-                    p->cb = delaycb(delay_s, delay_ns, wrap(mkref(this),
-                                    &ProcessEnforcer::ProcessTimeout, p));
+                    ArmTimer(p, TIMER_RESPONSE, delay_s, delay_ns);
+                } else if (GetCPUTime(p, &p->cpu_start)) {
+                    ArmTimer(p, TIMER_CPU_CHECK, delay_s, delay_ns);
                 } else {
-                    uint32_t start_time = GetCPUTime(p);
-                    p->cb = delaycb(delay_s, delay_ns, wrap(mkref(this),
-                                    &ProcessEnforcer::CheckCPUTime, p,
-                                    start_time));
+                    CloseSocket(p);
+                    Fail(p, ENF_EXITED);
+                    return;
                 }
-                fdcb(p->fd, selread, wrap(mkref(this),
-                     &ProcessEnforcer::ProcessResponse, p));
+                Watch(p);
                 return;
             }
         }
         LOG("Killing %s", p->handle->cstr());
-        close(p->fd);
-        fdcb(p->fd, selread, 0);
-        Kill(p->handle);
+        CloseSocket(p);
+        Fail(p, p->probe_state);
+    }
+
+    // Back on the control plane
+
+    // Without a pidfd: polls until a process we killed is gone. With one:
+    // runs once, fence_thaw_ms after the kill, to thaw the cgroup.
+    void ConfirmDeath(Process* p) {
+        if (p->exited || Dead(p->pid)) {
+            KillConfirmed(p);
+            return;
+        }
+        if (!p->frozen_cgroup.empty() &&
+            TimerWheel::Now() - p->killed_ns >=
+                static_cast<uint64_t>(fence_thaw_ms) *
+                kMillisecondsToNanoseconds) {
+            LOG("%s still there %u ms after it was fenced, thawing %s",
+                p->handle->cstr(), fence_thaw_ms, p->frozen_cgroup.c_str());
+            Thaw(p);
+        }
+        if (!p->exit_events) {
+            timers_->Arm(p->confirm_timer, 0, confirm_wait_ns);
+        }
+    }
+
+    void ArmThaw(Process* p) {
+        timers_->Arm(p->confirm_timer, fence_thaw_ms / kSecondsToMilliseconds,
+                     (fence_thaw_ms % kSecondsToMilliseconds) *
+                     kMillisecondsToNanoseconds);
+    }
+
+    void KillConfirmed(Process* p) {
+        LOG("%s is gone %llu us after it was fenced", p->handle->cstr(),
+            static_cast<unsigned long long>(
+                (TimerWheel::Now() - p->killed_ns) /
+                kMicrosecondsToNanoseconds));
+        p->killed_ns = 0;
+        Thaw(p);
+    }
+
+    // The process's cgroup v2 directory, or "" if it is the root, our own
+    // cgroup or one of its ancestors (or we cannot tell), which we must not
+    // freeze
+    static std::string CgroupOf(pid_t pid) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+        std::string mine, theirs;
+        FILE* f = fopen(path, "r");
+        FILE* self = fopen("/proc/self/cgroup", "r");
+        char line[512];
+        while (f && fgets(line, sizeof(line), f)) {
+            if (0 == strncmp(line, "0::", 3)) theirs = line + 3;
+        }
+        while (self && fgets(line, sizeof(line), self)) {
+            if (0 == strncmp(line, "0::", 3)) mine = line + 3;
+        }
+        if (f) fclose(f);
+        if (self) fclose(self);
+        errno = 0;
+        // Drop the newlines
+        if (!theirs.empty() && theirs[theirs.size() - 1] == '\n') {
+            theirs.erase(theirs.size() - 1);
+        }
+        if (!mine.empty() && mine[mine.size() - 1] == '\n') {
+            mine.erase(mine.size() - 1);
+        }
+        if (theirs.empty() || theirs == "/" || mine.empty()) {
+            return std::string();
+        }
+        // Freezing an ancestor of ours would freeze us
+        if (0 == mine.compare(0, theirs.size(), theirs) &&
+            (mine.size() == theirs.size() || mine[theirs.size()] == '/')) {
+            return std::string();
+        }
+        return "/sys/fs/cgroup" + theirs;
+    }
+
+    static bool WriteFreeze(const std::string& cgroup, char value) {
+        std::string path = cgroup + "/cgroup.freeze";
+        int fd = open(path.c_str(), O_WRONLY);
+        bool ok = (fd >= 0 && 1 == write(fd, &value, 1));
+        if (fd >= 0) close(fd);
+        errno = 0;
+        return ok;
+    }
+
+    // Stops everything in the process's cgroup, including any helpers it
+    // forked, until the process is gone. SIGKILL still gets through to a
+    // frozen process.
+    void Freeze(Process* p) {
+        std::string cgroup = CgroupOf(p->pid);
+        if (cgroup.empty()) return;
+        if (WriteFreeze(cgroup, '1')) {
+            p->frozen_cgroup = cgroup;
+        } else {
+            LOG("cannot freeze %s", cgroup.c_str());
+        }
+    }
+
+    void Thaw(Process* p) {
+        if (p->frozen_cgroup.empty()) return;
+        WriteFreeze(p->frozen_cgroup, '0');
+        p->frozen_cgroup.clear();
     }
 
     void ClientAcceptor(int fd) {
@@ -320,40 +1079,129 @@ class ProcessEnforcer : public virtual Enforcer {
         // TODO(leners): Can short messages be broken up on unix pipes?
         if (sizeof(handshake) ==
                 recv(fd, &handshake, sizeof(handshake), 0)) {
-            if (monitored_[handshake.handle]) {
-                // What happens next is not entirely correct. The process that
-                // we are monitoring could have died and another process took
-                // it's pid. There is a way to check for this, assuming the
-                // handle is always part of the procfile, but we're not doing
-                // this right now.
-                Process* current = monitored_[handshake.handle];
-                if (!current->active &&
-                    !check_process_table(current->pid)) {
-                    LOG("replacing dead process %s", handshake.handle);
-                    delete current;
-                    Process* p = New Process(&handshake, fd);
-                    LOG("%d is the delay_ms", p->delay_ms);
-                    monitored_[*(p->handle)] = p;
-                } else {
-                    LOG("process %s exists and is active", handshake.handle);
-                    close(fd);
-                    fdcb(fd, selread, 0);
-                }
-            } else {
-                Process* p = New Process(&handshake, fd);
-                LOG("%d is the delay_ms, %s is the delay type", p->delay_ms,
-                    (p->delay == DELAY_REALTIME) ? "real time" : "cpu time");
-                monitored_[*(p->handle)] = p;
+            fdcb(fd, selread, 0);
+            handshake.handle[sizeof(handshake.handle) - 1] = '\0';
+            str handle(handshake.handle);
+            if (!OwnsTarget(handle)) {
+                SendToShard(ShardOf(handle, shards_), &handshake,
+                            sizeof(handshake), fd);
+                return;
             }
+            AddProcess(&handshake, fd);
         } else {
             close(fd);
             fdcb(fd, selread, 0);
         }
     }
 
+    // Starts tracking a process that connected on fd
+    void AddProcess(const process_observer_handshake* h, int fd) {
+        Process* current = monitored_[h->handle];
+        if (current) {
+            // What happens next is not entirely correct. The process that
+            // we are monitoring could have died and another process took
+            // it's pid. There is a way to check for this, assuming the
+            // handle is always part of the procfile, but we're not doing
+            // this right now.
+            if (!current->active && Dead(current->pid)) {
+                LOG("replacing dead process %s", h->handle);
+                current->removed = true;
+                timers_->Cancel(current->confirm_timer);
+                Thaw(current);
+                Post(PLANE_REMOVE, current);
+                Process* p = NewProcess(h, fd);
+                LOG("%d is the delay_ms", p->delay_ms);
+                monitored_[*(p->handle)] = p;
+                TargetAvailable(p->handle);
+            } else {
+                LOG("process %s exists and is active", h->handle);
+                close(fd);
+                fdcb(fd, selread, 0);
+            }
+        } else {
+            Process* p = NewProcess(h, fd);
+            LOG("%d is the delay_ms, %s is the delay type", p->delay_ms,
+                (p->delay == DELAY_REALTIME) ? "real time" : "cpu time");
+            monitored_[*(p->handle)] = p;
+            TargetAvailable(p->handle);
+        }
+    }
+
+    Process* NewProcess(const process_observer_handshake* h, int fd) {
+        Process* p = New Process(h);
+        p->heartbeat = MapHeartbeat(p->pid);
+        p->confirm_timer = timers_->NewTimer(wrap(mkref(this),
+                                             &ProcessEnforcer::ConfirmDeath,
+                                             p));
+        plane_msg m = Msg(PLANE_ADD, p);
+        m.fd = fd;
+        m.pidfd = PidfdOpen(p->pid);
+        if (m.pidfd < 0) {
+            // An old kernel; hangups and probes will do
+            errno = 0;
+        }
+        p->exit_events = (m.pidfd >= 0);
+        Post(m);
+        return p;
+    }
+
+    // The page of a process that publishes heartbeats, or NULL. Pages are
+    // found by pid, so the process has to create its page before it
+    // connects.
+    static const process_observer_heartbeat* MapHeartbeat(pid_t pid) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s%d", falcon_process_heartbeat_prefix,
+                 pid);
+        int fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0) {
+            errno = 0;
+            return NULL;
+        }
+        struct stat st;
+        void* page = MAP_FAILED;
+        // A short page would fault on reading
+        if (0 == fstat(fd, &st) &&
+            st.st_size >= static_cast<off_t>(
+                sizeof(process_observer_heartbeat))) {
+            page = mmap(NULL, sizeof(process_observer_heartbeat), PROT_READ,
+                        MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (page == MAP_FAILED) {
+            errno = 0;
+            return NULL;
+        }
+        const process_observer_heartbeat* hb =
+            static_cast<const process_observer_heartbeat*>(page);
+        if (hb->magic != kHeartbeatMagic ||
+            hb->pid != static_cast<uint32_t>(pid)) {
+            munmap(page, sizeof(process_observer_heartbeat));
+            return NULL;
+        }
+        LOG("%d publishes heartbeats", pid);
+        return hb;
+    }
+
+    // The process is gone, and so is its page
+    static void UnmapHeartbeat(Process* p) {
+        if (!p->heartbeat) return;
+        munmap(const_cast<process_observer_heartbeat*>(p->heartbeat),
+               sizeof(process_observer_heartbeat));
+        p->heartbeat = NULL;
+        char name[64];
+        snprintf(name, sizeof(name), "%s%d", falcon_process_heartbeat_prefix,
+                 p->pid);
+        shm_unlink(name);
+    }
+
     void AcceptProcess(int fd) {
         int newfd = accept(fd, NULL, NULL);
-        CHECK(newfd >= 0);
+        if (newfd < 0) {
+            // Another shard got it
+            CHECK(EAGAIN == errno || EWOULDBLOCK == errno);
+            errno = 0;
+            return;
+        }
         fdcb(newfd, selread, wrap(mkref(this),
              &ProcessEnforcer::ClientAcceptor, newfd));
     }
@@ -16,11 +16,14 @@
  */
 #include "process_spy/process_observer.h"
 
+#include <fcntl.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 namespace {
@@ -29,6 +32,72 @@ spyfunc_f Spy;
 uint32_t delay_ms_ = kDefaultDelay_ms;
 delay_type delay_;
 char* handle_ = NULL;
+// Zero unless EnableHeartbeat was called
+uint32_t heartbeat_ms_ = 0;
+process_observer_heartbeat* heartbeat_ = NULL;
+// Both threads call Spy()
+pthread_mutex_t spy_lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t
+CallSpy() {
+    pthread_mutex_lock(&spy_lock_);
+    uint32_t state = Spy();
+    pthread_mutex_unlock(&spy_lock_);
+    return state;
+}
+
+void *
+HeartbeatThread(void *) {
+    for (;;) {
+        uint32_t state = CallSpy();
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        PublishHeartbeat(heartbeat_, state,
+                         ts.tv_sec * kSecondsToNanoseconds + ts.tv_nsec);
+        usleep(heartbeat_ms_ * kMillisecondsToMicroseconds);
+    }
+    return NULL;
+}
+
+void
+HeartbeatName(char* name, size_t len) {
+    snprintf(name, len, "%s%d", falcon_process_heartbeat_prefix, getpid());
+}
+
+void
+UnlinkHeartbeat() {
+    char name[64];
+    HeartbeatName(name, sizeof(name));
+    shm_unlink(name);
+}
+
+// Creates and maps our page. Without one we only answer socket probes.
+bool
+MapHeartbeat() {
+    char name[64];
+    HeartbeatName(name, sizeof(name));
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    if (0 != ftruncate(fd, sizeof(process_observer_heartbeat))) {
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    void* page = mmap(NULL, sizeof(process_observer_heartbeat),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        shm_unlink(name);
+        return false;
+    }
+    heartbeat_ = static_cast<process_observer_heartbeat*>(page);
+    heartbeat_->pid = getpid();
+    // The spy ignores the page until the magic shows up
+    __sync_synchronize();
+    heartbeat_->magic = kHeartbeatMagic;
+    atexit(UnlinkHeartbeat);
+    return true;
+}
 
 void *
 SpyThread(void *) {
@@ -45,8 +114,13 @@ SpyThread(void *) {
     for (;;) {
         int handlerd_socket = socket(AF_UNIX, SOCK_STREAM, 0);
         CHECK(handlerd_socket > 0);
-        CHECK(0 == connect(handlerd_socket, (struct sockaddr *) &addr,
-                           sizeof(addr)));
+        if (0 != connect(handlerd_socket, (struct sockaddr *) &addr,
+                         sizeof(addr))) {
+            // The spy is restarting, or its standby is taking over
+            close(handlerd_socket);
+            usleep(delay_ms_ * kMillisecondsToMicroseconds);
+            continue;
+        }
         CHECK(sizeof(handshake) == send(handlerd_socket, &handshake,
                                         sizeof(handshake), 0));
         struct process_observer_probe probe;
@@ -54,7 +128,7 @@ SpyThread(void *) {
             if (sizeof(probe) !=
                     recv(handlerd_socket, &probe, sizeof(probe), 0)) break;
             struct process_observer_reply reply;
-            reply.state = Spy();
+            reply.state = CallSpy();
             if (sizeof(reply) !=
                     send(handlerd_socket, &reply, sizeof(reply), 0)) break;
         }
@@ -76,10 +150,19 @@ SetSpy(spyfunc_f spy, const char *handle, delay_type delay, uint32_t delay_ms) {
     delay_ms_ = delay_ms;
     handle_ = strndup(handle, kHandleSize);
     pthread_t thread;
+    // The page has to exist before the handshake, when the spy looks for it
+    if (heartbeat_ms_ && MapHeartbeat()) {
+        CHECK(0 == pthread_create(&thread, NULL, HeartbeatThread, NULL));
+    }
     CHECK(0 == pthread_create(&thread, NULL, SpyThread, NULL));
     return;
 }
 
+void
+EnableHeartbeat(uint32_t period_ms) {
+    heartbeat_ms_ = period_ms ? period_ms : 1;
+}
+
 void
 SetHandle(const char * handle) {
     CHECK(0 == prctl(PR_SET_NAME, handle, NULL, NULL));
@@ -27,4 +27,10 @@ void SetHandle(const char *handle);
 void SetSpy(spyfunc_f, const char *handle);
 void SetSpy(spyfunc_f, const char *handle, delay_type delay, uint32_t delay_ms);
 
+// Publishes the spy function's answer every period_ms to a shared memory
+// page, which the process spy reads instead of probing over its socket. It
+// still probes over the socket when the page stops advancing, so the spy
+// function is called from two threads (never at once). Call before SetSpy.
+void EnableHeartbeat(uint32_t period_ms);
+
 #endif  // _NTFA_SPIES_APPLICATION_SPY_H_
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2011 Joshua B. Leners (University of Texas at Austin).
+ * All rights reserved.
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Texas at Austin. The name of the
+ * University may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+// Compares the old and new ways of reading a process's CPU time from
+// /proc/pid/stat. "getprocbypid" is GetProcByPid(), which the CPU-time delay
+// mode used on every probe: fopen, fgets, a 44-field sscanf and a malloc.
+// "reader" is ProcStatReader::ReadCPUTime() on a file kept open. "parsestat"
+// and "scan" time ParseStat() and ScanStatFields() alone on the same line.
+// Every mode reads this process's own stat file.
+//
+// usage: stat_bench [iterations]
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "process_spy/parse_proc.h"
+
+namespace {
+
+// Keeps the compiler from dropping the work
+volatile unsigned long long sink;
+
+double
+Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + kNanosecondsToSeconds * ts.tv_nsec;
+}
+
+void
+Report(const char* mode, int iterations, double start) {
+    printf("mode=%s iterations=%d ns_per_op=%.1f\n", mode, iterations,
+           1e9 * (Now() - start) / iterations);
+}
+
+// Both parsers must agree, and the scanner must survive a command name
+// that sscanf's %s cannot
+void
+CheckScanner(const char* line) {
+    proc_info_s info;
+    ParseStat(line, &info);
+    const int fields[] = {kStatUtime, kStatStime};
+    unsigned long long values[2];
+    CHECK(ScanStatFields(line, strlen(line), fields, 2, values));
+    CHECK(values[0] == info.utime && values[1] == info.stime);
+
+    const char* odd = "42 (a) b (c) ) R 1 42 42 0 -1 4194560 1 0 0 0 "
+                      "17 23 0 0 20 0 1 0 1 1 1 1 1 1 1 1 0 0 0 0 0 0 0 "
+                      "17 0 0 0 0 0 0\n";
+    CHECK(ScanStatFields(odd, strlen(odd), fields, 2, values));
+    CHECK(values[0] == 17 && values[1] == 23);
+}
+
+}  // end anonymous namespace
+
+int
+main(int argc, char** argv) {
+    int iterations = (argc > 1) ? atoi(argv[1]) : 200000;
+    pid_t pid = getpid();
+
+    char path[64];
+    char line[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* f = fopen(path, "r");
+    CHECK(f && fgets(line, sizeof(line), f));
+    fclose(f);
+    CheckScanner(line);
+
+    double start = Now();
+    for (int i = 0; i < iterations; ++i) {
+        proc_info_p pi = GetProcByPid(pid);
+        sink += pi->utime + pi->stime;
+        free(pi);
+    }
+    Report("getprocbypid", iterations, start);
+
+    ProcStatReader reader(pid);
+    CHECK(reader.Valid());
+    start = Now();
+    for (int i = 0; i < iterations; ++i) {
+        unsigned long long ticks;
+        CHECK(reader.ReadCPUTime(&ticks));
+        sink += ticks;
+    }
+    Report("reader", iterations, start);
+
+    start = Now();
+    for (int i = 0; i < iterations; ++i) {
+        proc_info_s info;
+        ParseStat(line, &info);
+        sink += info.utime + info.stime;
+    }
+    Report("parsestat", iterations, start);
+
+    const int fields[] = {kStatUtime, kStatStime};
+    size_t len = strlen(line);
+    start = Now();
+    for (int i = 0; i < iterations; ++i) {
+        unsigned long long values[2];
+        ScanStatFields(line, len, fields, 2, values);
+        sink += values[0] + values[1];
+    }
+    Report("scan", iterations, start);
+    return EXIT_SUCCESS;
+}
@@ -38,6 +38,11 @@ const uint32_t  kVMMCheck_ms = 100;
 const uint32_t  kVMMResp_us = 20000;
 const uint32_t  kVMMRetry = 5;
 const int32_t   kMaxPollPeriod_ms = 6000;
+// Shortest counter check period a detection deadline can ask for
+const uint64_t  kMinCheck_ns = 1000 * 1000;
+// fsync on /jffs costs tens of milliseconds and wears the flash, so reserve
+// generations in blocks.
+const uint32_t  kGenerationLease = 64;
 
 uint32_t max_vmm_retry_ = 0;
 uint32_t vmm_check_ns_ = 0;
@@ -56,7 +61,11 @@ class VMM : public virtual refcount {
     VMM(ref<str> h, ref<str> v, uint32_t i, uint32_t p, ref<aclnt> c,
         timespec n) :
          handle(h), vlan_id(v), ipaddr(i), switch_port(p), clnt(c),
-         monitored(false), last_query(n), count(0) {}
+         monitored(false), last_query(n), count(0), timer(NULL),
+         check_s(vmm_check_s_), check_ns(vmm_check_ns_),
+         probing(false), retries(0), rx_bytes(0),
+         last_msg(New refcounted<obs_probe_msg>()),
+         probe_cb(New refcounted<rpccb_unreliable*>()) {}
     ref<str>    handle;
     // Use vlan_id for counting packets against netstat.
     ref<str>    vlan_id;
@@ -66,6 +75,18 @@ class VMM : public virtual refcount {
     bool        monitored;
     timespec    last_query;
     uint64_t    count;
+
+    // When timer fires it retransmits the outstanding probe if probing is
+    // set and checks the interface counters (against rx_bytes) otherwise.
+    // Counters are checked every check_s/check_ns.
+    wheel_timer*                timer;
+    uint32_t                    check_s;
+    uint32_t                    check_ns;
+    bool                        probing;
+    uint32_t                    retries;
+    unsigned long               rx_bytes;
+    ref<obs_probe_msg>          last_msg;
+    ref<rpccb_unreliable*>      probe_cb;
 };
 
 class VMMEnforcer : public virtual Enforcer {
@@ -110,16 +131,41 @@ class VMMEnforcer : public virtual Enforcer {
         Config::GetFromConfig("vmm_obs_probe_port", &vmm_obs_probe_port_,
                               kDefaultVMMProbePort);
 
-        // start server
+        logfile_name_ = "/jffs/falcon.gen";
+        Config::GetFromConfig("generation_lease", &generation_lease_,
+                              kGenerationLease);
+        Config::GetFromConfig("down_deadline_ms", &down_deadline_ms_,
+                              kDefaultDownDeadlineMs);
+        Config::GetFromConfig("replication_socket", &replication_path_,
+                              std::string());
+        Config::GetFromConfig("enforcer_standby", &standby_, false);
+        Config::GetFromConfig("takeover_ms", &takeover_ms_,
+                              kDefaultTakeoverMs);
+        Config::GetFromConfig("standby_port", &standby_port_,
+                              static_cast<uint32_t>(kFalconPort));
+        Config::GetFromConfig("admission_rate", &admission_rate_,
+                              kDefaultAdmissionRate);
+        Config::GetFromConfig("admission_burst", &admission_burst_,
+                              kDefaultAdmissionBurst);
+
+        // The primary owns the observer port
+        if (!standby_) {
+            StartObserverServer();
+        }
+        return;
+    }
+
+    virtual void BecomePrimary() {
+        StartObserverServer();
+    }
+
+    void StartObserverServer() {
         int fd = inetsocket(SOCK_DGRAM, vmm_obs_probe_port_, INADDR_ANY);
         CHECK(fd > 0);
         make_async(fd);
         close_on_exec(fd);
         obs_srv_ = asrv::alloc(axprt_dgram::alloc(fd), vmm_obs_prog_1);
         obs_srv_->setcb(wrap(mkref(this), &VMMEnforcer::ObserverDispatch));
-
-        logfile_name_ = "/jffs/falcon.gen";
-        return;
     }
 
     virtual void StartMonitoring(const ref<const str> handle) {
@@ -141,6 +187,7 @@ class VMMEnforcer : public virtual Enforcer {
         if (target->monitored) {
             LOG("STOP MONITORING %s", handle->cstr());
             target->monitored = false;
+            timers_->Cancel(target->timer);
         }
         return;
     }
@@ -161,6 +208,26 @@ class VMMEnforcer : public virtual Enforcer {
         return;
     }
 
+    // A failure shows within a counter check period plus the time a probe
+    // gets to be answered, retransmissions included. Only the period is
+    // tuned per VMM.
+    virtual uint32_t SetDeadline(const ref<const str> handle,
+                                 uint32_t deadline_ms) {
+        ptr<VMM> vmm = monitored_vmms_[*handle];
+        if (!vmm) return 0;
+        uint64_t timeout_ns = vmm_to_s_ * kSecondsToNanoseconds + vmm_to_ns_;
+        uint64_t check_ns = vmm_check_s_ * kSecondsToNanoseconds +
+                            vmm_check_ns_;
+        if (deadline_ms != 0) {
+            uint64_t deadline_ns = deadline_ms * kMillisecondsToNanoseconds;
+            check_ns = (deadline_ns > timeout_ns + kMinCheck_ns) ?
+                       deadline_ns - timeout_ns : kMinCheck_ns;
+        }
+        vmm->check_s = check_ns / kSecondsToNanoseconds;
+        vmm->check_ns = check_ns % kSecondsToNanoseconds;
+        return (check_ns + timeout_ns) / kMillisecondsToNanoseconds;
+    }
+
 
   private:
     void ObserverDispatch(svccb *sbp) {
@@ -199,11 +266,15 @@ class VMMEnforcer : public virtual Enforcer {
                 int32_t switch_port = get_port_from_ip(ipaddr);
                 ref<str> vlan_id =
                     New refcounted<str>(get_vlan_from_port(switch_port));
-                ptr<VMM> new_vmm = New refcounted<VMM>(handle, vlan_id, ipaddr,
+                ref<VMM> new_vmm = New refcounted<VMM>(handle, vlan_id, ipaddr,
                                                        switch_port, clnt, now);
+                new_vmm->timer = timers_->NewTimer(wrap(mkref(this),
+                                     &VMMEnforcer::TimerFired, new_vmm));
                 ptr<VMM> old_vmm = monitored_vmms_[*(new_vmm->handle)];
                 if (old_vmm) {
                     old_vmm->monitored = false;
+                    timers_->FreeTimer(old_vmm->timer);
+                    old_vmm->timer = NULL;
                 }
                 monitored_vmms_[*(new_vmm->handle)] = new_vmm;
                 obs_register_response r;
@@ -232,12 +303,23 @@ class VMMEnforcer : public virtual Enforcer {
         return;
     }
 
-    void Retry(ref<VMM> vmm, ref<rpccb_unreliable *> cb, uint32_t retries) {
-        if (vmm->monitored && *cb && retries < kVMMRetry) {
+    void TimerFired(ref<VMM> vmm) {
+        if (!vmm->monitored) return;
+        if (vmm->probing) {
+            Retry(vmm);
+        } else {
+            MonitorAction(vmm->handle, vmm->rx_bytes, vmm->last_msg,
+                          vmm->probe_cb, RPC_SUCCESS);
+        }
+    }
+
+    void Retry(ref<VMM> vmm) {
+        ref<rpccb_unreliable *> cb = vmm->probe_cb;
+        if (*cb && vmm->retries < kVMMRetry) {
             LOG("retrying %s", vmm->handle->cstr());
-            (*cb)->xmit(retries + 1);
-            delaycb(vmm_resp_s_, vmm_resp_ns_, wrap(mkref(this),
-                    &VMMEnforcer::Retry, vmm, cb, retries + 1));
+            vmm->retries++;
+            (*cb)->xmit(vmm->retries);
+            timers_->Arm(vmm->timer, vmm_resp_s_, vmm_resp_ns_);
         }
     }
 
@@ -256,6 +338,7 @@ class VMMEnforcer : public virtual Enforcer {
         //     (b) Send a probe for good measure
         if (st == RPC_TIMEDOUT) {
             LOG("Timedout");
+            ProbeFailed(handle);
             bool killable = Killable(handle);
             if (killable) Kill(handle);
             *old_cb = NULL;
@@ -269,12 +352,18 @@ class VMMEnforcer : public virtual Enforcer {
 
             // Acknowledge the up, clear the clnt.
             CHECK(st == RPC_SUCCESS);
+            timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            if (*old_cb) {
+                // An answered probe rather than the check timer
+                ProbeAnswered(handle, static_cast<uint64_t>(
+                    TimespecDiff(&now, &vmm->last_query) *
+                    kSecondsToNanoseconds));
+            }
             ObserveUp(handle);
             *old_cb = NULL;
 
             unsigned long new_rx_bytes = GetRXBytes(handle);
-            timespec now;
-            clock_gettime(CLOCK_REALTIME, &now);
             // If it's been a while since the last probe or we haven't seen
             // any network activity, send a probe
             if (TimespecDiff(&now, &vmm->last_query) > max_poll_period_ ||
@@ -293,13 +382,17 @@ class VMMEnforcer : public virtual Enforcer {
                                            &VMMEnforcer::MonitorAction, handle,
                                            new_rx_bytes, res, cb)));
                 *cb = rcb;
-                delaycb(vmm_resp_s_, vmm_resp_ns_, wrap(mkref(this),
-                        &VMMEnforcer::Retry, vmm, cb, 0));
+                vmm->probing = true;
+                vmm->retries = 0;
+                vmm->probe_cb = cb;
+                timers_->Arm(vmm->timer, vmm_resp_s_, vmm_resp_ns_);
                 clock_gettime(CLOCK_REALTIME, &vmm->last_query);
             } else {
-                delaycb(vmm_check_s_, vmm_check_ns_,
-                        wrap(mkref(this), &VMMEnforcer::MonitorAction,
-                             handle, new_rx_bytes, msg, old_cb, RPC_SUCCESS));
+                vmm->probing = false;
+                vmm->rx_bytes = new_rx_bytes;
+                vmm->last_msg = msg;
+                vmm->probe_cb = old_cb;
+                timers_->Arm(vmm->timer, vmm->check_s, vmm->check_ns);
             }
         }
         return;